@@ -0,0 +1,285 @@
+//
+// Asynchronous requests. A fixed pool of workers runs submitted batches with
+// rsubmit and posts each finished batch to a completion queue, which the
+// caller polls, waits on, or watches through an eventfd from its event loop.
+//
+// Every worker has its own queue and submissions are spread over the queues
+// round robin; a worker whose queue is empty takes work from the others, so
+// one long batch does not hold up the requests queued behind it.
+//
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "ramfs.h"
+
+//one submitted batch, queued and then completed
+typedef struct aio_task {
+    RamfsSubmission *ops;
+    int count;
+    void *user_data;
+    int result; //returned by rsubmit
+    struct aio_task *next;
+} AioTask;
+
+//queue of one worker, others take from it when theirs is empty
+typedef struct aio_queue {
+    pthread_mutex_t lock;
+    AioTask *head;
+    AioTask *tail;
+} AioQueue;
+
+typedef struct aio_worker {
+    pthread_t thread;
+    struct ramfs_aio *aio;
+    int id;
+} AioWorker;
+
+struct ramfs_aio {
+    Ramfs *fs; //file system the batches run on
+    int worker_count;
+    int started; //workers running, fewer than worker_count only if raio_create failed
+    AioWorker *workers;
+    AioQueue *queues; //one per worker
+    atomic_uint next_queue; //round robin position of submit
+    atomic_int pending; //tasks queued and not yet taken
+    pthread_mutex_t idle_lock; //idle workers sleep on idle until pending or stopping
+    pthread_cond_t idle;
+    int stopping;
+    //completion queue, the eventfd is readable exactly while it is not empty
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;
+    AioTask *done_head;
+    AioTask *done_tail;
+    int event_fd;
+};
+
+static void queue_push(AioQueue *queue, AioTask *task) {
+    task->next = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail != NULL) {
+        queue->tail->next = task;
+    } else {
+        queue->head = task;
+    }
+    queue->tail = task;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static AioTask *queue_pop(AioQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    AioTask *task = queue->head;
+    if (task != NULL) {
+        queue->head = task->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+//next task for worker id: its own queue first, then the others in turn
+static AioTask *take(RamfsAio *aio, int id) {
+    for (int i = 0; i < aio->worker_count; i++) {
+        AioTask *task = queue_pop(&aio->queues[(id + i) % aio->worker_count]);
+        if (task != NULL) {
+            atomic_fetch_sub(&aio->pending, 1);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void complete(RamfsAio *aio, AioTask *task) {
+    task->next = NULL;
+    pthread_mutex_lock(&aio->done_lock);
+    if (aio->done_tail != NULL) {
+        aio->done_tail->next = task;
+    } else {
+        aio->done_head = task;
+        //only the change to non-empty is counted, so the counter never overflows
+        uint64_t one = 1;
+        ssize_t written = write(aio->event_fd, &one, sizeof(one));
+        (void) written;
+    }
+    aio->done_tail = task;
+    pthread_cond_broadcast(&aio->done_cond);
+    pthread_mutex_unlock(&aio->done_lock);
+}
+
+static void *worker_main(void *arg) {
+    AioWorker *worker = (AioWorker *) arg;
+    RamfsAio *aio = worker->aio;
+    for (;;) {
+        AioTask *task = take(aio, worker->id);
+        if (task != NULL) {
+            task->result = rfs_submit(aio->fs, task->ops, task->count);
+            complete(aio, task);
+            continue;
+        }
+        pthread_mutex_lock(&aio->idle_lock);
+        while (atomic_load(&aio->pending) == 0 && !aio->stopping) {
+            pthread_cond_wait(&aio->idle, &aio->idle_lock);
+        }
+        //queued work still runs when stopping
+        int stop = aio->stopping && atomic_load(&aio->pending) == 0;
+        pthread_mutex_unlock(&aio->idle_lock);
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+RamfsAio *raio_create(int workers) {
+    return rfs_aio_create(ramfs_default(), workers);
+}
+
+RamfsAio *rfs_aio_create(Ramfs *fs, int workers) {
+    if (fs == NULL || workers < 1 || workers > RAMFS_AIO_MAX_WORKERS) {
+        return NULL;
+    }
+    RamfsAio *aio = (RamfsAio *) calloc(1, sizeof(RamfsAio));
+    if (aio == NULL) {
+        return NULL;
+    }
+    aio->workers = (AioWorker *) calloc(workers, sizeof(AioWorker));
+    aio->queues = (AioQueue *) calloc(workers, sizeof(AioQueue));
+    aio->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (aio->workers == NULL || aio->queues == NULL || aio->event_fd == -1) {
+        if (aio->event_fd != -1) {
+            close(aio->event_fd);
+        }
+        free(aio->workers);
+        free(aio->queues);
+        free(aio);
+        return NULL;
+    }
+    aio->fs = fs;
+    atomic_init(&aio->next_queue, 0);
+    atomic_init(&aio->pending, 0);
+    pthread_mutex_init(&aio->idle_lock, NULL);
+    pthread_cond_init(&aio->idle, NULL);
+    pthread_mutex_init(&aio->done_lock, NULL);
+    pthread_cond_init(&aio->done_cond, NULL);
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_init(&aio->queues[i].lock, NULL);
+    }
+    aio->worker_count = workers;
+    for (int i = 0; i < workers; i++) {
+        aio->workers[i].aio = aio;
+        aio->workers[i].id = i;
+        if (pthread_create(&aio->workers[i].thread, NULL, worker_main, &aio->workers[i]) != 0) {
+            //the workers started so far stop again
+            raio_destroy(aio);
+            return NULL;
+        }
+        aio->started++;
+    }
+    return aio;
+}
+
+int raio_submit(RamfsAio *aio, RamfsSubmission *ops, int count, void *user_data) {
+    if (aio == NULL || count < 0 || (ops == NULL && count > 0)) {
+        return -1;
+    }
+    AioTask *task = (AioTask *) malloc(sizeof(AioTask));
+    if (task == NULL) {
+        return -1;
+    }
+    task->ops = ops;
+    task->count = count;
+    task->user_data = user_data;
+    task->result = 0;
+    unsigned index = atomic_fetch_add(&aio->next_queue, 1) % (unsigned) aio->worker_count;
+    queue_push(&aio->queues[index], task);
+    //counted under the idle lock, so a worker about to sleep sees it
+    pthread_mutex_lock(&aio->idle_lock);
+    atomic_fetch_add(&aio->pending, 1);
+    pthread_cond_signal(&aio->idle);
+    pthread_mutex_unlock(&aio->idle_lock);
+    return 0;
+}
+
+//move up to max finished batches into completions, caller holds the done lock
+static int drain(RamfsAio *aio, RamfsCompletion *completions, int max) {
+    int n = 0;
+    while (n < max && aio->done_head != NULL) {
+        AioTask *task = aio->done_head;
+        aio->done_head = task->next;
+        completions[n].user_data = task->user_data;
+        completions[n].ops = task->ops;
+        completions[n].count = task->count;
+        completions[n].result = task->result;
+        free(task);
+        n++;
+    }
+    if (aio->done_head == NULL) {
+        aio->done_tail = NULL;
+        if (n > 0) {
+            uint64_t count;
+            ssize_t got = read(aio->event_fd, &count, sizeof(count));
+            (void) got;
+        }
+    }
+    return n;
+}
+
+int raio_poll(RamfsAio *aio, RamfsCompletion *completions, int max) {
+    if (aio == NULL || max < 0 || (completions == NULL && max > 0)) {
+        return -1;
+    }
+    pthread_mutex_lock(&aio->done_lock);
+    int n = drain(aio, completions, max);
+    pthread_mutex_unlock(&aio->done_lock);
+    return n;
+}
+
+int raio_wait(RamfsAio *aio, RamfsCompletion *completions, int max) {
+    if (aio == NULL || max < 1 || completions == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&aio->done_lock);
+    while (aio->done_head == NULL) {
+        pthread_cond_wait(&aio->done_cond, &aio->done_lock);
+    }
+    int n = drain(aio, completions, max);
+    pthread_mutex_unlock(&aio->done_lock);
+    return n;
+}
+
+int raio_fd(RamfsAio *aio) {
+    return aio != NULL ? aio->event_fd : -1;
+}
+
+void raio_destroy(RamfsAio *aio) {
+    if (aio == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&aio->idle_lock);
+    aio->stopping = 1;
+    pthread_cond_broadcast(&aio->idle);
+    pthread_mutex_unlock(&aio->idle_lock);
+    for (int i = 0; i < aio->started; i++) {
+        pthread_join(aio->workers[i].thread, NULL);
+    }
+    //completions never polled
+    while (aio->done_head != NULL) {
+        AioTask *task = aio->done_head;
+        aio->done_head = task->next;
+        free(task);
+    }
+    for (int i = 0; i < aio->worker_count; i++) {
+        pthread_mutex_destroy(&aio->queues[i].lock);
+    }
+    pthread_mutex_destroy(&aio->idle_lock);
+    pthread_cond_destroy(&aio->idle);
+    pthread_mutex_destroy(&aio->done_lock);
+    pthread_cond_destroy(&aio->done_cond);
+    close(aio->event_fd);
+    free(aio->workers);
+    free(aio->queues);
+    free(aio);
+}
@@ -0,0 +1,980 @@
+#include "ramfs.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+//results are printed one JSON object per line: {"bench":..., "metric":..., "value":...};
+//usage: ramfs_bench [image path] [bench name...], runs every bench without names. The checkpoint
+//image and the journal are written at the image path, put it on the disk to measure
+
+#define DIRS 64
+#define FILES_PER_DIR 64
+#define FILE_SIZE (16 * 1024)
+
+//timed operations per microbench, latencies are kept for percentiles
+#define OPS 100000
+#define DEPTH 16
+#define WIDE_FILES 10000
+#define IO_FILE_SIZE (16 * 1024 * 1024)
+
+//tree of the walk bench, WALK_FANOUT directories per level and WALK_FILES files in every bottom one;
+//far more paths than the path cache holds, so most lookups walk
+#define WALK_LEVELS 6
+#define WALK_FANOUT 6
+#define WALK_FILES 2
+
+#define JOURNAL_OPS 2000
+#define JOURNAL_WRITE 4096
+#define JOURNAL_THREADS 8
+
+//files written by the ingest bench, and files per rsubmit batch
+#define INGEST_FILES 20000
+#define INGEST_BATCH 64
+#define INGEST_SYNC_FILES 2000
+
+//batches run by the aio bench, each one write of AIO_WRITE bytes to one of AIO_FILES files
+#define AIO_BATCHES 4000
+#define AIO_WRITE (256 * 1024)
+#define AIO_FILES 64
+
+//copies of one file written by the dedup bench
+#define DEDUP_COPIES 64
+#define DEDUP_FILE_SIZE (1024 * 1024)
+
+//text-like files left for the compression thread, and cold reads of them
+#define COMPRESS_FILES 32
+#define COMPRESS_FILE_SIZE (1024 * 1024)
+#define COMPRESS_IDLE_MS 20
+
+//files of the budget bench against a budget of a quarter of them, reads go mostly to a hot fifth
+#define BUDGET_FILES 64
+#define BUDGET_FILE_SIZE (1024 * 1024)
+#define BUDGET_BYTES (BUDGET_FILES * BUDGET_FILE_SIZE / 4)
+#define BUDGET_READS 200000
+
+//files of the preallocate bench written in small appends, with and without their size reserved first
+#define PREALLOC_FILES 4096
+#define PREALLOC_FILE_SIZE (64 * 1024)
+#define PREALLOC_WRITE 256
+
+//processes of the share bench reading the checkpoint tree, and timed reads of the whole tree by each
+#define SHARE_PROCS 4
+#define SHARE_PASSES 4
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *bench, const char *metric, double value) {
+    printf("{\"bench\":\"%s\",\"metric\":\"%s\",\"value\":%.3f}\n", bench, metric, value);
+}
+
+//latency of every operation of the running microbench
+static double samples[OPS];
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+//throughput and latency percentiles of count operations timed into samples
+static void report_ops(const char *bench, size_t count, double elapsed_ms) {
+    qsort(samples, count, sizeof(double), compare_double);
+    report(bench, "ops_per_s", count / (elapsed_ms / 1e3));
+    report(bench, "p50_ns", samples[count / 2]);
+    report(bench, "p99_ns", samples[count * 99 / 100]);
+    report(bench, "p999_ns", samples[count * 999 / 1000]);
+    report(bench, "max_ns", samples[count - 1]);
+}
+
+static void fail(const char *what) {
+    fprintf(stderr, "bench failed: %s\n", what);
+    exit(EXIT_FAILURE);
+}
+
+//the working set a service would rebuild by replaying its writes
+static void build_tree(const char *data) {
+    char path[64];
+    for (int d = 0; d < DIRS; d++) {
+        sprintf(path, "/d%d", d);
+        if (rmkdir(path) == -1) {
+            fail("rmkdir");
+        }
+        for (int f = 0; f < FILES_PER_DIR; f++) {
+            sprintf(path, "/d%d/f%d", d, f);
+            int fd = ropen(path, O_CREAT | O_WRONLY);
+            if (fd < 0 || rwrite(fd, data + (d * FILES_PER_DIR + f) % 4096, FILE_SIZE) != FILE_SIZE) {
+                fail("rwrite");
+            }
+            rclose(fd);
+        }
+    }
+}
+
+//read every file once, returns a checksum so the reads are not optimized out
+static unsigned long read_tree(char *buf) {
+    unsigned long sum = 0;
+    char path[64];
+    for (int d = 0; d < DIRS; d++) {
+        for (int f = 0; f < FILES_PER_DIR; f++) {
+            sprintf(path, "/d%d/f%d", d, f);
+            int fd = ropen(path, O_RDONLY);
+            if (fd < 0 || rread(fd, buf, FILE_SIZE) != FILE_SIZE) {
+                fail("rread");
+            }
+            sum += (unsigned char) buf[FILE_SIZE - 1];
+            rclose(fd);
+        }
+    }
+    return sum;
+}
+
+//restore from a checkpoint image against rebuilding the same tree from scratch
+static void bench_checkpoint(const char *image) {
+    char *data = (char *) malloc(FILE_SIZE + 4096);
+    char *buf = (char *) malloc(FILE_SIZE);
+    for (int i = 0; i < FILE_SIZE + 4096; i++) {
+        data[i] = (char) rand();
+    }
+    init_ramfs();
+    double start = now_ms();
+    build_tree(data);
+    report("checkpoint", "rebuild_ms", now_ms() - start);
+    unsigned long expect = read_tree(buf);
+
+    start = now_ms();
+    if (rcheckpoint(image) == -1) {
+        fail("rcheckpoint");
+    }
+    report("checkpoint", "checkpoint_ms", now_ms() - start);
+    FILE *file = fopen(image, "rb");
+    fseek(file, 0, SEEK_END);
+    report("checkpoint", "image_mb", ftell(file) / (1024.0 * 1024.0));
+    fclose(file);
+
+    start = now_ms();
+    if (rrestore(image) == -1) {
+        fail("rrestore");
+    }
+    report("checkpoint", "restore_ms", now_ms() - start);
+    //pages of the image are faulted in here
+    start = now_ms();
+    if (read_tree(buf) != expect) {
+        fail("restored content differs");
+    }
+    report("checkpoint", "first_read_ms", now_ms() - start);
+    start = now_ms();
+    read_tree(buf);
+    report("checkpoint", "warm_read_ms", now_ms() - start);
+    unlink(image);
+    free(data);
+    free(buf);
+}
+
+//open and stat a file DEPTH directories down, and a name missing at the bottom
+static void bench_lookup() {
+    char path[256] = "";
+    init_ramfs();
+    for (int d = 0; d < DEPTH; d++) {
+        sprintf(path + strlen(path), "/dir%d", d);
+        if (rmkdir(path) == -1) {
+            fail("rmkdir");
+        }
+    }
+    char file[300], missing[300];
+    sprintf(file, "%s/leaf", path);
+    sprintf(missing, "%s/none", path);
+    rclose(ropen(file, O_CREAT | O_WRONLY));
+    double start = now_ms();
+    for (int i = 0; i < OPS; i++) {
+        double t = now_ns();
+        int fd = ropen(file, O_RDONLY);
+        rclose(fd);
+        samples[i] = now_ns() - t;
+        if (fd < 0) {
+            fail("deep ropen");
+        }
+    }
+    report_ops("lookup_deep_open", OPS, now_ms() - start);
+    RamfsStat st;
+    start = now_ms();
+    for (int i = 0; i < OPS; i++) {
+        double t = now_ns();
+        rstat(file, &st);
+        samples[i] = now_ns() - t;
+    }
+    report_ops("lookup_deep_stat", OPS, now_ms() - start);
+    start = now_ms();
+    for (int i = 0; i < OPS; i++) {
+        double t = now_ns();
+        int result = rstat(missing, &st);
+        samples[i] = now_ns() - t;
+        if (result != -1) {
+            fail("missing rstat");
+        }
+    }
+    report_ops("lookup_deep_miss", OPS, now_ms() - start);
+}
+
+//path of file f below the bottom directory number leaf of the walk tree, f < 0 for the directory
+static void walk_name(char *path, int leaf, int f) {
+    path[0] = '\0';
+    for (int level = WALK_LEVELS - 1; level >= 0; level--) {
+        int digit = leaf;
+        for (int i = 0; i < level; i++) {
+            digit /= WALK_FANOUT;
+        }
+        sprintf(path + strlen(path), "/walk%d", digit % WALK_FANOUT);
+    }
+    if (f >= 0) {
+        sprintf(path + strlen(path), "/file%d", f);
+    }
+}
+
+//stat random files WALK_LEVELS + 1 names down in a tree too big for the path cache
+static void bench_walk() {
+    char path[128];
+    int leaves = 1;
+    for (int level = 0; level < WALK_LEVELS; level++) {
+        leaves *= WALK_FANOUT;
+    }
+    init_ramfs();
+    for (int leaf = 0; leaf < leaves; leaf++) {
+        //every prefix of the first path below a directory is new
+        char *end = path;
+        walk_name(path, leaf, -1);
+        while ((end = strchr(end + 1, '/')) != NULL) {
+            *end = '\0';
+            rmkdir(path);
+            *end = '/';
+        }
+        if (rmkdir(path) == -1 && leaf % WALK_FANOUT == 0) {
+            fail("walk rmkdir");
+        }
+        for (int f = 0; f < WALK_FILES; f++) {
+            walk_name(path, leaf, f);
+            int fd = ropen(path, O_CREAT | O_WRONLY);
+            if (fd < 0) {
+                fail("walk create");
+            }
+            rclose(fd);
+        }
+    }
+    RamfsStat st;
+    double start = now_ms();
+    for (int i = 0; i < OPS; i++) {
+        walk_name(path, rand() % leaves, rand() % WALK_FILES);
+        double t = now_ns();
+        int result = rstat(path, &st);
+        samples[i] = now_ns() - t;
+        if (result == -1) {
+            fail("walk rstat");
+        }
+    }
+    report_ops("walk_stat", OPS, now_ms() - start);
+}
+
+//fill one directory with WIDE_FILES files, then empty it again
+static void bench_wide() {
+    char path[64];
+    init_ramfs();
+    rmkdir("/wide");
+    double start = now_ms();
+    for (int i = 0; i < WIDE_FILES; i++) {
+        sprintf(path, "/wide/file%d", i);
+        double t = now_ns();
+        int fd = ropen(path, O_CREAT | O_WRONLY);
+        rclose(fd);
+        samples[i] = now_ns() - t;
+        if (fd < 0) {
+            fail("wide create");
+        }
+    }
+    report_ops("wide_create", WIDE_FILES, now_ms() - start);
+    start = now_ms();
+    for (int i = 0; i < WIDE_FILES; i++) {
+        sprintf(path, "/wide/file%d", i);
+        double t = now_ns();
+        int result = runlink(path);
+        samples[i] = now_ns() - t;
+        if (result == -1) {
+            fail("wide unlink");
+        }
+    }
+    report_ops("wide_unlink", WIDE_FILES, now_ms() - start);
+}
+
+//sequential then random writes and reads of one size through a file of IO_FILE_SIZE
+static void bench_io_size(size_t size, char *buf) {
+    char bench[64];
+    size_t count = IO_FILE_SIZE / size < OPS ? IO_FILE_SIZE / size : OPS;
+    size_t slots = IO_FILE_SIZE / size;
+    init_ramfs();
+    int fd = ropen("/io", O_CREAT | O_RDWR);
+    double start = now_ms();
+    for (size_t i = 0; i < count; i++) {
+        double t = now_ns();
+        ssize_t n = rwrite(fd, buf, size);
+        samples[i] = now_ns() - t;
+        if (n != (ssize_t) size) {
+            fail("sequential rwrite");
+        }
+    }
+    sprintf(bench, "seq_write_%zu", size);
+    report_ops(bench, count, now_ms() - start);
+    //the random ops below find the whole file written
+    for (size_t i = count; i < slots; i++) {
+        rwrite(fd, buf, size);
+    }
+    rseek(fd, 0, SEEK_SET);
+    start = now_ms();
+    for (size_t i = 0; i < count; i++) {
+        double t = now_ns();
+        ssize_t n = rread(fd, buf, size);
+        samples[i] = now_ns() - t;
+        if (n != (ssize_t) size) {
+            fail("sequential rread");
+        }
+    }
+    sprintf(bench, "seq_read_%zu", size);
+    report_ops(bench, count, now_ms() - start);
+    start = now_ms();
+    for (size_t i = 0; i < count; i++) {
+        off_t offset = (off_t) ((size_t) rand() % slots * size);
+        double t = now_ns();
+        ssize_t n = rpwrite(fd, buf, size, offset);
+        samples[i] = now_ns() - t;
+        if (n != (ssize_t) size) {
+            fail("random rpwrite");
+        }
+    }
+    sprintf(bench, "rand_write_%zu", size);
+    report_ops(bench, count, now_ms() - start);
+    start = now_ms();
+    for (size_t i = 0; i < count; i++) {
+        off_t offset = (off_t) ((size_t) rand() % slots * size);
+        double t = now_ns();
+        ssize_t n = rpread(fd, buf, size, offset);
+        samples[i] = now_ns() - t;
+        if (n != (ssize_t) size) {
+            fail("random rpread");
+        }
+    }
+    sprintf(bench, "rand_read_%zu", size);
+    report_ops(bench, count, now_ms() - start);
+    rclose(fd);
+}
+
+static void bench_io() {
+    static const size_t sizes[] = {64, 512, 4096, 65536, 1024 * 1024};
+    char *buf = (char *) malloc(1024 * 1024);
+    memset(buf, 'x', 1024 * 1024);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench_io_size(sizes[i], buf);
+    }
+    free(buf);
+}
+
+//open and close the same file while a thousand other descriptors stay open
+static void bench_fd_churn() {
+    static int held[1000];
+    init_ramfs();
+    rclose(ropen("/churn", O_CREAT | O_WRONLY));
+    double start = now_ms();
+    for (int i = 0; i < OPS; i++) {
+        double t = now_ns();
+        int fd = ropen("/churn", O_RDONLY);
+        int result = rclose(fd);
+        samples[i] = now_ns() - t;
+        if (result == -1) {
+            fail("fd churn");
+        }
+    }
+    report_ops("fd_churn", OPS, now_ms() - start);
+    for (int i = 0; i < 1000; i++) {
+        held[i] = ropen("/churn", O_RDONLY);
+    }
+    start = now_ms();
+    for (int i = 0; i < OPS; i++) {
+        double t = now_ns();
+        int fd = ropen("/churn", O_RDONLY);
+        int result = rclose(fd);
+        samples[i] = now_ns() - t;
+        if (result == -1) {
+            fail("fd churn");
+        }
+    }
+    report_ops("fd_churn_1000_open", OPS, now_ms() - start);
+    for (int i = 0; i < 1000; i++) {
+        rclose(held[i]);
+    }
+}
+
+static const char *level_names[] = {"none", "async", "sync"};
+
+//JOURNAL_OPS writes of JOURNAL_WRITE bytes to a private file
+static void *journal_writer(void *arg) {
+    long id = (long) arg;
+    char path[64];
+    static char data[JOURNAL_WRITE];
+    sprintf(path, "/w%ld", id);
+    int fd = ropen(path, O_CREAT | O_WRONLY | O_TRUNC);
+    for (int i = 0; i < JOURNAL_OPS; i++) {
+        if (rwrite(fd, data, JOURNAL_WRITE) != JOURNAL_WRITE) {
+            fail("journaled rwrite");
+        }
+    }
+    rclose(fd);
+    return NULL;
+}
+
+//cost of journaling one change at every durability level, and how well syncs are shared
+static void bench_journal(const char *image) {
+    char journal[256], metric[64], path[64];
+    snprintf(journal, sizeof(journal), "%s.journal", image);
+    for (int level = RAMFS_DURABILITY_NONE; level <= RAMFS_DURABILITY_SYNC; level++) {
+        unlink(image);
+        unlink(journal);
+        if (ramfs_durability(image, journal, level) == -1) {
+            fail("ramfs_durability");
+        }
+        double start = now_ms();
+        journal_writer((void *) 0);
+        sprintf(metric, "write_4k_us_%s", level_names[level]);
+        report("journal", metric, (now_ms() - start) * 1e3 / JOURNAL_OPS);
+
+        start = now_ms();
+        for (int i = 0; i < JOURNAL_OPS / 2; i++) {
+            sprintf(path, "/m%d", i);
+            if (rmkdir(path) == -1 || rrmdir(path) == -1) {
+                fail("journaled rmkdir");
+            }
+        }
+        sprintf(metric, "mkdir_rmdir_us_%s", level_names[level]);
+        report("journal", metric, (now_ms() - start) * 1e3 / JOURNAL_OPS);
+
+        //concurrent writers share syncs, so throughput should grow with the thread count
+        pthread_t threads[JOURNAL_THREADS];
+        start = now_ms();
+        for (long i = 0; i < JOURNAL_THREADS; i++) {
+            pthread_create(&threads[i], NULL, journal_writer, (void *) i);
+        }
+        for (int i = 0; i < JOURNAL_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        sprintf(metric, "write_4k_ops_per_s_%dthreads_%s", JOURNAL_THREADS, level_names[level]);
+        report("journal", metric, JOURNAL_OPS * JOURNAL_THREADS / ((now_ms() - start) / 1e3));
+    }
+    //the last level left a journal of every change above, recovery replays it
+    double start = now_ms();
+    init_ramfs();
+    report("journal", "replay_ms", now_ms() - start);
+    RamfsStat st;
+    if (rstat("/w0", &st) == -1 || st.size != (off_t) JOURNAL_OPS * JOURNAL_WRITE) {
+        fail("replayed content differs");
+    }
+    ramfs_durability(NULL, NULL, RAMFS_DURABILITY_NONE);
+    unlink(journal);
+    unlink(image);
+}
+
+//create, write and close count small files in /in, one call each or INGEST_BATCH files per rsubmit;
+//latencies are per file
+static void ingest(const char *bench, int count, int batched) {
+    static RamfsSubmission ops[INGEST_BATCH * 3];
+    static char paths[INGEST_BATCH][64];
+    static char data[256];
+    if (rmkdir("/in") == -1) {
+        fail("rmkdir");
+    }
+    double start = now_ms();
+    for (int i = 0; i < count; i += INGEST_BATCH) {
+        int files = count - i < INGEST_BATCH ? count - i : INGEST_BATCH;
+        double t = now_ns();
+        if (batched) {
+            memset(ops, 0, sizeof(ops));
+            for (int f = 0; f < files; f++) {
+                RamfsSubmission *op = &ops[f * 3];
+                sprintf(paths[f], "/in/f%d", i + f);
+                op[0].op = RAMFS_SUBMIT_OPEN;
+                op[0].flags = RAMFS_SUBMIT_LINK;
+                op[0].path = paths[f];
+                op[0].open_flags = O_CREAT | O_WRONLY;
+                op[1].op = RAMFS_SUBMIT_WRITE;
+                op[1].flags = RAMFS_SUBMIT_LINK;
+                op[1].fd = RAMFS_FD_LINKED;
+                op[1].buf = data;
+                op[1].count = sizeof(data);
+                op[1].offset = -1;
+                op[2].op = RAMFS_SUBMIT_CLOSE;
+                op[2].fd = RAMFS_FD_LINKED;
+            }
+            if (rsubmit(ops, files * 3) != files * 3) {
+                fail("rsubmit");
+            }
+        } else {
+            for (int f = 0; f < files; f++) {
+                sprintf(paths[f], "/in/f%d", i + f);
+                int fd = ropen(paths[f], O_CREAT | O_WRONLY);
+                if (fd < 0 || rwrite(fd, data, sizeof(data)) != sizeof(data) || rclose(fd) == -1) {
+                    fail("ingest");
+                }
+            }
+        }
+        double per_file = (now_ns() - t) / files;
+        for (int f = 0; f < files; f++) {
+            samples[i + f] = per_file;
+        }
+    }
+    report_ops(bench, count, now_ms() - start);
+}
+
+//open, write and close of many small files, one call each against batched through rsubmit
+static void bench_ingest(const char *image) {
+    char journal[256];
+    snprintf(journal, sizeof(journal), "%s.journal", image);
+    init_ramfs();
+    ingest("ingest_calls", INGEST_FILES, 0);
+    init_ramfs();
+    ingest("ingest_submit", INGEST_FILES, 1);
+    //a synchronous journal waits once per call, but once per batch
+    unlink(image);
+    unlink(journal);
+    if (ramfs_durability(image, journal, RAMFS_DURABILITY_SYNC) == -1) {
+        fail("ramfs_durability");
+    }
+    ingest("ingest_calls_sync", INGEST_SYNC_FILES, 0);
+    unlink(journal);
+    if (ramfs_durability(image, journal, RAMFS_DURABILITY_SYNC) == -1) {
+        fail("ramfs_durability");
+    }
+    ingest("ingest_submit_sync", INGEST_SYNC_FILES, 1);
+    ramfs_durability(NULL, NULL, RAMFS_DURABILITY_NONE);
+    unlink(journal);
+    unlink(image);
+}
+
+//throughput of large writes queued on raio engines of 1 to 8 workers
+static void bench_aio() {
+    static RamfsSubmission ops[AIO_BATCHES];
+    static RamfsCompletion completions[64];
+    char metric[64], path[64];
+    char *data = (char *) malloc(AIO_WRITE);
+    memset(data, 'a', AIO_WRITE);
+    init_ramfs();
+    int fds[AIO_FILES];
+    for (int i = 0; i < AIO_FILES; i++) {
+        sprintf(path, "/aio%d", i);
+        fds[i] = ropen(path, O_CREAT | O_WRONLY);
+    }
+    for (int workers = 1; workers <= 8; workers *= 2) {
+        RamfsAio *aio = raio_create(workers);
+        if (aio == NULL) {
+            fail("raio_create");
+        }
+        memset(ops, 0, sizeof(ops));
+        double start = now_ms();
+        for (int i = 0; i < AIO_BATCHES; i++) {
+            ops[i].op = RAMFS_SUBMIT_WRITE;
+            ops[i].fd = fds[i % AIO_FILES];
+            ops[i].buf = data;
+            ops[i].count = AIO_WRITE;
+            ops[i].offset = 0;
+            if (raio_submit(aio, &ops[i], 1, NULL) == -1) {
+                fail("raio_submit");
+            }
+        }
+        for (int done = 0; done < AIO_BATCHES;) {
+            int n = raio_wait(aio, completions, 64);
+            for (int i = 0; i < n; i++) {
+                if (completions[i].result != 1) {
+                    fail("aio write");
+                }
+            }
+            done += n;
+        }
+        sprintf(metric, "write_256k_ops_per_s_%dworkers", workers);
+        report("aio", metric, AIO_BATCHES / ((now_ms() - start) / 1e3));
+        raio_destroy(aio);
+    }
+    for (int i = 0; i < AIO_FILES; i++) {
+        rclose(fds[i]);
+    }
+    free(data);
+}
+
+//write throughput and memory of identical files with and without deduplication
+static void bench_dedup() {
+    char metric[64], path[64];
+    char *data = (char *) malloc(DEDUP_FILE_SIZE);
+    for (int i = 0; i < DEDUP_FILE_SIZE; i++) {
+        data[i] = (char) rand();
+    }
+    static RamfsStats stats;
+    for (int on = 0; on <= 1; on++) {
+        init_ramfs();
+        ramfs_dedup(on);
+        double start = now_ms();
+        for (int i = 0; i < DEDUP_COPIES; i++) {
+            sprintf(path, "/copy%d", i);
+            int fd = ropen(path, O_CREAT | O_WRONLY);
+            if (fd < 0 || rwrite(fd, data, DEDUP_FILE_SIZE) != DEDUP_FILE_SIZE) {
+                fail("dedup rwrite");
+            }
+            rclose(fd);
+        }
+        const char *mode = on ? "on" : "off";
+        sprintf(metric, "write_mb_per_s_%s", mode);
+        report("dedup", metric, DEDUP_COPIES * (DEDUP_FILE_SIZE / 1048576.0) / ((now_ms() - start) / 1e3));
+        ramfs_stats(&stats);
+        sprintf(metric, "block_mb_%s", mode);
+        report("dedup", metric, stats.block_bytes / 1048576.0);
+    }
+    RamfsDedupStats dedup;
+    ramfs_dedup_stats(&dedup);
+    report("dedup", "ratio", dedup.ratio);
+    report("dedup", "saved_mb", dedup.saved_bytes / 1048576.0);
+    ramfs_dedup(0);
+    free(data);
+}
+
+//memory of cold compressible files and the cost of reading them back
+static void bench_compress() {
+    char path[64];
+    char *data = (char *) malloc(COMPRESS_FILE_SIZE);
+    char *buf = (char *) malloc(COMPRESS_FILE_SIZE);
+    //words from a small vocabulary compress about as well as text
+    static const char *words[] = {"block ", "file ", "the ", "directory ", "read ", "write ", "of ", "a "};
+    for (size_t i = 0; i < COMPRESS_FILE_SIZE;) {
+        const char *word = words[rand() % 8];
+        for (size_t j = 0; word[j] != 0 && i < COMPRESS_FILE_SIZE; j++) {
+            data[i++] = word[j];
+        }
+    }
+    static RamfsStats stats;
+    init_ramfs();
+    for (int i = 0; i < COMPRESS_FILES; i++) {
+        sprintf(path, "/cold%d", i);
+        int fd = ropen(path, O_CREAT | O_WRONLY);
+        if (fd < 0 || rwrite(fd, data, COMPRESS_FILE_SIZE) != COMPRESS_FILE_SIZE) {
+            fail("compress rwrite");
+        }
+        rclose(fd);
+    }
+    ramfs_stats(&stats);
+    report("compress", "block_mb_raw", stats.block_bytes / 1048576.0);
+    double start = now_ms();
+    ramfs_compress(COMPRESS_IDLE_MS);
+    while (stats.compressed_raw_bytes < (int64_t) COMPRESS_FILES * COMPRESS_FILE_SIZE) {
+        if (now_ms() - start > 10000) {
+            fail("compress timeout");
+        }
+        usleep(1000);
+        ramfs_stats(&stats);
+    }
+    ramfs_compress(0);
+    report("compress", "block_mb_compressed", stats.block_bytes / 1048576.0);
+    report("compress", "ratio", (double) stats.compressed_raw_bytes / stats.compressed_bytes);
+    start = now_ms();
+    for (int i = 0; i < COMPRESS_FILES; i++) {
+        sprintf(path, "/cold%d", i);
+        int fd = ropen(path, O_RDONLY);
+        if (fd < 0 || rread(fd, buf, COMPRESS_FILE_SIZE) != COMPRESS_FILE_SIZE ||
+            memcmp(buf, data, COMPRESS_FILE_SIZE) != 0) {
+            fail("compress rread");
+        }
+        rclose(fd);
+    }
+    report("compress", "cold_read_mb_per_s", COMPRESS_FILES * (COMPRESS_FILE_SIZE / 1048576.0) / ((now_ms() - start) / 1e3));
+    ramfs_stats(&stats);
+    report("compress", "decompress_p50_ns", (double) ramfs_stats_percentile(&stats.ops[RAMFS_OP_DECOMPRESS], 0.5));
+    free(data);
+    free(buf);
+}
+
+//random reads of a working set four times the memory budget, with most reads on a hot fifth
+static void bench_budget(const char *image) {
+    char path[64], backing[1024];
+    snprintf(backing, sizeof(backing), "%s.spill", image);
+    char *data = (char *) malloc(BUDGET_FILE_SIZE);
+    for (int i = 0; i < BUDGET_FILE_SIZE; i++) {
+        data[i] = (char) rand();
+    }
+    static RamfsStats stats;
+    int fds[BUDGET_FILES];
+    for (int on = 0; on <= 1; on++) {
+        init_ramfs();
+        for (int i = 0; i < BUDGET_FILES; i++) {
+            sprintf(path, "/set%d", i);
+            fds[i] = ropen(path, O_CREAT | O_RDWR);
+            if (fds[i] < 0 || rwrite(fds[i], data, BUDGET_FILE_SIZE) != BUDGET_FILE_SIZE) {
+                fail("budget rwrite");
+            }
+        }
+        if (on && ramfs_memory_budget(BUDGET_BYTES, backing) == -1) {
+            fail("ramfs_memory_budget");
+        }
+        double start = now_ms();
+        while (on && stats.block_bytes > BUDGET_BYTES) {
+            if (now_ms() - start > 10000) {
+                fail("budget timeout");
+            }
+            usleep(1000);
+            ramfs_stats(&stats);
+        }
+        char buf[4096];
+        start = now_ms();
+        for (int i = 0; i < BUDGET_READS; i++) {
+            int hot = rand() % 10 < 8;
+            int file = hot ? rand() % (BUDGET_FILES / 5) : rand() % BUDGET_FILES;
+            off_t offset = (off_t) (rand() % (BUDGET_FILE_SIZE / 4096)) * 4096;
+            if (rpread(fds[file], buf, sizeof(buf), offset) != sizeof(buf)) {
+                fail("budget rpread");
+            }
+        }
+        const char *mode = on ? "budget" : "unlimited";
+        char metric[64];
+        sprintf(metric, "read_4k_ops_per_s_%s", mode);
+        report("budget", metric, BUDGET_READS / ((now_ms() - start) / 1e3));
+        ramfs_stats(&stats);
+        sprintf(metric, "block_mb_%s", mode);
+        report("budget", metric, stats.block_bytes / 1048576.0);
+        if (on) {
+            report("budget", "spilled_mb", stats.spilled_bytes / 1048576.0);
+            report("budget", "hit_rate", (double) stats.tier_hits / (stats.tier_hits + stats.tier_faults));
+            report("budget", "faults", (double) stats.tier_faults);
+            report("budget", "spills", (double) stats.spills);
+        }
+        for (int i = 0; i < BUDGET_FILES; i++) {
+            rclose(fds[i]);
+        }
+    }
+    ramfs_memory_budget(0, NULL);
+    init_ramfs();
+    unlink(backing);
+    free(data);
+}
+
+//proportional set size of this process in MB, a page mapped by n processes counts 1/n
+//appends to files whose final size the writer knows, growing as they go or reserved by rfallocate
+static void bench_preallocate() {
+    char metric[64], path[64], buf[PREALLOC_WRITE];
+    memset(buf, 'p', sizeof(buf));
+    for (int reserve = 0; reserve <= 1; reserve++) {
+        init_ramfs();
+        double start = now_ms();
+        for (int i = 0; i < PREALLOC_FILES; i++) {
+            sprintf(path, "/pre%d", i);
+            int fd = ropen(path, O_CREAT | O_WRONLY);
+            if (fd < 0 || (reserve && rfallocate(fd, 0, PREALLOC_FILE_SIZE) == -1)) {
+                fail("preallocate rfallocate");
+            }
+            for (int written = 0; written < PREALLOC_FILE_SIZE; written += PREALLOC_WRITE) {
+                if (rwrite(fd, buf, PREALLOC_WRITE) != PREALLOC_WRITE) {
+                    fail("preallocate rwrite");
+                }
+            }
+            rclose(fd);
+        }
+        sprintf(metric, "write_mb_per_s_%s", reserve ? "reserved" : "growing");
+        report("preallocate", metric, PREALLOC_FILES * (PREALLOC_FILE_SIZE / 1048576.0) / ((now_ms() - start) / 1e3));
+    }
+}
+
+static double pss_mb() {
+    FILE *file = fopen("/proc/self/smaps_rollup", "r");
+    char line[128];
+    long kb = -1;
+    while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "Pss: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    return kb / 1024.0;
+}
+
+//one process of the share bench: build a private tree or join the shared one, read it and send
+//its read throughput, the memory the tree added to the process and a checksum to out
+static void share_child(const char *share_path, const char *data, int out) {
+    char *buf = (char *) malloc(FILE_SIZE);
+    init_ramfs();
+    double base_mb = pss_mb();
+    if (share_path == NULL) {
+        build_tree(data);
+    } else if (ramfs_share(share_path) == -1) {
+        fail("ramfs_share");
+    }
+    //the first pass faults the shared pages in
+    unsigned long sum = read_tree(buf);
+    double start = now_ms();
+    for (int i = 0; i < SHARE_PASSES; i++) {
+        if (read_tree(buf) != sum) {
+            fail("share rread");
+        }
+    }
+    double result[3] = {SHARE_PASSES * DIRS * FILES_PER_DIR * (FILE_SIZE / 1048576.0) / ((now_ms() - start) / 1e3),
+                        pss_mb() - base_mb, (double) sum};
+    if (write(out, result, sizeof(result)) != sizeof(result)) {
+        fail("share report");
+    }
+    free(buf);
+}
+
+static void wait_children(int count) {
+    for (int i = 0; i < count; i++) {
+        int status;
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            fail("share child");
+        }
+    }
+}
+
+//SHARE_PROCS processes reading the checkpoint tree, each from its own copy and all from one shared image;
+//memory is the proportional set size the tree adds to the readers, summed over them
+static void bench_share(const char *image) {
+    char share_path[256];
+    snprintf(share_path, sizeof(share_path), "%s.share", image);
+    char *data = (char *) malloc(FILE_SIZE + 4096);
+    for (int i = 0; i < FILE_SIZE + 4096; i++) {
+        data[i] = (char) rand();
+    }
+    init_ramfs();
+    unlink(share_path);
+    double expect = -1;
+    for (int shared = 0; shared <= 1; shared++) {
+        fflush(stdout);
+        if (shared) {
+            //the first process to join publishes its tree
+            pid_t pid = fork();
+            if (pid == -1) {
+                fail("fork");
+            }
+            if (pid == 0) {
+                init_ramfs();
+                build_tree(data);
+                if (ramfs_share(share_path) == -1) {
+                    fail("ramfs_share");
+                }
+                exit(EXIT_SUCCESS);
+            }
+            wait_children(1);
+            if (ramfs_share(share_path) == -1) {
+                fail("ramfs_share");
+            }
+        }
+        int pipe_fds[2];
+        if (pipe(pipe_fds) == -1) {
+            fail("pipe");
+        }
+        for (int i = 0; i < SHARE_PROCS; i++) {
+            pid_t pid = fork();
+            if (pid == -1) {
+                fail("fork");
+            }
+            if (pid == 0) {
+                share_child(shared ? share_path : NULL, data, pipe_fds[1]);
+                //one process publishes a change the others pick up on their next refresh
+                if (shared && i == 0) {
+                    int fd = -1;
+                    if (rshare_begin() == -1 || (fd = ropen("/note", O_CREAT | O_WRONLY)) < 0 ||
+                        rwrite(fd, "shared", 6) != 6 || rclose(fd) == -1 || rshare_commit() == -1) {
+                        fail("share publish");
+                    }
+                }
+                exit(EXIT_SUCCESS);
+            }
+        }
+        close(pipe_fds[1]);
+        double read_mb_per_s = 0, pss = 0;
+        for (int i = 0; i < SHARE_PROCS; i++) {
+            double result[3];
+            if (read(pipe_fds[0], result, sizeof(result)) != sizeof(result)) {
+                fail("share child");
+            }
+            //every process, private or shared, reads the same content
+            if (expect != -1 && result[2] != expect) {
+                fail("share content differs");
+            }
+            expect = result[2];
+            read_mb_per_s += result[0] / SHARE_PROCS;
+            pss += result[1];
+        }
+        close(pipe_fds[0]);
+        wait_children(SHARE_PROCS);
+        const char *mode = shared ? "shared" : "private";
+        char metric[64];
+        sprintf(metric, "read_mb_per_s_%s", mode);
+        report("share", metric, read_mb_per_s);
+        sprintf(metric, "tree_pss_mb_%dprocs_%s", SHARE_PROCS, mode);
+        report("share", metric, pss);
+    }
+    RamfsStat st;
+    if (rshare_refresh() != 1 || rstat("/note", &st) == -1 || st.size != 6) {
+        fail("published change missing");
+    }
+    ramfs_share(NULL);
+    init_ramfs();
+    unlink(share_path);
+    snprintf(share_path, sizeof(share_path), "%s.share.lock", image);
+    unlink(share_path);
+    free(data);
+}
+
+//benches that write files get the image path, the rest run in memory only
+typedef struct bench {
+    const char *name;
+    void (*run)();
+    void (*run_image)(const char *image);
+} Bench;
+
+static const Bench benches[] = {
+        {"lookup",      bench_lookup, NULL},
+        {"walk",        bench_walk, NULL},
+        {"wide",        bench_wide, NULL},
+        {"io",          bench_io, NULL},
+        {"fd_churn",    bench_fd_churn, NULL},
+        {"checkpoint",  NULL, bench_checkpoint},
+        {"journal",     NULL, bench_journal},
+        {"ingest",      NULL, bench_ingest},
+        {"aio",         bench_aio, NULL},
+        {"dedup",       bench_dedup, NULL},
+        {"compress",    bench_compress, NULL},
+        {"budget",      NULL, bench_budget},
+        {"preallocate", bench_preallocate, NULL},
+        {"share",       NULL, bench_share},
+};
+
+int main(int argc, char *argv[]) {
+    const char *image = argc > 1 ? argv[1] : "ramfs_bench.img";
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        int selected = argc <= 2;
+        for (int j = 2; j < argc; j++) {
+            selected |= strcmp(argv[j], benches[i].name) == 0;
+        }
+        if (selected) {
+            //every bench sees the same random sequence, whichever ran before it
+            srand(1);
+            if (benches[i].run != NULL) {
+                benches[i].run();
+            } else {
+                benches[i].run_image(image);
+            }
+        }
+    }
+    return 0;
+}
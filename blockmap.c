@@ -0,0 +1,501 @@
+//
+// Block map: file content split into fixed size blocks indexed by a radix tree.
+//
+#include <string.h>
+#include "blockmap.h"
+#include "stats.h"
+#include "dedup.h"
+#include "compress.h"
+#include "spill.h"
+
+//number of blocks covered by a tree of the given height
+static size_t map_span(int height) {
+    return (size_t) 1 << (height * MAP_SHIFT);
+}
+
+//slot index of a block inside a node on the given level
+static size_t map_slot(size_t index, int level) {
+    return (index >> ((level - 1) * MAP_SHIFT)) & (MAP_FANOUT - 1);
+}
+
+const char bmap_zeros[BLOCK_SIZE];
+
+//capacity of the only block of a single block file that has to hold size bytes, doubled from capacity
+static size_t single_capacity(size_t capacity, size_t size) {
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    return capacity < BLOCK_SIZE ? capacity : BLOCK_SIZE;
+}
+
+Block *block_alloc(BlockStore *store, size_t capacity) {
+    Block *block = (Block *) arena_alloc(store->arena, sizeof(Block) + capacity);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->capacity = capacity;
+    atomic_init(&block->refs, 1);
+    atomic_init(&block->indexed, 0);
+    block->data = (char *) (block + 1);
+    block->stored = 0;
+    stats_gauge(store->stats, STATS_BLOCK_BYTES, (int64_t) capacity);
+    return block;
+}
+
+int block_external(const Block *block) {
+    return block->data != (const char *) (block + 1);
+}
+
+int block_spilled(const Block *block) {
+    return block->data == NULL;
+}
+
+void block_get(Block *block) {
+    atomic_fetch_add_explicit(&block->refs, 1, memory_order_relaxed);
+}
+
+void block_put(Block *block, BlockStore *store) {
+    if (atomic_fetch_sub_explicit(&block->refs, 1, memory_order_acq_rel) == 1) {
+        if (atomic_load(&block->indexed)) {
+            dedup_forget(store->dedup, block);
+        }
+        //an external block only owns its header
+        size_t capacity = block_external(block) ? 0 : block->capacity;
+        if (block_spilled(block)) {
+            spill_forget(store, block);
+        }
+        if (block->stored != 0) {
+            compress_forget(store->cache, block);
+            stats_gauge(store->stats, STATS_COMPRESSED_BYTES, -(int64_t) block->stored);
+            stats_gauge(store->stats, STATS_COMPRESSED_RAW_BYTES, -(int64_t) block->capacity);
+            capacity = block->stored;
+        }
+        stats_gauge(store->stats, STATS_BLOCK_BYTES, -(int64_t) capacity);
+        arena_free(store->arena, block, sizeof(Block) + capacity);
+    }
+}
+
+//replace a block of the map by a private copy with the given capacity, the new bytes are zeroed
+static Block *resize_block(BlockMap *map, BlockStore *store, Block *old, size_t capacity) {
+    Block *block = block_alloc(store, capacity);
+    if (block == NULL) {
+        return NULL;
+    }
+    size_t keep = 0;
+    if (old != NULL) {
+        keep = old->capacity < capacity ? old->capacity : capacity;
+        if (block_read(store, old, 0, block->data, keep) == -1) {
+            block_put(block, store);
+            return NULL;
+        }
+        map->allocated -= old->capacity;
+        map->spilled -= block_spilled(old);
+        block_put(old, store);
+    }
+    map->allocated += capacity;
+    memset(block->data + keep, 0, capacity - keep);
+    return block;
+}
+
+static MapNode *node_alloc(BlockStore *store) {
+    MapNode *node = (MapNode *) arena_calloc(store->arena, sizeof(MapNode));
+    if (node != NULL) {
+        atomic_init(&node->refs, 1);
+    }
+    return node;
+}
+
+//drop a reference to a subtree, the last one frees it
+static void node_put(BlockStore *store, void *node, int height) {
+    if (node == NULL) {
+        return;
+    }
+    if (height == 0) {
+        block_put((Block *) node, store);
+        return;
+    }
+    MapNode *map_node = (MapNode *) node;
+    if (atomic_fetch_sub_explicit(&map_node->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    for (int i = 0; i < MAP_FANOUT; i++) {
+        node_put(store, map_node->slots[i], height - 1);
+    }
+    arena_free(store->arena, node, sizeof(MapNode));
+}
+
+//make the node in slot private to this map, copying it if another map shares it
+static MapNode *node_own(BlockStore *store, void **slot, int height) {
+    MapNode *node = (MapNode *) *slot;
+    if (atomic_load(&node->refs) == 1) {
+        return node;
+    }
+    MapNode *copy = node_alloc(store);
+    if (copy == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < MAP_FANOUT; i++) {
+        copy->slots[i] = node->slots[i];
+        if (node->slots[i] == NULL) {
+            continue;
+        }
+        //the copy holds its own reference to every child
+        if (height == 1) {
+            block_get((Block *) node->slots[i]);
+        } else {
+            atomic_fetch_add_explicit(&((MapNode *) node->slots[i])->refs, 1, memory_order_relaxed);
+        }
+    }
+    node_put(store, node, height);
+    *slot = copy;
+    return copy;
+}
+
+Block *bmap_find(const BlockMap *map, size_t index) {
+    if (map->root == NULL || index >= map_span(map->height)) {
+        return NULL;
+    }
+    void *node = map->root;
+    for (int level = map->height; level > 0 && node != NULL; level--) {
+        node = ((MapNode *) node)->slots[map_slot(index, level)];
+    }
+    return (Block *) node;
+}
+
+//add levels on top until the tree covers index
+static int map_grow(BlockMap *map, BlockStore *store, size_t index) {
+    while (index >= map_span(map->height)) {
+        if (map->root != NULL) {
+            if (map->height == 0 && ((Block *) map->root)->capacity < BLOCK_SIZE) {
+                //the file no longer fits one block, give the first block its full size
+                Block *block = resize_block(map, store, (Block *) map->root, BLOCK_SIZE);
+                if (block == NULL) {
+                    return -1;
+                }
+                map->root = block;
+            }
+            MapNode *node = node_alloc(store);
+            if (node == NULL) {
+                return -1;
+            }
+            //the new root takes over the reference of the map
+            node->slots[0] = map->root;
+            map->root = node;
+        }
+        map->height++;
+    }
+    return 0;
+}
+
+//return the slot holding a block, creating the nodes on the way to it
+static void **block_slot(BlockMap *map, BlockStore *store, size_t index) {
+    if (map_grow(map, store, index) == -1) {
+        return NULL;
+    }
+    void **slot = &map->root;
+    for (int level = map->height; level > 0; level--) {
+        if (*slot == NULL) {
+            *slot = node_alloc(store);
+            if (*slot == NULL) {
+                return NULL;
+            }
+        } else if (node_own(store, slot, level) == NULL) {
+            //nodes shared with a clone are copied along the path, the rest stays shared
+            return NULL;
+        }
+        slot = &((MapNode *) *slot)->slots[map_slot(index, level)];
+    }
+    return slot;
+}
+
+void bmap_init(BlockMap *map) {
+    map->root = NULL;
+    map->height = 0;
+    map->allocated = 0;
+    map->spilled = 0;
+}
+
+void bmap_free(BlockMap *map, BlockStore *store) {
+    node_put(store, map->root, map->height);
+    bmap_init(map);
+}
+
+void bmap_clone(BlockMap *dst, const BlockMap *src) {
+    *dst = *src;
+    if (src->root == NULL) {
+        return;
+    }
+    if (src->height == 0) {
+        block_get((Block *) src->root);
+    } else {
+        atomic_fetch_add_explicit(&((MapNode *) src->root)->refs, 1, memory_order_relaxed);
+    }
+}
+
+int bmap_read(BlockStore *store, const BlockMap *map, size_t offset, void *buf, size_t count) {
+    char *dst = (char *) buf;
+    while (count > 0) {
+        size_t index = offset >> BLOCK_SHIFT;
+        size_t start = offset & (BLOCK_SIZE - 1);
+        size_t len = BLOCK_SIZE - start < count ? BLOCK_SIZE - start : count;
+        Block *block = bmap_find(map, index);
+        size_t avail = 0;
+        if (block != NULL && start < block->capacity) {
+            avail = block->capacity - start < len ? block->capacity - start : len;
+            if (block_read(store, block, start, dst, avail) == -1) {
+                return -1;
+            }
+        }
+        //holes and the part beyond a small block read as zeros
+        memset(dst + avail, 0, len - avail);
+        dst += len;
+        offset += len;
+        count -= len;
+    }
+    return 0;
+}
+
+size_t bmap_seek(const BlockMap *map, size_t offset, int data) {
+    size_t limit = map_span(map->height);
+    size_t index = offset >> BLOCK_SHIFT;
+    while (index < limit) {
+        void *node = map->root;
+        int level = map->height;
+        while (level > 0 && node != NULL) {
+            node = ((MapNode *) node)->slots[map_slot(index, level)];
+            level--;
+        }
+        size_t start = index << BLOCK_SHIFT;
+        size_t pos = offset > start ? offset : start;
+        if (node == NULL) {
+            if (!data) {
+                return pos;
+            }
+            //skip the whole missing subtree
+            index = (index | (map_span(level) - 1)) + 1;
+            continue;
+        }
+        size_t end = start + ((Block *) node)->capacity;
+        if (data && pos < end) {
+            return pos;
+        }
+        //the tail of a short single block is a hole too
+        if (!data && end < start + BLOCK_SIZE && pos < start + BLOCK_SIZE) {
+            return pos > end ? pos : end;
+        }
+        index++;
+    }
+    if (data) {
+        return (size_t) -1;
+    }
+    //everything past the tree is a hole
+    return offset > (limit << BLOCK_SHIFT) ? offset : limit << BLOCK_SHIFT;
+}
+
+int bmap_attach(BlockMap *map, BlockStore *store, size_t index, const char *data, size_t length) {
+    Block *block = (Block *) arena_alloc(store->arena, sizeof(Block));
+    if (block == NULL) {
+        return -1;
+    }
+    block->capacity = length;
+    atomic_init(&block->refs, 1);
+    atomic_init(&block->indexed, 0);
+    block->data = (char *) data;
+    block->stored = 0;
+    void **slot = block_slot(map, store, index);
+    if (slot == NULL) {
+        arena_free(store->arena, block, sizeof(Block));
+        return -1;
+    }
+    *slot = block;
+    map->allocated += length;
+    return 0;
+}
+
+int bmap_reserve(BlockMap *map, BlockStore *store, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    if (map_grow(map, store, (size - 1) >> BLOCK_SHIFT) == -1) {
+        return -1;
+    }
+    Block *block = (Block *) map->root;
+    if (map->height == 0 && block != NULL && block->capacity < size) {
+        //grow a single block file to the final size at once instead of doubling per write;
+        //a short block restored from an image need not have a power of two size
+        block = resize_block(map, store, block, single_capacity(block->capacity, size));
+        if (block == NULL) {
+            return -1;
+        }
+        map->root = block;
+    }
+    return 0;
+}
+
+int bmap_write(BlockMap *map, BlockStore *store, size_t offset, const void *buf, size_t count) {
+    const char *src = (const char *) buf;
+    while (count > 0) {
+        size_t index = offset >> BLOCK_SHIFT;
+        size_t start = offset & (BLOCK_SIZE - 1);
+        size_t len = BLOCK_SIZE - start < count ? BLOCK_SIZE - start : count;
+        void **slot = block_slot(map, store, index);
+        if (slot == NULL) {
+            return -1;
+        }
+        Block *block = (Block *) *slot;
+        //a block pinned elsewhere is copied first, the holders keep the old content
+        if (block == NULL || block->capacity < start + len || atomic_load(&block->refs) > 1 ||
+            block_external(block) || block->stored != 0 ||
+            (atomic_load(&block->indexed) && dedup_unindex(store->dedup, block) == -1)) {
+            size_t capacity = BLOCK_SIZE;
+            if (map->height == 0) {
+                //a single block file grows its block by doubling
+                capacity = single_capacity(block != NULL ? block->capacity : BLOCK_MIN, start + len);
+            }
+            block = resize_block(map, store, block, capacity);
+            if (block == NULL) {
+                return -1;
+            }
+            *slot = block;
+        }
+        memcpy(block->data + start, src, len);
+        src += len;
+        offset += len;
+        count -= len;
+    }
+    return 0;
+}
+
+int bmap_allocate(BlockMap *map, BlockStore *store, size_t offset, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    //the tree and a single block grow once for the whole range
+    if (bmap_reserve(map, store, offset + count) == -1) {
+        return -1;
+    }
+    size_t last = (offset + count - 1) >> BLOCK_SHIFT;
+    for (size_t index = offset >> BLOCK_SHIFT; index <= last; index++) {
+        void **slot = block_slot(map, store, index);
+        if (slot == NULL) {
+            return -1;
+        }
+        if (*slot == NULL) {
+            size_t capacity = map->height == 0 ? single_capacity(BLOCK_MIN, offset + count) : BLOCK_SIZE;
+            Block *block = resize_block(map, store, NULL, capacity);
+            if (block == NULL) {
+                return -1;
+            }
+            *slot = block;
+        }
+    }
+    return 0;
+}
+
+//take the blocks of a subtree out of the counters of the map before the subtree is dropped
+static void uncount(BlockMap *map, void *node, int height) {
+    if (node == NULL) {
+        return;
+    }
+    if (height == 0) {
+        map->allocated -= ((Block *) node)->capacity;
+        map->spilled -= block_spilled((Block *) node);
+        return;
+    }
+    for (int i = 0; i < MAP_FANOUT; i++) {
+        uncount(map, ((MapNode *) node)->slots[i], height - 1);
+    }
+}
+
+//drop the blocks from index keep on below the node in slot, which covers the blocks from index first;
+//nodes shared with a clone are copied before they change
+static int trim(BlockMap *map, BlockStore *store, void **slot, int height, size_t first, size_t keep) {
+    if (*slot == NULL || (height > 0 && first + map_span(height) <= keep) || (height == 0 && first < keep)) {
+        return 0;
+    }
+    if (first >= keep) {
+        uncount(map, *slot, height);
+        node_put(store, *slot, height);
+        *slot = NULL;
+        return 0;
+    }
+    MapNode *node = node_own(store, slot, height);
+    if (node == NULL) {
+        return -1;
+    }
+    size_t span = map_span(height - 1);
+    for (size_t i = (keep - first) / span; i < MAP_FANOUT; i++) {
+        if (trim(map, store, &node->slots[i], height - 1, first + i * span, keep) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int bmap_truncate(BlockMap *map, BlockStore *store, size_t size) {
+    if (size == 0) {
+        bmap_free(map, store);
+        return 0;
+    }
+    if (trim(map, store, &map->root, map->height, 0, ((size - 1) >> BLOCK_SHIFT) + 1) == -1) {
+        return -1;
+    }
+    //the bytes past the end read as zeros once the file grows again
+    size_t start = size & (BLOCK_SIZE - 1);
+    Block *block = start != 0 ? bmap_find(map, size >> BLOCK_SHIFT) : NULL;
+    if (block != NULL && start < block->capacity) {
+        return bmap_write(map, store, size, bmap_zeros, block->capacity - start);
+    }
+    return 0;
+}
+
+int block_read(BlockStore *store, const Block *block, size_t start, void *buf, size_t count) {
+    if (block_spilled(block)) {
+        return spill_read(store->spill, block, start, buf, count);
+    }
+    if (block->stored != 0) {
+        block_unpack(store, block, start, buf, count);
+    } else {
+        memcpy(buf, block->data + start, count);
+    }
+    return 0;
+}
+
+int bmap_fault(BlockMap *map, BlockStore *store, size_t offset, size_t count) {
+    int faults = 0;
+    size_t last = count > 0 ? (offset + count - 1) >> BLOCK_SHIFT : 0;
+    for (size_t index = offset >> BLOCK_SHIFT; map->spilled > 0 && count > 0 && index <= last; index++) {
+        Block *block = bmap_find(map, index);
+        if (block == NULL || !block_spilled(block)) {
+            continue;
+        }
+        Block *copy = block_alloc(store, block->capacity);
+        if (copy == NULL) {
+            return -1;
+        }
+        if (spill_read(store->spill, block, 0, copy->data, block->capacity) == -1 ||
+            bmap_share(map, store, index, copy) == -1) {
+            block_put(copy, store);
+            return -1;
+        }
+        faults++;
+    }
+    return faults;
+}
+
+int bmap_share(BlockMap *map, BlockStore *store, size_t index, Block *block) {
+    void **slot = block_slot(map, store, index);
+    if (slot == NULL) {
+        return -1;
+    }
+    Block *old = (Block *) *slot;
+    *slot = block;
+    map->allocated += block->capacity;
+    map->spilled += block_spilled(block);
+    if (old != NULL) {
+        map->allocated -= old->capacity;
+        map->spilled -= block_spilled(old);
+        block_put(old, store);
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+//
+// Block map: file content split into fixed size blocks indexed by a radix tree.
+// Nodes and blocks are reference counted, so a map is cloned in O(1) and the
+// clones copy a path of the tree only when they write.
+//
+#ifndef BLOCKMAP_H
+#define BLOCKMAP_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include "slab.h"
+
+#define BLOCK_SHIFT 12
+#define BLOCK_SIZE (1 << BLOCK_SHIFT)
+//fanout of a radix tree node
+#define MAP_SHIFT 6
+#define MAP_FANOUT (1 << MAP_SHIFT)
+//smallest buffer given to the first block of a small file
+#define BLOCK_MIN 64
+
+//file data block, only the first block of a single block file may be smaller than BLOCK_SIZE;
+//a block referenced by more than its map, living in a checkpoint image, shared through the dedup index,
+//compressed or spilled to the backing file is copied before it is written
+typedef struct block {
+    size_t capacity; //bytes available in data, of the content before compression for a compressed block
+    atomic_int refs; //references, the map holding it and every pin
+    atomic_int indexed; //in the dedup index, other files may take it at any time
+    char *data; //block content, right after the header unless the block is external, NULL once spilled
+    uint32_t stored; //bytes of compressed content in data, 0 if the content is stored as is
+    uint32_t page; //page of the backing file holding the content of a spilled block
+} Block;
+
+//interior radix tree node, shared between cloned maps until one of them writes below it
+typedef struct map_node {
+    atomic_int refs; //maps and parent nodes holding the node
+    void *slots[MAP_FANOUT]; //child nodes, or blocks on the lowest level
+} MapNode;
+
+typedef struct block_map {
+    void *root; //Block when height is 0, MapNode otherwise, NULL if empty
+    int height; //number of MapNode levels above the blocks
+    size_t allocated; //bytes of blocks held, holes cost nothing
+    size_t spilled; //blocks among them paged out to the backing file
+} BlockMap;
+
+struct stats;
+struct dedup;
+struct unpack_cache;
+struct spill;
+
+//where the blocks of one file system come from and what tracks them
+typedef struct block_store {
+    Arena *arena; //memory of blocks and nodes
+    struct stats *stats; //counters of block memory
+    struct dedup *dedup; //index of shared full blocks
+    struct unpack_cache *cache; //unpacked compressed blocks
+    struct spill *spill; //backing file of paged out blocks
+} BlockStore;
+
+//zeros backing holes handed out by views
+extern const char bmap_zeros[BLOCK_SIZE];
+
+//allocate a block with one reference, the content is not initialized
+Block *block_alloc(BlockStore *store, size_t capacity);
+
+//1 if the block content lives outside the arena, in a read-only checkpoint image or the backing file
+int block_external(const Block *block);
+
+//1 if the block content was paged out to the backing file
+int block_spilled(const Block *block);
+
+//take a reference to a block
+void block_get(Block *block);
+
+//drop a reference, the last one frees the block
+void block_put(Block *block, BlockStore *store);
+
+void bmap_init(BlockMap *map);
+
+//drop every block and free every node
+void bmap_free(BlockMap *map, BlockStore *store);
+
+//make dst share the content of src, a write to either copies only the nodes and block it touches
+void bmap_clone(BlockMap *dst, const BlockMap *src);
+
+//block holding byte index << BLOCK_SHIFT, NULL for a hole
+Block *bmap_find(const BlockMap *map, size_t index);
+
+//copy count bytes at offset into buf, missing blocks read as zeros; -1 if the backing file fails
+int bmap_read(BlockStore *store, const BlockMap *map, size_t offset, void *buf, size_t count);
+
+//first offset at or after offset inside an allocated block (data 1) or a hole (data 0),
+//(size_t) -1 if no data follows; the space past the last block counts as a hole
+size_t bmap_seek(const BlockMap *map, size_t offset, int data);
+
+//put an external block of length bytes at data into the hole at index, return -1 if out of memory
+int bmap_attach(BlockMap *map, BlockStore *store, size_t index, const char *data, size_t length);
+
+//grow the map so that writes below size need no further growth step, return -1 if out of memory
+int bmap_reserve(BlockMap *map, BlockStore *store, size_t size);
+
+//copy count bytes from buf to offset, allocating blocks as needed, return -1 if out of memory
+//or the backing file fails
+int bmap_write(BlockMap *map, BlockStore *store, size_t offset, const void *buf, size_t count);
+
+//give every hole overlapping count bytes at offset a zeroed block, so writes there allocate nothing;
+//return -1 if out of memory, the blocks allocated so far stay
+int bmap_allocate(BlockMap *map, BlockStore *store, size_t offset, size_t count);
+
+//drop the blocks past size and zero the bytes past size in the block it ends inside,
+//return -1 if out of memory or the backing file fails
+int bmap_truncate(BlockMap *map, BlockStore *store, size_t size);
+
+//put block at index in place of the one there, taking over the caller's reference; -1 if out of memory
+int bmap_share(BlockMap *map, BlockStore *store, size_t index, Block *block);
+
+//bring the spilled blocks overlapping count bytes at offset back into memory,
+//return the number of blocks read back or -1 if out of memory or the backing file fails
+int bmap_fault(BlockMap *map, BlockStore *store, size_t offset, size_t count);
+
+//copy count bytes at start of a block's content to buf, decompressing or reading back as needed;
+//-1 if the backing file fails
+int block_read(BlockStore *store, const Block *block, size_t start, void *buf, size_t count);
+
+#endif //BLOCKMAP_H
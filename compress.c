@@ -0,0 +1,109 @@
+//
+// Compressed blocks. A compressed block keeps the logical capacity of the
+// block it replaced and holds stored bytes of lz data after its header; the
+// block map copies it on write like a shared block, so it is never changed.
+//
+// Reads unpack whole blocks into a small direct mapped cache, so a file read
+// sequentially or a hot block decompresses once instead of on every call.
+// Entries are keyed by the block address and dropped before the block is
+// freed, so an address reused by a later block never hits a stale entry.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "ramfs.h"
+#include "compress.h"
+#include "lz.h"
+#include "stats.h"
+
+typedef struct unpack_entry {
+    pthread_mutex_t lock;
+    const Block *block; //block unpacked into data, NULL if none
+    char data[BLOCK_SIZE];
+} UnpackEntry;
+
+int compress_init(UnpackCache *cache) {
+    //the pages of an entry are only touched once a block is unpacked into it
+    cache->entries = (UnpackEntry *) calloc(UNPACK_CACHE_BLOCKS, sizeof(UnpackEntry));
+    if (cache->entries == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < UNPACK_CACHE_BLOCKS; i++) {
+        pthread_mutex_init(&cache->entries[i].lock, NULL);
+    }
+    return 0;
+}
+
+void compress_destroy(UnpackCache *cache) {
+    if (cache->entries == NULL) {
+        return;
+    }
+    for (int i = 0; i < UNPACK_CACHE_BLOCKS; i++) {
+        pthread_mutex_destroy(&cache->entries[i].lock);
+    }
+    free(cache->entries);
+    cache->entries = NULL;
+}
+
+static UnpackEntry *cache_entry(UnpackCache *cache, const Block *block) {
+    uint64_t hash = (uint64_t) (uintptr_t) block * 0x9e3779b97f4a7c15ull;
+    return &cache->entries[(hash >> 32) % UNPACK_CACHE_BLOCKS];
+}
+
+Block *block_pack(BlockStore *store, const Block *block) {
+    if (block->stored != 0 || block_external(block) || block->capacity < PACK_MIN) {
+        return NULL;
+    }
+    char packed[BLOCK_SIZE];
+    size_t stored = lz_compress(block->data, block->capacity, packed, block->capacity - block->capacity / 8);
+    if (stored == 0) {
+        return NULL;
+    }
+    Block *result = (Block *) arena_alloc(store->arena, sizeof(Block) + stored);
+    if (result == NULL) {
+        return NULL;
+    }
+    result->capacity = block->capacity;
+    atomic_init(&result->refs, 1);
+    atomic_init(&result->indexed, 0);
+    result->data = (char *) (result + 1);
+    result->stored = (uint32_t) stored;
+    memcpy(result->data, packed, stored);
+    stats_gauge(store->stats, STATS_BLOCK_BYTES, (int64_t) stored);
+    stats_gauge(store->stats, STATS_COMPRESSED_BYTES, (int64_t) stored);
+    stats_gauge(store->stats, STATS_COMPRESSED_RAW_BYTES, (int64_t) block->capacity);
+    return result;
+}
+
+void block_unpack(BlockStore *store, const Block *block, size_t start, void *buf, size_t count) {
+    UnpackEntry *entry = cache_entry(store->cache, block);
+    pthread_mutex_lock(&entry->lock);
+    if (entry->block != block) {
+        uint64_t begin = stats_start(store->stats);
+        int result = lz_decompress(block->data, block->stored, entry->data, block->capacity);
+        stats_op(store->stats, RAMFS_OP_DECOMPRESS, begin, result == -1);
+        if (result == -1) {
+            //only blocks block_pack wrote are unpacked, so this is memory corruption
+            memset(entry->data, 0, block->capacity);
+        }
+        entry->block = block;
+    }
+    memcpy(buf, entry->data + start, count);
+    pthread_mutex_unlock(&entry->lock);
+}
+
+void compress_forget(UnpackCache *cache, const Block *block) {
+    UnpackEntry *entry = cache_entry(cache, block);
+    pthread_mutex_lock(&entry->lock);
+    if (entry->block == block) {
+        entry->block = NULL;
+    }
+    pthread_mutex_unlock(&entry->lock);
+}
+
+void compress_reset(UnpackCache *cache) {
+    for (int i = 0; i < UNPACK_CACHE_BLOCKS; i++) {
+        cache->entries[i].block = NULL;
+    }
+}
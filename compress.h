@@ -0,0 +1,38 @@
+//
+// Compressed blocks of cold file content and the cache reads unpack them through.
+//
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "blockmap.h"
+
+//smallest block worth compressing
+#define PACK_MIN 256
+//decompressed blocks kept for reads
+#define UNPACK_CACHE_BLOCKS 64
+
+struct unpack_entry;
+
+//decompressed blocks of one file system instance
+typedef struct unpack_cache {
+    struct unpack_entry *entries; //UNPACK_CACHE_BLOCKS entries, direct mapped by block address
+} UnpackCache;
+
+//-1 if out of memory
+int compress_init(UnpackCache *cache);
+
+void compress_destroy(UnpackCache *cache);
+
+//compressed copy of a block with one reference, NULL if it would not save an eighth or out of memory
+Block *block_pack(BlockStore *store, const Block *block);
+
+//copy count bytes at start of a compressed block's content to buf
+void block_unpack(BlockStore *store, const Block *block, size_t start, void *buf, size_t count);
+
+//drop a compressed block from the cache before it is freed
+void compress_forget(UnpackCache *cache, const Block *block);
+
+//empty the cache, only call while no other thread uses the file system
+void compress_reset(UnpackCache *cache);
+
+#endif //COMPRESS_H
@@ -0,0 +1,212 @@
+//
+// Full-path lookup cache (dentry cache) in front of find_file.
+//
+// Entries are immutable and replaced as a whole, so lookups take no lock.
+// Every slot carries a version and a count of changes in progress; a walk
+// result is only stored if neither moved since the lookup that missed, which
+// keeps a slow walk from caching a path that was created or deleted meanwhile.
+// Every file system instance has a cache of its own.
+//
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "ramfs.h"
+#include "dcache.h"
+#include "ebr.h"
+
+//slot count, must be a power of two
+#define DCACHE_SLOTS 16384
+//slots sharing one writer lock
+#define DCACHE_LOCKS 256
+//low half of a slot state counts changes in progress, high half is the version
+#define STATE_INFLIGHT 0xffffffffull
+#define STATE_VERSION (1ull << 32)
+
+//cached path
+typedef struct dentry {
+    uint64_t hash; //hash of the path
+    struct file *file; //cached file, NULL for a negative entry
+    size_t len; //path length
+    char path[]; //cleaned path
+} Dentry;
+
+typedef struct dcache_slot {
+    _Atomic(Dentry *) entry; //current entry, NULL if empty
+    _Atomic uint64_t state; //version and changes in progress
+} DcacheSlot;
+
+struct dcache {
+    Ebr *ebr; //domain of the lookups, replaced entries are retired there
+    DcacheSlot slots[DCACHE_SLOTS];
+    pthread_mutex_t locks[DCACHE_LOCKS];
+    struct {
+        atomic_ullong hits;
+        atomic_ullong negative_hits;
+        atomic_ullong misses;
+        atomic_ullong inserts;
+        atomic_ullong invalidations;
+    } stats;
+};
+
+Dcache *dcache_create(Ebr *ebr) {
+    //the slots start empty, calloc hands out zeroed pages without touching them
+    Dcache *cache = (Dcache *) calloc(1, sizeof(Dcache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->ebr = ebr;
+    for (int i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_init(&cache->locks[i], NULL);
+    }
+    return cache;
+}
+
+void dcache_destroy(Dcache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    dcache_clear(cache);
+    for (int i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_destroy(&cache->locks[i]);
+    }
+    free(cache);
+}
+
+static pthread_mutex_t *slot_lock(Dcache *cache, const DcacheSlot *slot) {
+    return &cache->locks[(slot - cache->slots) & (DCACHE_LOCKS - 1)];
+}
+
+static void free_entry(void *ptr, void *ctx) {
+    (void) ctx;
+    free(ptr);
+}
+
+//FNV-1a hash of a cleaned path, path_parse already made "/a//b/" and "/a/b" the same
+static uint64_t path_hash(const char *key, size_t len) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static DcacheSlot *find_slot(Dcache *cache, const char *path, size_t len, uint64_t *hash) {
+    if (len == 0) {
+        return NULL;
+    }
+    *hash = path_hash(path, len);
+    return &cache->slots[*hash & (DCACHE_SLOTS - 1)];
+}
+
+static int matches(const Dentry *entry, const char *key, size_t len, uint64_t hash) {
+    return entry != NULL && entry->hash == hash && entry->len == len && memcmp(entry->path, key, len) == 0;
+}
+
+int dcache_lookup(Dcache *cache, const char *path, size_t len, struct file **file, uint64_t *token) {
+    uint64_t hash;
+    DcacheSlot *slot = find_slot(cache, path, len, &hash);
+    if (slot == NULL) {
+        *token = STATE_INFLIGHT;
+        atomic_fetch_add_explicit(&cache->stats.misses, 1, memory_order_relaxed);
+        return 0;
+    }
+    *token = atomic_load(&slot->state);
+    Dentry *entry = atomic_load(&slot->entry);
+    if (!matches(entry, path, len, hash)) {
+        atomic_fetch_add_explicit(&cache->stats.misses, 1, memory_order_relaxed);
+        return 0;
+    }
+    if (entry->file == NULL) {
+        atomic_fetch_add_explicit(&cache->stats.negative_hits, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&cache->stats.hits, 1, memory_order_relaxed);
+    }
+    *file = entry->file;
+    return 1;
+}
+
+void dcache_insert(Dcache *cache, const char *path, size_t len, struct file *file, uint64_t token) {
+    //a change was in progress when the walk started
+    if ((token & STATE_INFLIGHT) != 0) {
+        return;
+    }
+    uint64_t hash;
+    DcacheSlot *slot = find_slot(cache, path, len, &hash);
+    if (slot == NULL) {
+        return;
+    }
+    Dentry *entry = (Dentry *) malloc(sizeof(Dentry) + len + 1);
+    if (entry == NULL) {
+        return;
+    }
+    entry->hash = hash;
+    entry->file = file;
+    entry->len = len;
+    memcpy(entry->path, path, len);
+    entry->path[len] = '\0';
+    pthread_mutex_t *lock = slot_lock(cache, slot);
+    pthread_mutex_lock(lock);
+    if (atomic_load(&slot->state) != token) {
+        //the slot saw a create or delete since the walk started
+        pthread_mutex_unlock(lock);
+        free(entry);
+        return;
+    }
+    Dentry *old = atomic_exchange(&slot->entry, entry);
+    pthread_mutex_unlock(lock);
+    if (old != NULL) {
+        ebr_retire(cache->ebr, old, free_entry, NULL);
+    }
+    atomic_fetch_add_explicit(&cache->stats.inserts, 1, memory_order_relaxed);
+}
+
+void dcache_invalidate_begin(Dcache *cache, const char *path, size_t len) {
+    uint64_t hash;
+    DcacheSlot *slot = find_slot(cache, path, len, &hash);
+    if (slot == NULL) {
+        return;
+    }
+    pthread_mutex_t *lock = slot_lock(cache, slot);
+    pthread_mutex_lock(lock);
+    atomic_fetch_add(&slot->state, STATE_VERSION + 1);
+    Dentry *old = atomic_load(&slot->entry);
+    if (matches(old, path, len, hash)) {
+        atomic_store(&slot->entry, NULL);
+        atomic_fetch_add_explicit(&cache->stats.invalidations, 1, memory_order_relaxed);
+    } else {
+        old = NULL;
+    }
+    pthread_mutex_unlock(lock);
+    if (old != NULL) {
+        ebr_retire(cache->ebr, old, free_entry, NULL);
+    }
+}
+
+void dcache_invalidate_end(Dcache *cache, const char *path, size_t len) {
+    uint64_t hash;
+    DcacheSlot *slot = find_slot(cache, path, len, &hash);
+    if (slot == NULL) {
+        return;
+    }
+    pthread_mutex_t *lock = slot_lock(cache, slot);
+    pthread_mutex_lock(lock);
+    atomic_fetch_add(&slot->state, STATE_VERSION - 1);
+    pthread_mutex_unlock(lock);
+}
+
+void dcache_clear(Dcache *cache) {
+    for (int i = 0; i < DCACHE_SLOTS; i++) {
+        free(atomic_exchange(&cache->slots[i].entry, NULL));
+    }
+}
+
+void dcache_stats(const Dcache *cache, DcacheStats *stats) {
+    stats->hits = atomic_load(&cache->stats.hits);
+    stats->negative_hits = atomic_load(&cache->stats.negative_hits);
+    stats->misses = atomic_load(&cache->stats.misses);
+    stats->inserts = atomic_load(&cache->stats.inserts);
+    stats->invalidations = atomic_load(&cache->stats.invalidations);
+}
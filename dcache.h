@@ -0,0 +1,44 @@
+//
+// Full-path lookup cache (dentry cache) in front of find_file.
+//
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "ebr.h"
+
+struct file;
+struct dcache_stats;
+
+//path cache of one file system
+typedef struct dcache Dcache;
+
+//empty cache whose lookups run inside sections of ebr, NULL if out of memory
+Dcache *dcache_create(Ebr *ebr);
+
+void dcache_destroy(Dcache *cache);
+
+//paths are the first length bytes of a path cleaned by path_parse
+
+//look up a path, return 1 and set file on hit (NULL for a negative entry), 0 on miss;
+//on a miss token receives the slot version to pass to dcache_insert
+//must be called inside an ebr section, the returned file is only valid until ebr_exit
+int dcache_lookup(Dcache *cache, const char *path, size_t length, struct file **file, uint64_t *token);
+
+//remember the result of a path walk, file may be NULL; dropped if the path was
+//invalidated since the dcache_lookup that produced token
+void dcache_insert(Dcache *cache, const char *path, size_t length, struct file *file, uint64_t token);
+
+//call before a path is created or deleted, under the lock of its parent directory
+void dcache_invalidate_begin(Dcache *cache, const char *path, size_t length);
+
+//call once the change is visible in the tree, still under the parent lock
+void dcache_invalidate_end(Dcache *cache, const char *path, size_t length);
+
+//drop every entry, only call while no other thread uses the file system
+void dcache_clear(Dcache *cache);
+
+void dcache_stats(const Dcache *cache, struct dcache_stats *stats);
+
+#endif //DCACHE_H
@@ -0,0 +1,209 @@
+//
+// Block deduplication. Full blocks written while ramfs_dedup is on are hashed
+// and looked up in a table of indexed blocks; an equal block found there
+// replaces the written one, so files with the same content share its memory.
+//
+// An indexed block is never written in place: the block map copies it on
+// write like any shared block, and its only holder takes it out of the index
+// first instead. Lookups compare the content, a hash match alone is not
+// trusted, and take their reference under the table lock, so a block whose
+// last reference is being dropped is never handed out again.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "ramfs.h"
+#include "dedup.h"
+
+//initial slot count, a power of two
+#define DEDUP_MIN_SLOTS 1024
+
+typedef struct dedup_slot {
+    uint64_t hash;
+    Block *block; //NULL if the slot is empty
+} DedupSlot;
+
+//hash of a full block, four independent lanes so the multiplies overlap
+static uint64_t block_hash(const char *data) {
+    uint64_t lanes[4] = {0x9e3779b97f4a7c15ull, 0xbf58476d1ce4e5b9ull, 0x94d049bb133111ebull, 0xff51afd7ed558ccdull};
+    for (size_t i = 0; i < BLOCK_SIZE; i += 32) {
+        for (int j = 0; j < 4; j++) {
+            uint64_t word;
+            memcpy(&word, data + i + j * 8, 8);
+            lanes[j] = (lanes[j] ^ word) * 0x9fb21c651e98df25ull;
+            lanes[j] ^= lanes[j] >> 29;
+        }
+    }
+    uint64_t hash = lanes[0] ^ (lanes[1] << 17 | lanes[1] >> 47) ^ (lanes[2] << 31 | lanes[2] >> 33) ^
+                    (lanes[3] << 47 | lanes[3] >> 17);
+    return hash * 0xd6e8feb86659fd93ull ^ hash >> 32;
+}
+
+//take a reference unless the last one is already gone
+static int block_get_live(Block *block) {
+    int refs = atomic_load(&block->refs);
+    while (refs > 0) {
+        if (atomic_compare_exchange_weak(&block->refs, &refs, refs + 1)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int table_grow(Dedup *dedup) {
+    size_t slots = dedup->slots == 0 ? DEDUP_MIN_SLOTS : dedup->slots * 2;
+    DedupSlot *grown = (DedupSlot *) calloc(slots, sizeof(DedupSlot));
+    if (grown == NULL) {
+        return -1;
+    }
+    DedupSlot *table = dedup->table;
+    for (size_t i = 0; i < dedup->slots; i++) {
+        if (table[i].block != NULL) {
+            size_t j = table[i].hash & (slots - 1);
+            while (grown[j].block != NULL) {
+                j = (j + 1) & (slots - 1);
+            }
+            grown[j] = table[i];
+        }
+    }
+    free(table);
+    dedup->table = grown;
+    dedup->slots = slots;
+    return 0;
+}
+
+//remove the slot holding block, shifting later probes back so no tombstone is needed
+static void table_remove(Dedup *dedup, Block *block, uint64_t hash) {
+    DedupSlot *table = dedup->table;
+    size_t mask = dedup->slots - 1;
+    size_t i = hash & mask;
+    while (table[i].block != block) {
+        if (table[i].block == NULL) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    for (size_t j = (i + 1) & mask; table[j].block != NULL; j = (j + 1) & mask) {
+        size_t home = table[j].hash & mask;
+        //move j into the hole at i unless its home lies cyclically in (i, j]
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i].block = NULL;
+    dedup->count--;
+}
+
+void dedup_init(Dedup *dedup) {
+    atomic_init(&dedup->enabled, 0);
+    pthread_mutex_init(&dedup->lock, NULL);
+    dedup->table = NULL;
+    dedup->slots = 0;
+    dedup->count = 0;
+    dedup->merged = 0;
+}
+
+void dedup_destroy(Dedup *dedup) {
+    free(dedup->table);
+    dedup->table = NULL;
+    pthread_mutex_destroy(&dedup->lock);
+}
+
+void dedup_enable(Dedup *dedup, int on) {
+    atomic_store(&dedup->enabled, on != 0);
+}
+
+int dedup_enabled(Dedup *dedup) {
+    return atomic_load_explicit(&dedup->enabled, memory_order_relaxed);
+}
+
+void dedup_block(BlockMap *map, BlockStore *store, size_t index) {
+    Dedup *dedup = store->dedup;
+    Block *block = bmap_find(map, index);
+    if (block == NULL || block->capacity != BLOCK_SIZE || block_external(block) || block->stored != 0 ||
+        atomic_load(&block->indexed)) {
+        return;
+    }
+    uint64_t hash = block_hash(block->data);
+    Block *same = NULL;
+    pthread_mutex_lock(&dedup->lock);
+    DedupSlot *table = dedup->table;
+    size_t mask = dedup->slots - 1;
+    for (size_t i = hash & mask; dedup->slots > 0 && table[i].block != NULL; i = (i + 1) & mask) {
+        if (table[i].hash == hash && memcmp(table[i].block->data, block->data, BLOCK_SIZE) == 0 &&
+            block_get_live(table[i].block) == 0) {
+            same = table[i].block;
+            break;
+        }
+    }
+    if (same == NULL) {
+        if ((dedup->count + 1) * 2 <= dedup->slots || table_grow(dedup) == 0) {
+            table = dedup->table;
+            mask = dedup->slots - 1;
+            size_t i = hash & mask;
+            while (table[i].block != NULL) {
+                i = (i + 1) & mask;
+            }
+            table[i].hash = hash;
+            table[i].block = block;
+            dedup->count++;
+            atomic_store(&block->indexed, 1);
+        }
+        pthread_mutex_unlock(&dedup->lock);
+        return;
+    }
+    dedup->merged++;
+    pthread_mutex_unlock(&dedup->lock);
+    if (bmap_share(map, store, index, same) == -1) {
+        block_put(same, store);
+    }
+}
+
+void dedup_forget(Dedup *dedup, Block *block) {
+    //the content of an indexed block never changed, so neither did its hash
+    uint64_t hash = block_hash(block->data);
+    pthread_mutex_lock(&dedup->lock);
+    table_remove(dedup, block, hash);
+    pthread_mutex_unlock(&dedup->lock);
+}
+
+int dedup_unindex(Dedup *dedup, Block *block) {
+    uint64_t hash = block_hash(block->data);
+    pthread_mutex_lock(&dedup->lock);
+    //lookups take references under the lock, so a single holder stays the only one
+    int result = -1;
+    if (atomic_load(&block->refs) == 1) {
+        table_remove(dedup, block, hash);
+        atomic_store(&block->indexed, 0);
+        result = 0;
+    }
+    pthread_mutex_unlock(&dedup->lock);
+    return result;
+}
+
+void dedup_reset(Dedup *dedup) {
+    pthread_mutex_lock(&dedup->lock);
+    free(dedup->table);
+    dedup->table = NULL;
+    dedup->slots = 0;
+    dedup->count = 0;
+    dedup->merged = 0;
+    pthread_mutex_unlock(&dedup->lock);
+}
+
+void dedup_stats(Dedup *dedup, RamfsDedupStats *stats) {
+    memset(stats, 0, sizeof(RamfsDedupStats));
+    pthread_mutex_lock(&dedup->lock);
+    for (size_t i = 0; i < dedup->slots; i++) {
+        if (dedup->table[i].block != NULL) {
+            stats->blocks++;
+            stats->references += atomic_load(&dedup->table[i].block->refs);
+        }
+    }
+    stats->merged = dedup->merged;
+    pthread_mutex_unlock(&dedup->lock);
+    stats->saved_bytes = (stats->references - stats->blocks) * BLOCK_SIZE;
+    stats->ratio = stats->blocks > 0 ? (double) stats->references / (double) stats->blocks : 1.0;
+}
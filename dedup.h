@@ -0,0 +1,54 @@
+//
+// Content-addressed index of full blocks, shared between files by ramfs_dedup.
+//
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "blockmap.h"
+
+struct dedup_slot;
+struct ramfs_dedup_stats;
+
+//index of one file system instance
+typedef struct dedup {
+    atomic_int enabled; //ramfs_dedup is on
+    pthread_mutex_t lock;
+    //open addressing with linear probing, at most half full
+    struct dedup_slot *table;
+    size_t slots;
+    size_t count;
+    uint64_t merged; //written blocks replaced by an indexed one
+} Dedup;
+
+void dedup_init(Dedup *dedup);
+
+//free the index, the blocks in it belong to their files
+void dedup_destroy(Dedup *dedup);
+
+//index full blocks from now on, or stop indexing new ones
+void dedup_enable(Dedup *dedup, int on);
+
+//1 while ramfs_dedup is on
+int dedup_enabled(Dedup *dedup);
+
+//replace the full block at index by an equal indexed block, or index it if there is none;
+//caller holds the write lock of the file owning map
+void dedup_block(BlockMap *map, BlockStore *store, size_t index);
+
+//take a block that lost its last reference out of the index, before it is freed
+void dedup_forget(Dedup *dedup, Block *block);
+
+//take an indexed block out of the index so its only holder may write it in place,
+//-1 if others hold it and it must be copied
+int dedup_unindex(Dedup *dedup, Block *block);
+
+//count the blocks in the index and the references to them
+void dedup_stats(Dedup *dedup, struct ramfs_dedup_stats *stats);
+
+//empty the index, only call while no other thread uses the file system
+void dedup_reset(Dedup *dedup);
+
+#endif //DEDUP_H
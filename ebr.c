@@ -0,0 +1,212 @@
+//
+// Epoch based reclamation. Lock-free readers run between ebr_enter and ebr_exit;
+// memory unlinked while they may still see it is handed to ebr_retire and freed
+// only after every thread has left the epoch it was retired in.
+//
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "ebr.h"
+
+//low bit of a thread epoch marks the thread as inside a section
+#define EBR_ACTIVE 1
+//retire calls between two attempts to advance the epoch
+#define EBR_BATCH 64
+
+//memory waiting for its grace period
+typedef struct retired {
+    void *ptr;
+    ebr_free_fn fn;
+    void *ctx;
+} Retired;
+
+//memory retired during one epoch
+typedef struct limbo {
+    Retired *items;
+    size_t count;
+    size_t capacity;
+    uint64_t epoch; //epoch the items were retired in
+} Limbo;
+
+//per thread record of a domain, freed with the domain and reused after its thread exits
+typedef struct ebr_thread {
+    _Atomic uint64_t epoch; //observed epoch shifted left by one, EBR_ACTIVE while inside a section
+    _Atomic uint64_t sections; //outermost sections entered, tells a waiting retire that a section ended
+    atomic_int in_use; //owned by a live thread
+    struct ebr_thread *next; //next record in the registry
+    int nesting; //depth of nested sections
+    size_t pending; //retire calls since the last advance attempt
+    Limbo limbo[3]; //one list per epoch that can still hold readers
+    pthread_mutex_t lock; //serializes the owner with ebr_drain
+} EbrThread;
+
+static void release_record(void *record) {
+    atomic_store(&((EbrThread *) record)->in_use, 0);
+}
+
+int ebr_init(Ebr *ebr) {
+    atomic_init(&ebr->epoch, 1);
+    atomic_init(&ebr->registry, NULL);
+    return pthread_key_create(&ebr->key, release_record) == 0 ? 0 : -1;
+}
+
+//claim a record left by an exited thread or register a new one, NULL if out of memory
+static EbrThread *thread_record(Ebr *ebr) {
+    EbrThread *record = (EbrThread *) pthread_getspecific(ebr->key);
+    if (record != NULL) {
+        return record;
+    }
+    for (record = atomic_load(&ebr->registry); record != NULL; record = record->next) {
+        int free_record = 0;
+        if (atomic_compare_exchange_strong(&record->in_use, &free_record, 1)) {
+            break;
+        }
+    }
+    if (record == NULL) {
+        record = (EbrThread *) calloc(1, sizeof(EbrThread));
+        if (record == NULL) {
+            return NULL;
+        }
+        atomic_init(&record->in_use, 1);
+        pthread_mutex_init(&record->lock, NULL);
+        EbrThread *head = atomic_load(&ebr->registry);
+        do {
+            record->next = head;
+        } while (!atomic_compare_exchange_weak(&ebr->registry, &head, record));
+    }
+    pthread_setspecific(ebr->key, record);
+    return record;
+}
+
+static void free_limbo(Limbo *limbo) {
+    for (size_t i = 0; i < limbo->count; i++) {
+        limbo->items[i].fn(limbo->items[i].ptr, limbo->items[i].ctx);
+    }
+    limbo->count = 0;
+}
+
+//free the lists whose grace period is over, caller holds record->lock
+static void collect(Ebr *ebr, EbrThread *record) {
+    uint64_t epoch = atomic_load(&ebr->epoch);
+    for (int i = 0; i < 3; i++) {
+        Limbo *limbo = &record->limbo[i];
+        if (limbo->count > 0 && limbo->epoch + 2 <= epoch) {
+            free_limbo(limbo);
+        }
+    }
+}
+
+//move the global epoch forward if every active thread has seen it
+static void try_advance(Ebr *ebr) {
+    uint64_t epoch = atomic_load(&ebr->epoch);
+    for (EbrThread *record = atomic_load(&ebr->registry); record != NULL; record = record->next) {
+        uint64_t local = atomic_load(&record->epoch);
+        if ((local & EBR_ACTIVE) && (local >> 1) != epoch) {
+            return;
+        }
+    }
+    atomic_compare_exchange_strong(&ebr->epoch, &epoch, epoch + 1);
+}
+
+int ebr_enter(Ebr *ebr) {
+    EbrThread *record = thread_record(ebr);
+    if (record == NULL) {
+        return -1;
+    }
+    if (record->nesting++ == 0) {
+        atomic_fetch_add(&record->sections, 1);
+        atomic_store(&record->epoch, (atomic_load(&ebr->epoch) << 1) | EBR_ACTIVE);
+    }
+    return 0;
+}
+
+void ebr_exit(Ebr *ebr) {
+    EbrThread *record = (EbrThread *) pthread_getspecific(ebr->key);
+    if (--record->nesting == 0) {
+        atomic_store_explicit(&record->epoch, 0, memory_order_release);
+    }
+}
+
+//wait until every section other threads were in has ended, self may be NULL;
+//the caller's own section is skipped since it no longer reaches what it retires
+static void synchronize(Ebr *ebr, EbrThread *self) {
+    for (EbrThread *record = atomic_load(&ebr->registry); record != NULL; record = record->next) {
+        if (record == self) {
+            continue;
+        }
+        //a changed count means the section seen here ended and a later one began
+        uint64_t sections = atomic_load(&record->sections);
+        while ((atomic_load(&record->epoch) & EBR_ACTIVE) && atomic_load(&record->sections) == sections) {
+            sched_yield();
+        }
+    }
+}
+
+void ebr_retire(Ebr *ebr, void *ptr, ebr_free_fn fn, void *ctx) {
+    EbrThread *record = thread_record(ebr);
+    if (record == NULL) {
+        synchronize(ebr, NULL);
+        fn(ptr, ctx);
+        return;
+    }
+    pthread_mutex_lock(&record->lock);
+    uint64_t epoch = atomic_load(&ebr->epoch);
+    Limbo *limbo = &record->limbo[epoch % 3];
+    if (limbo->count > 0 && limbo->epoch != epoch) {
+        //the list still holds an older epoch, at least three epochs back, so it is safe
+        free_limbo(limbo);
+    }
+    if (limbo->count == limbo->capacity) {
+        size_t capacity = limbo->capacity == 0 ? 16 : limbo->capacity * 2;
+        Retired *items = (Retired *) realloc(limbo->items, capacity * sizeof(Retired));
+        if (items == NULL) {
+            //the list cannot grow, free ptr once its grace period is over instead
+            pthread_mutex_unlock(&record->lock);
+            synchronize(ebr, record);
+            fn(ptr, ctx);
+            return;
+        }
+        limbo->items = items;
+        limbo->capacity = capacity;
+    }
+    limbo->epoch = epoch;
+    limbo->items[limbo->count].ptr = ptr;
+    limbo->items[limbo->count].fn = fn;
+    limbo->items[limbo->count].ctx = ctx;
+    limbo->count++;
+    if (++record->pending >= EBR_BATCH) {
+        record->pending = 0;
+        try_advance(ebr);
+        collect(ebr, record);
+    }
+    pthread_mutex_unlock(&record->lock);
+}
+
+void ebr_drain(Ebr *ebr) {
+    for (EbrThread *record = atomic_load(&ebr->registry); record != NULL; record = record->next) {
+        pthread_mutex_lock(&record->lock);
+        for (int i = 0; i < 3; i++) {
+            free_limbo(&record->limbo[i]);
+        }
+        pthread_mutex_unlock(&record->lock);
+    }
+}
+
+void ebr_destroy(Ebr *ebr) {
+    ebr_drain(ebr);
+    //threads still running keep the key's value, but a deleted key is never read again
+    pthread_key_delete(ebr->key);
+    EbrThread *record = atomic_load(&ebr->registry);
+    while (record != NULL) {
+        EbrThread *next = record->next;
+        for (int i = 0; i < 3; i++) {
+            free(record->limbo[i].items);
+        }
+        pthread_mutex_destroy(&record->lock);
+        free(record);
+        record = next;
+    }
+    atomic_store(&ebr->registry, NULL);
+}
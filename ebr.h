@@ -0,0 +1,44 @@
+//
+// Epoch based reclamation. Lock-free readers run between ebr_enter and ebr_exit;
+// memory unlinked while they may still see it is handed to ebr_retire and freed
+// only after every thread has left the epoch it was retired in.
+//
+#ifndef EBR_H
+#define EBR_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+//callback releasing retired memory
+typedef void (*ebr_free_fn)(void *ptr, void *ctx);
+
+struct ebr_thread;
+
+//reclamation domain, a reader in one domain never holds back the memory of another
+typedef struct ebr {
+    _Atomic uint64_t epoch; //global epoch of the domain
+    struct ebr_thread *_Atomic registry; //records of the threads that used the domain
+    pthread_key_t key; //record of the calling thread
+} Ebr;
+
+//-1 if out of thread keys
+int ebr_init(Ebr *ebr);
+
+//free everything still retired and the thread records, only call while no thread uses the domain
+void ebr_destroy(Ebr *ebr);
+
+//start a read side section, sections nest; -1 if the thread record cannot be allocated,
+//in which case no section was started and ebr_exit must not be called
+int ebr_enter(Ebr *ebr);
+
+//end a read side section
+void ebr_exit(Ebr *ebr);
+
+//free ptr with fn(ptr, ctx) once no reader of the domain can still hold it; when out of memory
+//this waits for the sections other threads are in to end and frees ptr before returning
+void ebr_retire(Ebr *ebr, void *ptr, ebr_free_fn fn, void *ctx);
+
+//free everything retired so far, only call while no thread can still reach that memory
+void ebr_drain(Ebr *ebr);
+
+#endif //EBR_H
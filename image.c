@@ -0,0 +1,304 @@
+//
+// Checkpoint image: the file tree and block contents laid out for mmap.
+//
+// Full blocks are stored page aligned, so a restored file points its blocks
+// straight into a private read-only mapping and pages are faulted in on first
+// access instead of being read up front.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+
+struct image_writer {
+    int fd; //temporary file
+    char *path; //final path
+    char *tmp_path; //path of the temporary file
+    uint64_t cursor; //end of the block data
+    uint64_t journal_lsn; //stored in the header
+    ImageRecord *records;
+    size_t record_count, record_capacity;
+    ImageExtent *extents;
+    size_t extent_count, extent_capacity;
+    char *names;
+    size_t names_size, names_capacity;
+};
+
+//grow an array to hold one more item
+static int reserve(void **items, size_t *capacity, size_t count, size_t item_size, size_t need) {
+    if (count + need <= *capacity) {
+        return 0;
+    }
+    size_t grown = *capacity == 0 ? 64 : *capacity * 2;
+    while (grown < count + need) {
+        grown *= 2;
+    }
+    void *memory = realloc(*items, grown * item_size);
+    if (memory == NULL) {
+        return -1;
+    }
+    *items = memory;
+    *capacity = grown;
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t count, uint64_t offset) {
+    const char *src = (const char *) buf;
+    while (count > 0) {
+        ssize_t written = pwrite(fd, src, count, (off_t) offset);
+        if (written <= 0) {
+            return -1;
+        }
+        src += written;
+        offset += written;
+        count -= written;
+    }
+    return 0;
+}
+
+//sync the directory holding path, which makes a rename into it survive a crash; -1 on error
+static int sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash == NULL ? strdup(".") : slash == path ? strdup("/") : strndup(path, slash - path);
+    if (dir == NULL) {
+        return -1;
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+ImageWriter *image_create(const char *path, uint64_t journal_lsn) {
+    ImageWriter *writer = (ImageWriter *) calloc(1, sizeof(ImageWriter));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->path = strdup(path);
+    writer->tmp_path = (char *) malloc(strlen(path) + 5);
+    if (writer->path == NULL || writer->tmp_path == NULL) {
+        free(writer->path);
+        free(writer->tmp_path);
+        free(writer);
+        return NULL;
+    }
+    sprintf(writer->tmp_path, "%s.tmp", path);
+    writer->fd = open(writer->tmp_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (writer->fd == -1) {
+        free(writer->path);
+        free(writer->tmp_path);
+        free(writer);
+        return NULL;
+    }
+    //the header is written last, the first page is kept for it
+    writer->cursor = BLOCK_SIZE;
+    writer->journal_lsn = journal_lsn;
+    return writer;
+}
+
+int64_t image_add(ImageWriter *writer, uint32_t parent, int type, const char *name, uint64_t size,
+                  BlockStore *store, const BlockMap *content) {
+    size_t name_length = strlen(name);
+    if (reserve((void **) &writer->records, &writer->record_capacity, writer->record_count,
+                sizeof(ImageRecord), 1) == -1 ||
+        reserve((void **) &writer->names, &writer->names_capacity, writer->names_size, 1, name_length) == -1) {
+        return -1;
+    }
+    ImageRecord *record = &writer->records[writer->record_count];
+    memset(record, 0, sizeof(ImageRecord));
+    record->parent = parent;
+    record->type = type;
+    record->size = size;
+    record->name_offset = writer->names_size;
+    record->name_length = name_length;
+    record->extent_first = writer->extent_count;
+    if (name_length > 0) {
+        memcpy(writer->names + writer->names_size, name, name_length);
+    }
+    writer->names_size += name_length;
+    //every allocated block up to the size, holes stay holes
+    size_t offset = 0;
+    while (offset < size && (offset = bmap_seek(content, offset, 1)) < size) {
+        size_t index = offset >> BLOCK_SHIFT;
+        Block *block = bmap_find(content, index);
+        size_t length = block->capacity;
+        if (content->height == 0 && length > size) {
+            //the spare capacity of a single short block is never read
+            length = size;
+        }
+        if (reserve((void **) &writer->extents, &writer->extent_capacity, writer->extent_count,
+                    sizeof(ImageExtent), 1) == -1) {
+            return -1;
+        }
+        if (length == BLOCK_SIZE) {
+            writer->cursor = (writer->cursor + BLOCK_SIZE - 1) & ~(uint64_t) (BLOCK_SIZE - 1);
+        }
+        const char *data = block->data;
+        char unpacked[BLOCK_SIZE];
+        if (block->stored != 0 || block_spilled(block)) {
+            if (block_read(store, block, 0, unpacked, length) == -1) {
+                return -1;
+            }
+            data = unpacked;
+        }
+        if (write_all(writer->fd, data, length, writer->cursor) == -1) {
+            return -1;
+        }
+        ImageExtent *extent = &writer->extents[writer->extent_count++];
+        extent->index = index;
+        extent->offset = writer->cursor;
+        extent->length = length;
+        writer->cursor += length;
+        record->extent_count++;
+        offset = (index + 1) << BLOCK_SHIFT;
+    }
+    return (int64_t) writer->record_count++;
+}
+
+static void writer_free(ImageWriter *writer) {
+    free(writer->records);
+    free(writer->extents);
+    free(writer->names);
+    free(writer->path);
+    free(writer->tmp_path);
+    free(writer);
+}
+
+int image_finish(ImageWriter *writer) {
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.block_size = BLOCK_SIZE;
+    //tables are 8 byte aligned so the mapping can use them in place
+    uint64_t cursor = (writer->cursor + 7) & ~(uint64_t) 7;
+    header.record_count = writer->record_count;
+    header.records_offset = cursor;
+    cursor += writer->record_count * sizeof(ImageRecord);
+    header.extent_count = writer->extent_count;
+    header.extents_offset = cursor;
+    cursor += writer->extent_count * sizeof(ImageExtent);
+    header.names_size = writer->names_size;
+    header.names_offset = cursor;
+    cursor += writer->names_size;
+    header.file_size = cursor;
+    header.journal_lsn = writer->journal_lsn;
+    int result = -1;
+    if (write_all(writer->fd, writer->records, writer->record_count * sizeof(ImageRecord),
+                  header.records_offset) == 0 &&
+        write_all(writer->fd, writer->extents, writer->extent_count * sizeof(ImageExtent),
+                  header.extents_offset) == 0 &&
+        write_all(writer->fd, writer->names, writer->names_size, header.names_offset) == 0 &&
+        write_all(writer->fd, &header, sizeof(header), 0) == 0 &&
+        ftruncate(writer->fd, (off_t) header.file_size) == 0 && fsync(writer->fd) == 0) {
+        //a crash leaves either the old image or the complete new one; the directory is synced before
+        //the journal is compacted past the new image, so a crash never keeps the shorter journal only
+        result = rename(writer->tmp_path, writer->path);
+        if (result == 0) {
+            result = sync_dir(writer->path);
+        }
+    }
+    close(writer->fd);
+    if (result == -1) {
+        unlink(writer->tmp_path);
+    }
+    writer_free(writer);
+    return result;
+}
+
+void image_abort(ImageWriter *writer) {
+    close(writer->fd);
+    unlink(writer->tmp_path);
+    writer_free(writer);
+}
+
+//1 if [offset, offset + size) lies inside the image
+static int in_image(const Image *image, uint64_t offset, uint64_t size) {
+    return offset <= image->length && size <= image->length - offset;
+}
+
+//check every table entry once, so restore can trust them
+static int image_valid(const Image *image) {
+    const ImageHeader *header = image->header;
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 || header->version != IMAGE_VERSION ||
+        header->block_size != BLOCK_SIZE || header->file_size != image->length || header->record_count == 0 ||
+        header->record_count > UINT32_MAX || header->records_offset % 8 != 0 || header->extents_offset % 8 != 0 ||
+        header->extent_count > image->length / sizeof(ImageExtent) ||
+        !in_image(image, header->records_offset, header->record_count * sizeof(ImageRecord)) ||
+        !in_image(image, header->extents_offset, header->extent_count * sizeof(ImageExtent)) ||
+        !in_image(image, header->names_offset, header->names_size)) {
+        return 0;
+    }
+    for (uint64_t i = 0; i < header->record_count; i++) {
+        const ImageRecord *record = &image->records[i];
+        if ((i > 0 && record->parent >= i) || record->type > 1 ||
+            record->name_offset > header->names_size || record->name_length > header->names_size - record->name_offset ||
+            record->extent_first > header->extent_count ||
+            record->extent_count > header->extent_count - record->extent_first) {
+            return 0;
+        }
+        //blocks stay inside the file size, which also bounds the depth of its radix tree
+        uint64_t blocks = (record->size >> BLOCK_SHIFT) + ((record->size & (BLOCK_SIZE - 1)) != 0);
+        uint64_t next = 0;
+        for (uint64_t j = 0; j < record->extent_count; j++) {
+            const ImageExtent *extent = &image->extents[record->extent_first + j];
+            if (extent->index < next || extent->index >= blocks || extent->length == 0 || extent->length > BLOCK_SIZE ||
+                !in_image(image, extent->offset, extent->length) ||
+                (extent->length < BLOCK_SIZE && record->extent_count > 1)) {
+                return 0;
+            }
+            next = extent->index + 1;
+        }
+    }
+    return 1;
+}
+
+Image *image_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    Image *image = NULL;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(ImageHeader)) {
+        //private and read-only: pages are faulted in on first use and never written back
+        void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        image = base != MAP_FAILED ? (Image *) malloc(sizeof(Image)) : NULL;
+        if (image != NULL) {
+            image->base = (const char *) base;
+            image->length = st.st_size;
+            image->header = (const ImageHeader *) base;
+            image->records = (const ImageRecord *) (image->base + image->header->records_offset);
+            image->extents = (const ImageExtent *) (image->base + image->header->extents_offset);
+            image->names = image->base + image->header->names_offset;
+            if (!image_valid(image)) {
+                image_close(image);
+                image = NULL;
+            }
+        } else if (base != MAP_FAILED) {
+            munmap(base, st.st_size);
+        }
+    }
+    close(fd);
+    if (image == NULL) {
+        //ENOENT stays reserved for a missing image
+        errno = EINVAL;
+    }
+    return image;
+}
+
+void image_close(Image *image) {
+    if (image != NULL) {
+        munmap((void *) image->base, image->length);
+        free(image);
+    }
+}
@@ -0,0 +1,81 @@
+//
+// Checkpoint image: the file tree and block contents laid out for mmap.
+//
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include "blockmap.h"
+
+#define IMAGE_MAGIC "RAMFSIMG"
+#define IMAGE_VERSION 2
+
+//file header, the tables follow the block data
+typedef struct image_header {
+    char magic[8]; //IMAGE_MAGIC
+    uint32_t version; //IMAGE_VERSION
+    uint32_t block_size; //BLOCK_SIZE of the writer
+    uint64_t record_count; //files, the root first and every parent before its children
+    uint64_t records_offset;
+    uint64_t extent_count; //blocks of all files
+    uint64_t extents_offset;
+    uint64_t names_size; //bytes of all names
+    uint64_t names_offset;
+    uint64_t file_size; //length of the whole image
+    uint64_t journal_lsn; //last journal record the image holds, 0 without a journal
+} ImageHeader;
+
+//one file or directory
+typedef struct image_record {
+    uint32_t parent; //record index of the parent directory, 0 for the root itself
+    uint32_t type; //0 file, 1 directory
+    uint64_t size; //file size
+    uint64_t name_offset; //name inside the name table
+    uint32_t name_length;
+    uint32_t reserved;
+    uint64_t extent_first; //first block inside the extent table
+    uint64_t extent_count; //blocks of the file, ascending by index
+} ImageRecord;
+
+//one block of a file
+typedef struct image_extent {
+    uint64_t index; //block index inside the file
+    uint64_t offset; //block data inside the image, page aligned for full blocks
+    uint64_t length; //bytes stored, BLOCK_SIZE except for a single short block
+} ImageExtent;
+
+struct image_writer;
+typedef struct image_writer ImageWriter;
+
+//mapped image, the tables point into the mapping
+typedef struct image {
+    const char *base; //start of the mapping
+    size_t length; //bytes mapped
+    const ImageHeader *header;
+    const ImageRecord *records;
+    const ImageExtent *extents;
+    const char *names;
+} Image;
+
+//start writing an image to path holding the journal up to journal_lsn, NULL on error;
+//the file appears only once image_finish succeeds
+ImageWriter *image_create(const char *path, uint64_t journal_lsn);
+
+//append a file with the given content, parent is the index returned for its directory;
+//store reads back compressed and paged out blocks. Return the index of the record, -1 on error
+int64_t image_add(ImageWriter *writer, uint32_t parent, int type, const char *name, uint64_t size,
+                  BlockStore *store, const BlockMap *content);
+
+//write the tables, sync and move the image into place, then free the writer; -1 on error
+int image_finish(ImageWriter *writer);
+
+//drop an unfinished image
+void image_abort(ImageWriter *writer);
+
+//map and validate an image, NULL if it can not be read or is malformed; errno is ENOENT only
+//if there is no image at path
+Image *image_open(const char *path);
+
+void image_close(Image *image);
+
+#endif //IMAGE_H
@@ -0,0 +1,95 @@
+//
+// Inode table. The name, name hash and child index of every file live in one
+// cache line of a table indexed by 32-bit inode numbers, so a path walk reads
+// an index slot and then the inode it names, instead of chasing the file,
+// its heap-allocated name and its index through separate allocations.
+//
+// The table grows a page at a time and pages never move, which lets readers
+// index it without locks. Freed numbers are reused first to keep the table
+// dense; the caller frees a number only after an ebr grace period.
+//
+#include <stdlib.h>
+#include <string.h>
+#include "inode.h"
+
+static int add_page(InodeTable *table) {
+    if (table->page_count == INODE_PAGE_COUNT) {
+        return -1;
+    }
+    Inode *page = (Inode *) aligned_alloc(sizeof(Inode), INODE_PAGE * sizeof(Inode));
+    if (page == NULL) {
+        return -1;
+    }
+    memset(page, 0, INODE_PAGE * sizeof(Inode));
+    atomic_store_explicit(&table->pages[table->page_count], page, memory_order_release);
+    table->page_count++;
+    return 0;
+}
+
+int inode_init(InodeTable *table) {
+    //the page pointers are only touched as pages are added
+    table->pages = (_Atomic(Inode *) *) calloc(INODE_PAGE_COUNT, sizeof(Inode *));
+    if (table->pages == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&table->lock, NULL);
+    table->page_count = 0;
+    if (inode_reset(table) == -1) {
+        inode_destroy(table);
+        return -1;
+    }
+    return 0;
+}
+
+void inode_destroy(InodeTable *table) {
+    for (size_t i = 0; i < table->page_count; i++) {
+        free(atomic_load(&table->pages[i]));
+    }
+    free(table->pages);
+    table->pages = NULL;
+    table->page_count = 0;
+    pthread_mutex_destroy(&table->lock);
+}
+
+uint32_t inode_alloc(InodeTable *table) {
+    pthread_mutex_lock(&table->lock);
+    uint32_t ino = table->free_head;
+    if (ino != INODE_NONE) {
+        table->free_head = inode_get(table, ino)->next_free;
+        memset(inode_get(table, ino), 0, sizeof(Inode));
+    } else if (table->next_ino / INODE_PAGE < table->page_count || add_page(table) == 0) {
+        //entries of a new page are zeroed already
+        ino = table->next_ino++;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return ino;
+}
+
+void inode_free(InodeTable *table, uint32_t ino) {
+    if (ino == INODE_NONE) {
+        return;
+    }
+    pthread_mutex_lock(&table->lock);
+    inode_get(table, ino)->next_free = table->free_head;
+    table->free_head = ino;
+    pthread_mutex_unlock(&table->lock);
+}
+
+int inode_reset(InodeTable *table) {
+    for (size_t i = 0; i < table->page_count; i++) {
+        free(atomic_load(&table->pages[i]));
+        atomic_store(&table->pages[i], NULL);
+    }
+    table->page_count = 0;
+    table->free_head = INODE_NONE;
+    //INODE_NONE takes the first entry of the first page
+    table->next_ino = INODE_NONE + 1;
+    return add_page(table);
+}
+
+size_t inode_table_bytes(InodeTable *table) {
+    pthread_mutex_lock(&table->lock);
+    size_t bytes = table->page_count * INODE_PAGE * sizeof(Inode);
+    pthread_mutex_unlock(&table->lock);
+    return bytes;
+}
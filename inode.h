@@ -0,0 +1,64 @@
+//
+// Inode table.
+//
+#ifndef INODE_H
+#define INODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "path.h"
+
+//inodes per page of the table, and pages; inode numbers stay below their product
+#define INODE_PAGE 1024
+#define INODE_PAGE_COUNT 65536
+//number of no inode, its entry always exists and stays empty
+#define INODE_NONE 0
+
+struct file;
+struct dir_index;
+
+//the part of a file a path walk reads, one cache line per inode
+typedef struct inode {
+    _Atomic(struct dir_index *) index; //name index of the children, directory only
+    struct file *file; //the rest of the file
+    uint32_t hash; //hash of the name
+    uint32_t next_free; //next number on the free list while unused
+    uint8_t name_length;
+    char name[PATH_NAME_MAX + 1]; //file name, terminated
+} __attribute__((aligned(64))) Inode;
+
+//inodes of one file system
+typedef struct inode_table {
+    _Atomic(Inode *) *pages; //INODE_PAGE_COUNT pages, NULL until first needed; pages never move once published
+    pthread_mutex_t lock; //guards the fields below
+    uint32_t next_ino; //lowest number never handed out
+    uint32_t free_head; //freed numbers, linked by next_free
+    size_t page_count; //pages allocated, always the first ones
+} InodeTable;
+
+//entry of an inode number handed out by inode_alloc, or of INODE_NONE
+static inline Inode *inode_get(const InodeTable *table, uint32_t ino) {
+    Inode *page = atomic_load_explicit(&table->pages[ino / INODE_PAGE], memory_order_acquire);
+    return &page[ino % INODE_PAGE];
+}
+
+//table holding only INODE_NONE, -1 if out of memory
+int inode_init(InodeTable *table);
+
+void inode_destroy(InodeTable *table);
+
+//zeroed entry for a new file, INODE_NONE if the table is full or out of memory
+uint32_t inode_alloc(InodeTable *table);
+
+//return a number to the table once no lock-free reader can still reach its entry
+void inode_free(InodeTable *table, uint32_t ino);
+
+//free every page and start over with only INODE_NONE; no other thread may use the table meanwhile
+int inode_reset(InodeTable *table);
+
+//bytes held by the table pages
+size_t inode_table_bytes(InodeTable *table);
+
+#endif //INODE_H
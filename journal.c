@@ -0,0 +1,429 @@
+//
+// Write-ahead journal. Every change appends a record to an in-memory buffer
+// while it still holds the locks that order it, and waits for the disk only
+// after letting them go.
+//
+// Group commit: the first waiter that finds no sync in progress becomes the
+// leader, takes the whole buffer, writes and syncs it; records appended
+// meanwhile go to the other buffer and are written by the next leader in one
+// write and one fdatasync, however many threads are waiting for them.
+//
+// An async journal skips the waiting and leaves the syncs to a background
+// thread, a crash then loses at most the last interval.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "ramfs.h"
+#include "journal.h"
+
+struct journal {
+    int fd; //journal file, opened for append
+    char *path;
+    int durability; //JOURNAL_ASYNC or JOURNAL_SYNC
+    pthread_mutex_t lock; //guards everything below
+    pthread_cond_t synced; //signalled whenever a sync ends
+    pthread_cond_t wake; //wakes the background thread
+    char *buffer; //records not written yet
+    size_t size, capacity;
+    char *spare; //buffer being written by the leader
+    size_t spare_capacity;
+    uint64_t next_lsn; //lsn of the next record
+    uint64_t durable; //last lsn synced
+    int syncing; //a leader is writing and syncing
+    int failed; //a write or sync failed, nothing is durable any more
+    int stop; //the background thread should exit
+    pthread_t thread; //background thread of an async journal
+};
+
+//crc32 tables for slicing by 8, table k advances a byte k positions further
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xedb88320U : crc >> 1;
+        }
+        crc_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            crc_table[k][i] = crc_table[0][crc_table[k - 1][i] & 0xff] ^ (crc_table[k - 1][i] >> 8);
+        }
+    }
+}
+
+//continue a crc32, start with 0; every written byte passes through here
+static uint32_t crc32(uint32_t crc, const void *data, size_t length) {
+    const unsigned char *p = (const unsigned char *) data;
+    crc = ~crc;
+    for (; length >= 8; length -= 8, p += 8) {
+        uint32_t low = crc ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+        crc = crc_table[7][low & 0xff] ^ crc_table[6][(low >> 8) & 0xff] ^ crc_table[5][(low >> 16) & 0xff] ^
+              crc_table[4][low >> 24] ^ crc_table[3][p[4]] ^ crc_table[2][p[5]] ^ crc_table[1][p[6]] ^
+              crc_table[0][p[7]];
+    }
+    for (; length > 0; length--, p++) {
+        crc = crc_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+//crc of the path and data, computed before taking the lock
+static uint32_t payload_crc(const char *path, size_t path_length, const struct riovec *iov, int iovcnt) {
+    uint32_t crc = crc32(0, path, path_length);
+    for (int i = 0; i < iovcnt; i++) {
+        crc = crc32(crc, iov[i].iov_base, iov[i].iov_len);
+    }
+    return crc;
+}
+
+//crc of a record, the payload crc continued over the header fields after the crc field
+static uint32_t record_crc(const JournalRecord *record, uint32_t payload) {
+    const char *fields = (const char *) &record->lsn;
+    return crc32(payload, fields, sizeof(JournalRecord) - (fields - (const char *) record));
+}
+
+static int write_all(int fd, const void *buf, size_t count) {
+    const char *src = (const char *) buf;
+    while (count > 0) {
+        ssize_t written = write(fd, src, count);
+        if (written <= 0) {
+            return -1;
+        }
+        src += written;
+        count -= written;
+    }
+    return 0;
+}
+
+//sync the directory holding path, which makes a rename into it survive a crash; -1 on error
+static int sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash == NULL ? strdup(".") : slash == path ? strdup("/") : strndup(path, slash - path);
+    if (dir == NULL) {
+        return -1;
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+//whole file in one buffer, NULL if it can not be read
+static char *read_file(int fd, size_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return NULL;
+    }
+    char *data = (char *) malloc(st.st_size > 0 ? st.st_size : 1);
+    size_t done = 0;
+    while (data != NULL && done < (size_t) st.st_size) {
+        ssize_t n = pread(fd, data + done, st.st_size - done, (off_t) done);
+        if (n <= 0) {
+            free(data);
+            return NULL;
+        }
+        done += n;
+    }
+    *size = done;
+    return data;
+}
+
+//length of the intact record at data, 0 if it is torn or corrupt
+static size_t record_check(const char *data, size_t size, uint64_t last_lsn) {
+    JournalRecord record;
+    if (size < sizeof(JournalRecord)) {
+        return 0;
+    }
+    memcpy(&record, data, sizeof(record));
+    if (record.magic != JOURNAL_MAGIC || record.path_length == 0 ||
+        record.path_length > size - sizeof(JournalRecord) ||
+        record.length > size - sizeof(JournalRecord) - record.path_length ||
+        (last_lsn != 0 && record.lsn != last_lsn + 1)) {
+        return 0;
+    }
+    const char *path = data + sizeof(JournalRecord);
+    struct riovec iov = {(void *) (path + record.path_length), record.length};
+    if (path[record.path_length - 1] != '\0' ||
+        record_crc(&record, payload_crc(path, record.path_length, &iov, 1)) != record.crc) {
+        return 0;
+    }
+    return sizeof(JournalRecord) + record.path_length + record.length;
+}
+
+//write and sync the buffer as the leader, caller holds the lock and no sync is in progress
+static void journal_sync(Journal *journal) {
+    char *data = journal->buffer;
+    size_t size = journal->size;
+    uint64_t last = journal->next_lsn - 1;
+    journal->buffer = journal->spare;
+    journal->spare = data;
+    size_t capacity = journal->capacity;
+    journal->capacity = journal->spare_capacity;
+    journal->spare_capacity = capacity;
+    journal->size = 0;
+    journal->syncing = 1;
+    pthread_mutex_unlock(&journal->lock);
+    int ok = (size == 0 || write_all(journal->fd, data, size) == 0) && fdatasync(journal->fd) == 0;
+    pthread_mutex_lock(&journal->lock);
+    journal->syncing = 0;
+    if (ok) {
+        journal->durable = last;
+    } else {
+        journal->failed = 1;
+    }
+    pthread_cond_broadcast(&journal->synced);
+}
+
+//sync in the background every interval, or earlier once enough is buffered
+static void *journal_thread(void *arg) {
+    Journal *journal = (Journal *) arg;
+    pthread_mutex_lock(&journal->lock);
+    while (!journal->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += JOURNAL_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&journal->wake, &journal->lock, &deadline);
+        if (!journal->syncing && !journal->failed && journal->size > 0) {
+            journal_sync(journal);
+        }
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return NULL;
+}
+
+Journal *journal_open(const char *path, int durability, uint64_t after,
+                      void (*replay)(const JournalEntry *entry, void *ctx), void *ctx) {
+    pthread_once(&crc_once, crc_init);
+    Journal *journal = (Journal *) calloc(1, sizeof(Journal));
+    if (journal == NULL) {
+        return NULL;
+    }
+    journal->durability = durability;
+    journal->path = strdup(path);
+    journal->fd = open(path, O_CREAT | O_RDWR | O_APPEND, 0644);
+    size_t size = 0;
+    char *data = journal->fd != -1 ? read_file(journal->fd, &size) : NULL;
+    if (journal->path == NULL || data == NULL) {
+        if (journal->fd != -1) {
+            close(journal->fd);
+        }
+        free(data);
+        free(journal->path);
+        free(journal);
+        return NULL;
+    }
+    //replay up to the first record that did not make it to the disk whole
+    size_t offset = 0, length;
+    uint64_t last = 0;
+    while ((length = record_check(data + offset, size - offset, last)) > 0) {
+        JournalRecord record;
+        memcpy(&record, data + offset, sizeof(record));
+        if (record.lsn > after) {
+            JournalEntry entry;
+            entry.op = record.op;
+            entry.lsn = record.lsn;
+            entry.path = data + offset + sizeof(JournalRecord);
+            entry.offset = record.offset;
+            entry.data = entry.path + record.path_length;
+            entry.length = record.length;
+            replay(&entry, ctx);
+        }
+        last = record.lsn;
+        offset += length;
+    }
+    free(data);
+    if (offset < size && (ftruncate(journal->fd, (off_t) offset) == -1 || fsync(journal->fd) == -1)) {
+        close(journal->fd);
+        free(journal->path);
+        free(journal);
+        return NULL;
+    }
+    //a checkpoint may be ahead of a journal it was compacted from
+    journal->next_lsn = (last > after ? last : after) + 1;
+    journal->durable = journal->next_lsn - 1;
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->synced, NULL);
+    pthread_cond_init(&journal->wake, NULL);
+    if (durability == JOURNAL_ASYNC && pthread_create(&journal->thread, NULL, journal_thread, journal) != 0) {
+        journal->durability = JOURNAL_SYNC;
+    }
+    return journal;
+}
+
+uint64_t journal_append(Journal *journal, int op, const char *path, uint64_t offset,
+                        const struct riovec *iov, int iovcnt) {
+    JournalRecord record;
+    memset(&record, 0, sizeof(record));
+    record.magic = JOURNAL_MAGIC;
+    record.offset = offset;
+    record.op = (uint16_t) op;
+    record.path_length = (uint16_t) (strlen(path) + 1);
+    for (int i = 0; i < iovcnt; i++) {
+        record.length += iov[i].iov_len;
+    }
+    size_t need = sizeof(JournalRecord) + record.path_length + record.length;
+    uint32_t payload = payload_crc(path, record.path_length, iov, iovcnt);
+    pthread_mutex_lock(&journal->lock);
+    if (journal->failed) {
+        pthread_mutex_unlock(&journal->lock);
+        return 0;
+    }
+    if (journal->size + need > journal->capacity) {
+        size_t capacity = journal->capacity == 0 ? 64 * 1024 : journal->capacity * 2;
+        while (capacity < journal->size + need) {
+            capacity *= 2;
+        }
+        char *grown = (char *) realloc(journal->buffer, capacity);
+        if (grown == NULL) {
+            //a hole in the lsn sequence would stop replay here anyway
+            journal->failed = 1;
+            pthread_mutex_unlock(&journal->lock);
+            return 0;
+        }
+        journal->buffer = grown;
+        journal->capacity = capacity;
+    }
+    record.lsn = journal->next_lsn++;
+    record.crc = record_crc(&record, payload);
+    char *dst = journal->buffer + journal->size;
+    memcpy(dst, &record, sizeof(record));
+    dst += sizeof(record);
+    memcpy(dst, path, record.path_length);
+    dst += record.path_length;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > 0) {
+            memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+            dst += iov[i].iov_len;
+        }
+    }
+    journal->size += need;
+    if (journal->durability == JOURNAL_ASYNC && journal->size >= JOURNAL_FLUSH_BYTES) {
+        pthread_cond_signal(&journal->wake);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return record.lsn;
+}
+
+int journal_wait(Journal *journal, uint64_t lsn) {
+    pthread_mutex_lock(&journal->lock);
+    if (journal->durability == JOURNAL_SYNC) {
+        while (!journal->failed && journal->durable < lsn) {
+            if (journal->syncing) {
+                //the records buffered now go with the next sync
+                pthread_cond_wait(&journal->synced, &journal->lock);
+            } else {
+                journal_sync(journal);
+            }
+        }
+    }
+    int result = journal->failed || lsn == 0 ? -1 : 0;
+    pthread_mutex_unlock(&journal->lock);
+    return result;
+}
+
+uint64_t journal_lsn(Journal *journal) {
+    pthread_mutex_lock(&journal->lock);
+    uint64_t lsn = journal->next_lsn - 1;
+    pthread_mutex_unlock(&journal->lock);
+    return lsn;
+}
+
+//write everything buffered, caller holds the lock; -1 if the journal failed
+static int journal_drain(Journal *journal) {
+    while (journal->syncing) {
+        pthread_cond_wait(&journal->synced, &journal->lock);
+    }
+    if (!journal->failed && journal->size > 0) {
+        journal_sync(journal);
+    }
+    return journal->failed ? -1 : 0;
+}
+
+int journal_compact(Journal *journal, uint64_t lsn) {
+    pthread_mutex_lock(&journal->lock);
+    //appends wait for the lock, so the file holds every record while it is rewritten
+    if (journal_drain(journal) == -1) {
+        pthread_mutex_unlock(&journal->lock);
+        return -1;
+    }
+    size_t size = 0;
+    char *data = read_file(journal->fd, &size);
+    if (data == NULL) {
+        pthread_mutex_unlock(&journal->lock);
+        return -1;
+    }
+    size_t offset = 0, length;
+    uint64_t last = 0;
+    while ((length = record_check(data + offset, size - offset, last)) > 0) {
+        JournalRecord record;
+        memcpy(&record, data + offset, sizeof(record));
+        if (record.lsn > lsn) {
+            break;
+        }
+        last = record.lsn;
+        offset += length;
+    }
+    //the kept tail replaces the journal in one rename, a crash leaves either file whole
+    char *tmp_path = (char *) malloc(strlen(journal->path) + 5);
+    int result = -1;
+    if (tmp_path != NULL) {
+        sprintf(tmp_path, "%s.tmp", journal->path);
+        int fd = open(tmp_path, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0644);
+        if (fd != -1) {
+            if (write_all(fd, data + offset, size - offset) == 0 && fsync(fd) == 0 &&
+                rename(tmp_path, journal->path) == 0) {
+                close(journal->fd);
+                journal->fd = fd;
+                result = sync_dir(journal->path);
+            } else {
+                close(fd);
+                unlink(tmp_path);
+            }
+        }
+        free(tmp_path);
+    }
+    free(data);
+    pthread_mutex_unlock(&journal->lock);
+    return result;
+}
+
+void journal_close(Journal *journal) {
+    if (journal == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&journal->lock);
+    journal->stop = 1;
+    pthread_cond_signal(&journal->wake);
+    pthread_mutex_unlock(&journal->lock);
+    if (journal->durability == JOURNAL_ASYNC) {
+        pthread_join(journal->thread, NULL);
+    }
+    pthread_mutex_lock(&journal->lock);
+    journal_drain(journal);
+    pthread_mutex_unlock(&journal->lock);
+    close(journal->fd);
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->synced);
+    pthread_cond_destroy(&journal->wake);
+    free(journal->buffer);
+    free(journal->spare);
+    free(journal->path);
+    free(journal);
+}
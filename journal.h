@@ -0,0 +1,76 @@
+//
+// Write-ahead journal of the changes made since the last checkpoint.
+//
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOURNAL_MAGIC 0x4c4e524aU
+
+//operations, the path is the cleaned absolute path of the file
+#define JOURNAL_MKDIR 1
+#define JOURNAL_RMDIR 2
+#define JOURNAL_UNLINK 3
+#define JOURNAL_CREATE 4 //empty file
+#define JOURNAL_TRUNCATE 5 //offset is the new size
+#define JOURNAL_WRITE 6 //data written at offset
+
+//when appended records reach the disk
+#define JOURNAL_ASYNC 1 //a background thread syncs every JOURNAL_INTERVAL_MS
+#define JOURNAL_SYNC 2 //journal_wait syncs, waiters arriving during a sync share the next one
+
+#define JOURNAL_INTERVAL_MS 10
+//an async journal wakes its thread early once this much is buffered
+#define JOURNAL_FLUSH_BYTES (1 << 20)
+
+//record header, followed by the path with its terminator and then the data
+typedef struct journal_record {
+    uint32_t magic; //JOURNAL_MAGIC
+    uint32_t crc; //crc32 of the path and data, continued over the header fields after this one
+    uint64_t lsn; //log sequence number, ascending without gaps inside one journal
+    uint64_t offset; //write offset or new size
+    uint64_t length; //bytes of data
+    uint16_t op; //JOURNAL_MKDIR ...
+    uint16_t path_length; //bytes of the path including the terminator
+    uint32_t reserved;
+} JournalRecord;
+
+//one record handed to the replay callback
+typedef struct journal_entry {
+    int op;
+    uint64_t lsn;
+    const char *path;
+    uint64_t offset;
+    const void *data;
+    size_t length;
+} JournalEntry;
+
+struct journal;
+typedef struct journal Journal;
+struct riovec;
+
+//open or create the journal at path and replay every intact record after lsn after in order,
+//passing ctx along; a torn tail left by a crash is cut off; NULL on error
+Journal *journal_open(const char *path, int durability, uint64_t after,
+                      void (*replay)(const JournalEntry *entry, void *ctx), void *ctx);
+
+//buffer a record and return its lsn, 0 if the journal failed; callers append while holding the
+//locks that order the change against conflicting ones, so the journal replays them in that order
+uint64_t journal_append(Journal *journal, int op, const char *path, uint64_t offset,
+                        const struct riovec *iov, int iovcnt);
+
+//wait until the record lsn is durable as far as the durability level asks, -1 if the journal failed
+int journal_wait(Journal *journal, uint64_t lsn);
+
+//lsn of the last record appended
+uint64_t journal_lsn(Journal *journal);
+
+//drop the records up to lsn once a checkpoint holds them, -1 on error
+int journal_compact(Journal *journal, uint64_t lsn);
+
+//write and sync everything buffered, then close
+void journal_close(Journal *journal);
+
+#endif //JOURNAL_H
@@ -0,0 +1,167 @@
+//
+// LZ77 block codec. The output is a series of sequences, each a token byte
+// holding a literal length and a match length in its two nibbles, the
+// literals, and a 16 bit little endian match offset; a nibble of 15 is
+// continued by bytes added to it until one is below 255. The last sequence
+// has literals only and ends the input.
+//
+// The compressor is greedy with a single hash table of recent positions, which
+// is fast and finds the repeats that make cold file data compressible; the
+// decompressor checks every length and offset against both buffers.
+//
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+//write a length beyond its nibble, NULL if out of room
+static unsigned char *put_length(unsigned char *op, const unsigned char *end, size_t length) {
+    while (length >= 255) {
+        if (op >= end) {
+            return NULL;
+        }
+        *op++ = 255;
+        length -= 255;
+    }
+    if (op >= end) {
+        return NULL;
+    }
+    *op++ = (unsigned char) length;
+    return op;
+}
+
+//write one sequence, match_length 0 for the last one; NULL if out of room
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *end, const unsigned char *literals,
+                                   size_t literal_length, size_t offset, size_t match_length) {
+    if (op >= end) {
+        return NULL;
+    }
+    size_t match_code = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+    unsigned char *token = op++;
+    *token = (unsigned char) ((literal_length < 15 ? literal_length : 15) << 4 | (match_code < 15 ? match_code : 15));
+    if (literal_length >= 15 && (op = put_length(op, end, literal_length - 15)) == NULL) {
+        return NULL;
+    }
+    if ((size_t) (end - op) < literal_length) {
+        return NULL;
+    }
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+    if (match_length == 0) {
+        return op;
+    }
+    if (end - op < 2) {
+        return NULL;
+    }
+    *op++ = (unsigned char) offset;
+    *op++ = (unsigned char) (offset >> 8);
+    if (match_code >= 15 && (op = put_length(op, end, match_code - 15)) == NULL) {
+        return NULL;
+    }
+    return op;
+}
+
+size_t lz_compress(const void *src, size_t count, void *dst, size_t capacity) {
+    if (count > LZ_MAX_INPUT) {
+        return 0;
+    }
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char *op = (unsigned char *) dst;
+    const unsigned char *end = op + capacity;
+    //position + 1 of the last occurrence of every hash, 0 if none
+    uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t ip = 0, anchor = 0;
+    while (ip + LZ_MIN_MATCH <= count) {
+        uint32_t value = read32(in + ip);
+        uint32_t hash = lz_hash(value);
+        size_t candidate = table[hash];
+        table[hash] = (uint16_t) (ip + 1);
+        if (candidate == 0 || read32(in + candidate - 1) != value) {
+            ip++;
+            continue;
+        }
+        size_t ref = candidate - 1;
+        size_t length = LZ_MIN_MATCH;
+        while (ip + length < count && in[ref + length] == in[ip + length]) {
+            length++;
+        }
+        op = put_sequence(op, end, in + anchor, ip - anchor, ip - ref, length);
+        if (op == NULL) {
+            return 0;
+        }
+        ip += length;
+        anchor = ip;
+    }
+    op = put_sequence(op, end, in + anchor, count - anchor, 0, 0);
+    return op != NULL ? (size_t) (op - (unsigned char *) dst) : 0;
+}
+
+//read a length continued beyond its nibble, -1 if the input ends first
+static int get_length(const unsigned char **ip, const unsigned char *end, size_t *length) {
+    unsigned char byte;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+int lz_decompress(const void *src, size_t count, void *dst, size_t size) {
+    const unsigned char *ip = (const unsigned char *) src;
+    const unsigned char *in_end = ip + count;
+    unsigned char *op = (unsigned char *) dst;
+    unsigned char *out_end = op + size;
+    while (ip < in_end) {
+        unsigned char token = *ip++;
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && get_length(&ip, in_end, &literal_length) == -1) {
+            return -1;
+        }
+        if ((size_t) (in_end - ip) < literal_length || (size_t) (out_end - op) < literal_length) {
+            return -1;
+        }
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+        if (ip == in_end) {
+            break;
+        }
+        if (in_end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && get_length(&ip, in_end, &match_length) == -1) {
+            return -1;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t) (op - (unsigned char *) dst) ||
+            (size_t) (out_end - op) < match_length) {
+            return -1;
+        }
+        //byte by byte, a match may overlap the bytes it produces
+        const unsigned char *match = op - offset;
+        for (size_t i = 0; i < match_length; i++) {
+            op[i] = match[i];
+        }
+        op += match_length;
+    }
+    return op == out_end ? 0 : -1;
+}
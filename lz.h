@@ -0,0 +1,18 @@
+//
+// LZ77 block codec in the LZ4 block format, for blocks below 64 KB.
+//
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+//largest input lz_compress accepts, offsets are 16 bit
+#define LZ_MAX_INPUT 65535
+
+//compress count bytes of src into dst, return the compressed length or 0 if it does not fit in capacity
+size_t lz_compress(const void *src, size_t count, void *dst, size_t capacity);
+
+//decompress count bytes of src into exactly size bytes at dst, -1 if the input is malformed
+int lz_decompress(const void *src, size_t count, void *dst, size_t size);
+
+#endif //LZ_H
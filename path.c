@@ -0,0 +1,109 @@
+//
+// Path parsing. A pathname is checked and cleaned without allocating: one
+// sweep checks the characters, 16 bytes at a time for long paths, and a second
+// copies the names found with memchr into the caller's Path, dropping the
+// repeated and trailing slashes the lookups and the path cache would skip.
+// Names are then handed out as slices of the cleaned text.
+//
+#include <string.h>
+#include "path.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//1 for letters, digits, '.' and '/'
+static int path_char(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '.' && c <= '9');
+}
+
+//-1 if a byte is outside the path characters, else 1 if one of them is a '.' and 0 if none is
+static int check_chars(const char *s, size_t length) {
+    size_t i = 0;
+    int dot = 0;
+#ifdef __SSE2__
+    if (length >= PATH_SIMD_MIN) {
+        //'.', '/' and the digits are the one range 0x2e..0x39, and setting 0x20 folds the letters to
+        //lower case; bytes over 0x7f compare as negative and fall outside both
+        const __m128i punct_low = _mm_set1_epi8('.' - 1), punct_high = _mm_set1_epi8('9' + 1);
+        const __m128i alpha_low = _mm_set1_epi8('a' - 1), alpha_high = _mm_set1_epi8('z' + 1);
+        const __m128i fold = _mm_set1_epi8(0x20), dots = _mm_set1_epi8('.');
+        int dot_mask = 0;
+        for (; i + 16 <= length; i += 16) {
+            __m128i c = _mm_loadu_si128((const __m128i *) (s + i));
+            __m128i punct = _mm_and_si128(_mm_cmpgt_epi8(c, punct_low), _mm_cmplt_epi8(c, punct_high));
+            __m128i lower = _mm_or_si128(c, fold);
+            __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, alpha_low), _mm_cmplt_epi8(lower, alpha_high));
+            if (_mm_movemask_epi8(_mm_or_si128(punct, alpha)) != 0xffff) {
+                return -1;
+            }
+            dot_mask |= _mm_movemask_epi8(_mm_cmpeq_epi8(c, dots));
+        }
+        dot = dot_mask != 0;
+    }
+#endif
+    for (; i < length; i++) {
+        if (!path_char((unsigned char) s[i])) {
+            return -1;
+        }
+        dot |= s[i] == '.';
+    }
+    return dot;
+}
+
+int path_parse(Path *path, const char *pathname) {
+    if (pathname == NULL || pathname[0] != '/') {
+        return -1;
+    }
+    size_t length = strnlen(pathname, PATH_MAX_LENGTH + 1);
+    if (length > PATH_MAX_LENGTH) {
+        return -1;
+    }
+    int dot = check_chars(pathname, length);
+    if (dot == -1) {
+        return -1;
+    }
+    const char *p = pathname, *end = pathname + length;
+    char *text = path->text;
+    size_t out = 0;
+    path->name = 0;
+    while (p < end) {
+        if (*p == '/') {
+            p++;
+            continue;
+        }
+        const char *slash = (const char *) memchr(p, '/', end - p);
+        if (slash == NULL) {
+            slash = end;
+        }
+        size_t name_length = slash - p;
+        if (name_length > PATH_NAME_MAX) {
+            return -1;
+        }
+        text[out++] = '/';
+        path->name = out;
+        memcpy(text + out, p, name_length);
+        out += name_length;
+        p = slash;
+    }
+    text[out] = '\0';
+    path->length = out;
+    path->trailing_slash = end[-1] == '/';
+    path->dot = dot;
+    return 0;
+}
+
+size_t path_parent(const Path *path) {
+    return path->name - 1;
+}
+
+const char *path_next(const char *text, size_t length, size_t *pos, size_t *name_length) {
+    if (*pos >= length) {
+        return NULL;
+    }
+    //every name follows exactly one slash
+    const char *name = text + *pos + 1;
+    const char *slash = (const char *) memchr(name, '/', length - *pos - 1);
+    *name_length = slash != NULL ? (size_t) (slash - name) : length - *pos - 1;
+    *pos += 1 + *name_length;
+    return name;
+}
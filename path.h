@@ -0,0 +1,35 @@
+//
+// Path parsing shared by every call taking a pathname.
+//
+#ifndef PATH_H
+#define PATH_H
+
+#include <stddef.h>
+
+//longest accepted path, counted before slashes are dropped, and longest file name
+#define PATH_MAX_LENGTH 1024
+#define PATH_NAME_MAX 32
+//paths at least this long are checked 16 bytes at a time
+#define PATH_SIMD_MIN 16
+
+//a checked path, cleaned into a buffer the caller owns
+typedef struct path {
+    char text[PATH_MAX_LENGTH + 1]; //repeated and trailing slashes dropped, "" for the root
+    size_t length; //length of text
+    size_t name; //offset of the last component in text, 0 for the root
+    int trailing_slash; //the pathname ended in '/'
+    int dot; //a '.' occurs in the path
+} Path;
+
+//check and clean pathname into path: -1 unless it is absolute, at most PATH_MAX_LENGTH bytes of
+//letters, digits, '.' and '/', and no name is longer than PATH_NAME_MAX bytes
+int path_parse(Path *path, const char *pathname);
+
+//length of the parent directory's path in text, 0 for the root's children; not for the root itself
+size_t path_parent(const Path *path);
+
+//next name in the first length bytes of a cleaned path after *pos, NULL after the last one;
+//advances *pos and sets *name_length
+const char *path_next(const char *text, size_t length, size_t *pos, size_t *name_length);
+
+#endif //PATH_H
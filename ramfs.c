@@ -2,23 +2,101 @@
 // Created by xgs on 23-1-26.
 //
 #include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
 #include "ramfs.h"
+#include "dcache.h"
+#include "path.h"
+#include "inode.h"
+#include "blockmap.h"
+#include "slab.h"
+#include "ebr.h"
+#include "snapshot.h"
+#include "image.h"
+#include "journal.h"
+#include "stats.h"
+#include "dedup.h"
+#include "compress.h"
+#include "spill.h"
+#include "share.h"
 
 #define MAX_FD_COUNT 65558
+//an fd number is a slot index in the low bits and the slot generation above it
+#define FD_SLOT_BITS 17
+#define FD_SLOT_MASK ((1 << FD_SLOT_BITS) - 1)
+#define FD_GEN_MASK ((1 << (31 - FD_SLOT_BITS)) - 1)
+//the fd table is allocated in pages of FD_PAGE slots when first needed
+#define FD_PAGE_SHIFT 10
+#define FD_PAGE (1 << FD_PAGE_SHIFT)
+#define FD_PAGE_COUNT ((MAX_FD_COUNT + FD_PAGE - 1) / FD_PAGE)
 
 #define FILE 0
 #define DIRECTORY 1
+//listing position of a directory descriptor, kept in the child list but in no index
+#define DIR_CURSOR 2
+
+//link count of a removed file, it can not be opened any more
+#define FILE_DEAD (-1)
+//largest file size, far beyond memory, so offset arithmetic never overflows
+#define FILE_SIZE_MAX ((off_t) 1 << 48)
+
+//initial slot count of a directory index, must be a power of two
+#define DIR_INDEX_MIN 8
+//marks a deleted slot so that probing continues past it, never an inode number
+#define DIR_TOMBSTONE UINT32_MAX
+
+struct file;
+
+//content of a file replaced after a snapshot saw it
+typedef struct file_version {
+    uint64_t from; //generation the content was current from, until the next newer version
+    off_t size; //file size
+    BlockMap content; //file content, sharing blocks with the newer versions
+    struct file_version *next; //older version
+} FileVersion;
+
+//slot of a directory index, eight share a cache line
+typedef struct dir_slot {
+    _Atomic uint32_t hash; //hash of the entry name
+    _Atomic uint32_t ino; //inode of the entry, INODE_NONE if empty, DIR_TOMBSTONE if deleted
+} DirSlot;
+
+//name index of a directory, open addressing with linear probing;
+//readers probe it without locks, so a resize publishes a new index and retires the old one
+typedef struct dir_index {
+    size_t capacity; //slot count, power of two
+    size_t count; //live entries
+    size_t used; //live entries and tombstones
+    DirSlot slots[]; //slot array
+} DirIndex;
 
 typedef struct file {
-    char *name; //file name or directory name
+    uint32_t ino; //inode with the name and the child index, INODE_NONE for cursors and snapshot copies
     int type; //type 0:file 1:directory
-    int size; //file size
+    off_t size; //file size, the blocks of content may reach past it after rfallocate
     struct file *parent; //parent directory
     struct file *child; //child directory or file
+    struct file *last_child; //last child, new children are appended after it
     struct file *sibling; //sibling directory or file
-    char *content; //file content
-    int link_count; //link count
+    struct file *prev_sibling; //previous sibling, NULL for the first child
+    BlockMap content; //file content
+    _Atomic(Block *) linear; //contiguous copy of a multi block file shared by rmmap, dropped by writes
+    atomic_int link_count; //link count, FILE_DEAD once removed
+    pthread_rwlock_t lock; //guards the children of a directory or the size and content of a file
+    uint64_t born; //generation that created the file
+    uint64_t died; //generation that removed it, SNAP_LIVE while in the tree
+    uint64_t content_gen; //generation of the last change to size or content
+    FileVersion *versions; //older contents still seen by snapshots, newest first
+    struct file *ghosts; //removed children still seen by snapshots, linked by sibling, directory only
+    struct file *retained_next; //next file on the retained list
+    int retained; //on the retained list
+    _Atomic uint64_t touched; //tier clock at the last read or write
+    uint64_t packed; //touched when the content was last compressed, UINT64_MAX if never
 } File;
 
 //file descriptor
@@ -26,466 +104,3183 @@ typedef struct fd {
     off_t offset; //file descriptor
     int flags; //file descriptor flags
     File *file; //file
+    pthread_mutex_t lock; //serializes calls on the descriptor
+    int snapshot; //file is a private frozen copy from a snapshot
+    File *cursor; //rreaddir position in the children of a directory, NULL before the first call
 } Fd;
 
-//file descriptor table
+//page of the file descriptor table
+typedef struct fd_page {
+    uint64_t used[FD_PAGE / 64]; //bit set for every slot in use
+    _Atomic(Fd *) fds[FD_PAGE]; //open file descriptors
+    _Atomic uint32_t gens[FD_PAGE]; //generation of every slot, bumped by rclose
+} FdPage;
+
+//file descriptor table, lookups are lock-free
 typedef struct fd_table {
-    Fd *fds[MAX_FD_COUNT]; //file descriptor table
+    _Atomic(FdPage *) pages[FD_PAGE_COUNT]; //pages, NULL until first needed
+    uint64_t full[(FD_PAGE_COUNT + 63) / 64]; //bit set for every page without a free slot
+    pthread_mutex_t lock; //guards the bitmaps
 } FdTable;
 
+//state shared by the operations of one rsubmit
+typedef struct batch {
+    File *parent; //directory of the previous path, kept valid by the ebr section of the batch
+    char parent_path[PATH_MAX_LENGTH + 1]; //its cleaned path
+    size_t parent_length;
+    uint64_t lsn; //last journal record of the running operation, committed once for the batch
+    int deferred; //records wait once at the end of the batch, else every change waits for its own
+} Batch;
 
 //util function
-File *find_file(const char *pathname);
+File *find_file(Ramfs *fs, const char *path, size_t length);
 
-File *create_file(const char *pathname, int type);
+static File *walk_path(Ramfs *fs, const char *path, size_t length);
 
-//justify if the pathname is valid
-int justify_path(const char *pathname);
+File *create_file(Ramfs *fs, const Path *path, int type, int opened, int *exists);
 
-char *clean_path(const char *pathname);
+static File *create_in(Ramfs *fs, File *parent, const Path *path, int type, int opened, int *exists, Batch *batch);
 
-//file system
-FdTable fd_table;
-File *root;
+//lookups sharing the parent directory of consecutive batch operations
+static File *batch_find(Ramfs *fs, Batch *batch, const Path *path);
 
-//init file system
-void init_ramfs() {
-    //init file descriptor table
-    for (int i = 0; i < MAX_FD_COUNT; i++) {
-        fd_table.fds[i] = NULL;
+static File *batch_create(Ramfs *fs, Batch *batch, const Path *path, int type, int opened, int *exists);
+
+//durability
+static int recover(Ramfs *fs);
+
+//drop the rmmap mappings of an instance about to be reset, rmunmap refuses them afterwards
+static void mapping_forget(Ramfs *fs);
+
+//tier thread of ramfs_compress and ramfs_memory_budget, paused while the tree is replaced
+static void tier_stop(Ramfs *fs);
+
+static int tier_start(Ramfs *fs);
+
+//file descriptor table
+int fd_alloc(Ramfs *fs, Fd *fd1);
+
+Fd *fd_get(Ramfs *fs, int fd);
+
+int fd_release(Ramfs *fs, int fd);
+
+//directory index
+static Inode *inode_lookup(Ramfs *fs, Inode *dir, const char *name, size_t len);
+
+File *dir_lookup(Ramfs *fs, File *dir, const char *name, size_t len);
+
+int dir_insert(Ramfs *fs, File *dir, File *file);
+
+void dir_remove(Ramfs *fs, File *dir, File *file);
+
+//file system instance
+struct ramfs {
+    //memory of every file, directory index, block and descriptor
+    Arena arena;
+    File *root;
+    FdTable fd_table;
+    InodeTable inodes;
+    //readers of this instance, so a long section here holds back no other instance's memory
+    Ebr ebr;
+    Dcache *dcache;
+    Snapshots snaps;
+    //files holding ghosts or versions for snapshots, oldest first
+    File *retained_head;
+    File *retained_tail;
+    pthread_mutex_t retained_lock;
+    //checkpoint image the restored blocks point into, unmapped with the file system
+    Image *image;
+    //durability level and paths of ramfs_durability
+    int durability;
+    char *checkpoint_path;
+    char *journal_path;
+    //journal of the changes since the last checkpoint, NULL without durability
+    Journal *journal;
+    //checkpoints run one at a time, so the journal is never compacted past the image in place
+    pthread_mutex_t checkpoint_lock;
+    //what blocks are allocated from and accounted to, pointing at the parts below
+    BlockStore store;
+    Stats stats;
+    Dedup dedup;
+    UnpackCache cache;
+    Spill spill;
+    //compression and paging out of cold content, see ramfs_compress and ramfs_memory_budget;
+    //the clock is in ms and only moves while the tier thread runs
+    _Atomic uint64_t tier_clock;
+    int compress_idle_ms;
+    atomic_size_t memory_budget;
+    atomic_int tier_running;
+    pthread_t tier_thread;
+    pthread_mutex_t tier_lock;
+    pthread_cond_t tier_cond;
+    //live rmmap mappings by address, open addressing kept free of tombstones
+    struct mapping *mappings;
+    size_t mapping_capacity;
+    size_t mapping_count;
+    pthread_mutex_t mapping_lock;
+    //rview results not released yet
+    atomic_long views;
+    //image shared with other processes by ramfs_share
+    Share share;
+    int ready; //parts outside the arena are set up
+};
+
+//instance of the calls without an instance argument
+static Ramfs fs_default;
+
+//set up the parts of an instance outside its arena once, -1 if out of memory
+static int fs_prepare(Ramfs *fs) {
+    if (fs->ready) {
+        return 0;
+    }
+    if (ebr_init(&fs->ebr) == -1) {
+        return -1;
+    }
+    fs->dcache = dcache_create(&fs->ebr);
+    if (fs->dcache == NULL) {
+        ebr_destroy(&fs->ebr);
+        return -1;
+    }
+    if (inode_init(&fs->inodes) == -1) {
+        dcache_destroy(fs->dcache);
+        fs->dcache = NULL;
+        ebr_destroy(&fs->ebr);
+        return -1;
+    }
+    if (stats_init(&fs->stats) == -1) {
+        inode_destroy(&fs->inodes);
+        dcache_destroy(fs->dcache);
+        fs->dcache = NULL;
+        ebr_destroy(&fs->ebr);
+        return -1;
+    }
+    if (compress_init(&fs->cache) == -1) {
+        stats_destroy(&fs->stats);
+        inode_destroy(&fs->inodes);
+        dcache_destroy(fs->dcache);
+        fs->dcache = NULL;
+        ebr_destroy(&fs->ebr);
+        return -1;
     }
+    dedup_init(&fs->dedup);
+    spill_init(&fs->spill);
+    fs->store.arena = &fs->arena;
+    fs->store.stats = &fs->stats;
+    fs->store.dedup = &fs->dedup;
+    fs->store.cache = &fs->cache;
+    fs->store.spill = &fs->spill;
+    snap_init(&fs->snaps);
+    share_init(&fs->share);
+    pthread_mutex_init(&fs->retained_lock, NULL);
+    pthread_mutex_init(&fs->checkpoint_lock, NULL);
+    pthread_mutex_init(&fs->tier_lock, NULL);
+    pthread_cond_init(&fs->tier_cond, NULL);
+    pthread_mutex_init(&fs->mapping_lock, NULL);
+    fs->ready = 1;
+    return 0;
+}
+
+//start an empty file system in an instance, dropping a previous one in one go
+static void reset_ramfs(Ramfs *fs) {
+    //whatever the instance retired points into its arena
+    ebr_drain(&fs->ebr);
+    mapping_forget(fs);
+    arena_reset(&fs->arena);
+    image_close(fs->image);
+    fs->image = NULL;
+    dcache_clear(fs->dcache);
+    snap_reset(&fs->snaps);
+    dedup_reset(&fs->dedup);
+    compress_reset(&fs->cache);
+    spill_reset(&fs->spill);
+    fs->retained_head = NULL;
+    fs->retained_tail = NULL;
+    atomic_store(&fs->views, 0);
+    //init file descriptor table
+    memset(&fs->fd_table, 0, sizeof(fs->fd_table));
+    pthread_mutex_init(&fs->fd_table.lock, NULL);
     //create root directory
-    root = (File *) malloc(sizeof(File));
-    root->type = DIRECTORY;
-    root->name = "/";
-    root->size = 0;
-    root->parent = NULL;
-    root->child = NULL;
-    root->link_count=0;
-    root->sibling = NULL;
-    root->content = NULL;
+    inode_reset(&fs->inodes);
+    fs->root = (File *) arena_alloc(&fs->arena, sizeof(File));
+    fs->root->ino = inode_alloc(&fs->inodes);
+    inode_get(&fs->inodes, fs->root->ino)->file = fs->root;
+    fs->root->type = DIRECTORY;
+    fs->root->size = 0;
+    fs->root->parent = NULL;
+    fs->root->child = NULL;
+    fs->root->last_child = NULL;
+    atomic_init(&fs->root->link_count, 0);
+    fs->root->sibling = NULL;
+    fs->root->prev_sibling = NULL;
+    bmap_init(&fs->root->content);
+    atomic_init(&fs->root->linear, NULL);
+    pthread_rwlock_init(&fs->root->lock, NULL);
+    fs->root->born = 0;
+    fs->root->died = SNAP_LIVE;
+    fs->root->content_gen = 0;
+    fs->root->versions = NULL;
+    fs->root->ghosts = NULL;
+    fs->root->retained = 0;
+    atomic_init(&fs->root->touched, 0);
+    fs->root->packed = UINT64_MAX;
+    //the counters restart with the file system
+    stats_reset(&fs->stats);
+    stats_gauge(&fs->stats, STATS_DIRECTORIES, 1);
+}
+
+//start an instance over, recovering it if it is durable; must not run concurrently with any other call on it.
+//-1 if out of memory or recovery failed, which leaves an empty tree without durability
+int rfs_init(Ramfs *fs) {
+    if (fs_prepare(fs) == -1) {
+        return -1;
+    }
+    tier_stop(fs);
+    //records still buffered reach the disk before recovery reads them back
+    journal_close(fs->journal);
+    fs->journal = NULL;
+    reset_ramfs(fs);
+    int result = 0;
+    if (fs->durability != RAMFS_DURABILITY_NONE && recover(fs) == -1) {
+        fs->durability = RAMFS_DURABILITY_NONE;
+        reset_ramfs(fs);
+        result = -1;
+    }
+    tier_start(fs);
+    return result;
 }
 
+//note a read or write for the tier thread, without a store while the clock stands still
+static void file_touch(Ramfs *fs, File *file) {
+    uint64_t now = atomic_load_explicit(&fs->tier_clock, memory_order_relaxed);
+    if (atomic_load_explicit(&file->touched, memory_order_relaxed) != now) {
+        atomic_store_explicit(&file->touched, now, memory_order_relaxed);
+    }
+}
 
-//open file or directory
-int ropen(const char *pathname, int flags) {
+//1 if a read or write of file has to look for paged out blocks
+static int tier_access(Ramfs *fs, File *file) {
+    return file->content.spilled > 0 || atomic_load_explicit(&fs->memory_budget, memory_order_relaxed) != 0;
+}
+
+//bring the paged out blocks of count bytes at pos back before a read or write and count the hit or
+//fault; caller holds the file write lock, or the read lock if none is paged out. -1 if the backing file fails
+static int file_fault(Ramfs *fs, File *file, size_t pos, size_t count) {
+    int faults = bmap_fault(&file->content, &fs->store, pos, count);
+    if (faults != -1) {
+        stats_tier(&fs->stats, faults > 0 ? STATS_TIER_FAULTS : STATS_TIER_HITS, 1);
+    }
+    return faults == -1 ? -1 : 0;
+}
+
+//take a link for an open descriptor, fails once the file was removed
+static int file_get(File *file) {
+    int count = atomic_load(&file->link_count);
+    while (count != FILE_DEAD) {
+        if (atomic_compare_exchange_weak(&file->link_count, &count, count + 1)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+//mark a file without open descriptors as removed
+static int file_kill(File *file) {
+    int count = 0;
+    return atomic_compare_exchange_strong(&file->link_count, &count, FILE_DEAD) ? 0 : -1;
+}
+
+//FNV-1a hash of a file name
+static uint32_t name_hash(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static size_t dir_index_size(size_t capacity) {
+    return sizeof(DirIndex) + capacity * sizeof(DirSlot);
+}
+
+//ebr callback releasing a directory index, ctx is its instance
+static void free_index(void *ptr, void *ctx) {
+    DirIndex *index = (DirIndex *) ptr;
+    arena_free(&((Ramfs *) ctx)->arena, index, dir_index_size(index->capacity));
+}
+
+//forget the rmmap copy of a file before its content changes, caller holds the file write lock
+static void drop_linear(File *file, BlockStore *store) {
+    Block *linear = atomic_exchange(&file->linear, NULL);
+    if (linear != NULL) {
+        block_put(linear, store);
+    }
+}
+
+//release a file that readers can no longer reach, also the ebr callback of removed files;
+//ctx is its instance
+static void free_file(void *ptr, void *ctx) {
+    File *file = (File *) ptr;
+    Ramfs *fs = (Ramfs *) ctx;
+    DirIndex *index = atomic_load(&inode_get(&fs->inodes, file->ino)->index);
+    if (index != NULL) {
+        free_index(index, fs);
+    }
+    bmap_free(&file->content, &fs->store);
+    drop_linear(file, &fs->store);
+    while (file->versions != NULL) {
+        FileVersion *version = file->versions;
+        file->versions = version->next;
+        bmap_free(&version->content, &fs->store);
+        arena_free(&fs->arena, version, sizeof(FileVersion));
+    }
+    pthread_rwlock_destroy(&file->lock);
+    inode_free(&fs->inodes, file->ino);
+    arena_free(&fs->arena, file, sizeof(File));
+}
+
+//ebr callback releasing a closed descriptor, ctx is its instance
+static void free_fd(void *ptr, void *ctx) {
+    Fd *fd1 = (Fd *) ptr;
+    pthread_mutex_destroy(&fd1->lock);
+    arena_free(&((Ramfs *) ctx)->arena, fd1, sizeof(Fd));
+}
+
+//put a file on the retained list so that snapshot releases sweep it
+static void retain(Ramfs *fs, File *file) {
+    pthread_mutex_lock(&fs->retained_lock);
+    if (!file->retained) {
+        file->retained = 1;
+        file->retained_next = NULL;
+        if (fs->retained_tail != NULL) {
+            fs->retained_tail->retained_next = file;
+        } else {
+            fs->retained_head = file;
+        }
+        fs->retained_tail = file;
+    }
+    pthread_mutex_unlock(&fs->retained_lock);
+}
+
+//keep the content of a file for the snapshots that see it before a change in generation gen,
+//caller holds the file write lock inside a change section; -1 if out of memory
+static int file_preserve(Ramfs *fs, File *file, uint64_t gen) {
+    if (file->content_gen == gen) {
+        //no snapshot was taken since the last change
+        return 0;
+    }
+    if (snap_needed(&fs->snaps, file->content_gen, gen)) {
+        FileVersion *version = (FileVersion *) arena_alloc(&fs->arena, sizeof(FileVersion));
+        if (version == NULL) {
+            return -1;
+        }
+        version->from = file->content_gen;
+        version->size = file->size;
+        //O(1), the change copies only the nodes and blocks it writes
+        bmap_clone(&version->content, &file->content);
+        version->next = file->versions;
+        file->versions = version;
+        retain(fs, file);
+    }
+    file->content_gen = gen;
+    return 0;
+}
+
+//absolute path of a file in the live tree, caller holds a lock keeping it there; NULL if out of memory
+static char *file_path(Ramfs *fs, File *file) {
+    size_t length = 0;
+    for (File *cur = file; cur != fs->root; cur = cur->parent) {
+        length += inode_get(&fs->inodes, cur->ino)->name_length + 1;
+    }
+    char *path = (char *) malloc(length + 1);
+    if (path == NULL) {
+        return NULL;
+    }
+    path[length] = '\0';
+    for (File *cur = file; cur != fs->root; cur = cur->parent) {
+        const Inode *inode = inode_get(&fs->inodes, cur->ino);
+        length -= inode->name_length;
+        memcpy(path + length, inode->name, inode->name_length);
+        path[--length] = '/';
+    }
+    return path;
+}
+
+//journal a change at path while holding the locks that order it, return the lsn for journal_commit
+static uint64_t journal_change(Ramfs *fs, int op, const char *path, uint64_t offset, const struct riovec *iov, int iovcnt) {
+    return fs->journal != NULL ? journal_append(fs->journal, op, path, offset, iov, iovcnt) : 0;
+}
+
+//journal a change to the content of a file, caller holds the file write lock
+static uint64_t journal_file(Ramfs *fs, int op, File *file, uint64_t offset, const struct riovec *iov, int iovcnt) {
+    if (fs->journal == NULL) {
+        return 0;
+    }
+    char *path = file_path(fs, file);
+    uint64_t lsn = path != NULL ? journal_append(fs->journal, op, path, offset, iov, iovcnt) : 0;
+    free(path);
+    return lsn;
+}
+
+//wait for a journaled change as the durability level asks, after its locks and the gate are released;
+//-1 if it could not be journaled. Inside rsubmit the wait is left to the end of the batch
+static int journal_commit(Ramfs *fs, uint64_t lsn, Batch *batch) {
+    if (fs->journal == NULL) {
+        return 0;
+    }
+    if (batch != NULL && batch->deferred && lsn != 0) {
+        if (lsn > batch->lsn) {
+            batch->lsn = lsn;
+        }
+        return 0;
+    }
+    return journal_wait(fs->journal, lsn);
+}
+
+
+static int open_file(Ramfs *fs, File *file, int flags, Batch *batch);
+
+//open file or directory, batch is NULL outside rsubmit
+static int open_path(Ramfs *fs, const char *pathname, int flags, Batch *batch) {
     //invalid path
-    if (justify_path(pathname) == -1) {
+    Path path;
+    if (path_parse(&path, pathname) == -1) {
+        return -1;
+    }
+    if (ebr_enter(&fs->ebr) == -1) {
         return -1;
     }
-    char end = pathname[strlen(pathname) - 1];//get end char
-    char *path = clean_path(pathname);
     //find file or directory
-    File *file = find_file(path);
-    if (file == NULL) {//ûҵĬļ,ҲϷ
-        if (end == '/') {
-            free(path);
-            return -1;
-        }
-        //file or directory not found
-        if (flags & O_CREAT) {
-            //create file or directory
-            file = create_file(path, FILE);
-            if (file == NULL) {
-                //create file or directory failed
-                free(path);
-                return -1;
+    File *file;
+    for (;;) {
+        file = batch_find(fs, batch, &path);
+        if (file != NULL) {
+            if (file_get(file) == 0) {
+                break;
             }
-        } else {
-            //file or directory not found
-            free(path);
-            return -1;
+            //removed meanwhile, look again
+            continue;
+        }
+        if (path.trailing_slash || !(flags & O_CREAT)) {
+            break;
         }
+        //create the file already opened so that nobody can remove it first
+        int exists;
+        file = batch_create(fs, batch, &path, FILE, 1, &exists);
+        if (file != NULL || !exists) {
+            break;
+        }
+        //created by another thread meanwhile, open that one
     }
-    //find the first empty file descriptor
-    int fd = 1;
-    while (fd_table.fds[fd] != NULL) {
-        fd++;
+    if (file == NULL) {//ûҵĬļ,ҲϷ
+        ebr_exit(&fs->ebr);
+        return -1;
     }
-    //create file descriptor
-    Fd *fd1 = (Fd *) malloc(sizeof(Fd));
+    int fd = open_file(fs, file, flags, batch);
+    ebr_exit(&fs->ebr);
+    return fd;
+}
 
+//give a file found by open_path a descriptor, its link is dropped on failure
+static int open_file(Ramfs *fs, File *file, int flags, Batch *batch) {
+    //create file descriptor
+    Fd *fd1 = (Fd *) arena_alloc(&fs->arena, sizeof(Fd));
+    if (fd1 == NULL) {
+        atomic_fetch_sub(&file->link_count, 1);
+        return -1;
+    }
     fd1->flags = flags;
     fd1->file = file;
     fd1->offset = 0;
-    //add file descriptor to file descriptor table
-    fd_table.fds[fd] = fd1;
-    file->link_count++;//link count +1
+    fd1->snapshot = 0;
+    fd1->cursor = NULL;
+    pthread_mutex_init(&fd1->lock, NULL);
 
     if (file->type == FILE) {
+        //check flags
+        if ((flags & O_TRUNC) && ((flags & O_WRONLY) || (flags & O_RDWR))) {
+            //truncate file
+            uint64_t gen = snap_change_begin(&fs->snaps);
+            pthread_rwlock_wrlock(&file->lock);
+            uint64_t lsn = 0;
+            if (file_preserve(fs, file, gen) == 0) {
+                file->size = 0;
+                bmap_free(&file->content, &fs->store);
+                drop_linear(file, &fs->store);
+                lsn = journal_file(fs, JOURNAL_TRUNCATE, file, 0, NULL, 0);
+            }
+            pthread_rwlock_unlock(&file->lock);
+            snap_change_end(&fs->snaps);
+            if (journal_commit(fs, lsn, batch) == -1) {
+                atomic_fetch_sub(&file->link_count, 1);
+                free_fd(fd1, fs);
+                return -1;
+            }
+        }
         if (flags & O_APPEND) {
+            pthread_rwlock_rdlock(&file->lock);
             fd1->offset = file->size;
+            pthread_rwlock_unlock(&file->lock);
         }
         else {
             fd1->offset = 0;
         }
-        //check flags
-        if ((flags & O_TRUNC) && ((flags & O_WRONLY) || (flags & O_RDWR))) {
-            //truncate file
-            file->size = 0;
-            free(file->content);
-            file->content = NULL;
-        }
     }
-    free(path);
+    //add file descriptor to the first empty slot of the table
+    int fd = fd_alloc(fs, fd1);
+    if (fd == -1) {
+        atomic_fetch_sub(&file->link_count, 1);
+        free_fd(fd1, fs);
+    }
+    return fd;
+}
+
+int rfs_open(Ramfs *fs, const char *pathname, int flags) {
+    uint64_t start = stats_start(&fs->stats);
+    int fd = open_path(fs, pathname, flags, NULL);
+    stats_op(&fs->stats, RAMFS_OP_OPEN, start, fd == -1);
     return fd;
 }
 
 //create file or directory ,choose type FILE or DIRECTORY
-File *create_file(const char *pathname, int type) {
+//opened gives the new file its first link; exists is set if the name is taken
+File *create_file(Ramfs *fs, const Path *path, int type, int opened, int *exists) {
+    *exists = 0;
+    //the root always exists
+    if (path->length == 0) {
+        *exists = 1;
+        return NULL;
+    }
     //find parent directory
-    char *parent_path = (char *) malloc(strlen(pathname) + 1);
-    memset(parent_path, 0, strlen(pathname) + 1);
-    strcpy(parent_path, pathname);
-
-    char *name = strrchr(parent_path, '/');
-    *name = '\0';
-    name++;
-    char* tmp= clean_path(parent_path);
-    File *parent = find_file(tmp);
-    free(tmp);
+    File *parent = find_file(fs, path->text, path_parent(path));
     if (parent == NULL||parent->type!=DIRECTORY) {
-        free(parent_path);
         //parent directory not found
         return NULL;
     }
+    return create_in(fs, parent, path, type, opened, exists, NULL);
+}
+
+//give a new file an inode holding its name, -1 if the inode table is full
+static int file_name(Ramfs *fs, File *file, const char *name, size_t len) {
+    file->ino = inode_alloc(&fs->inodes);
+    if (file->ino == INODE_NONE) {
+        return -1;
+    }
+    Inode *inode = inode_get(&fs->inodes, file->ino);
+    inode->file = file;
+    inode->hash = name_hash(name, len);
+    inode->name_length = (uint8_t) len;
+    memcpy(inode->name, name, len);
+    inode->name[len] = '\0';
+    return 0;
+}
+
+//unlink a file or cursor from the child list of parent, caller holds the parent lock
+static void child_unlink(File *parent, File *file) {
+    if (file->prev_sibling != NULL) {
+        file->prev_sibling->sibling = file->sibling;
+    } else {
+        parent->child = file->sibling;
+    }
+    if (file->sibling != NULL) {
+        file->sibling->prev_sibling = file->prev_sibling;
+    } else {
+        parent->last_child = file->prev_sibling;
+    }
+}
+
+//link a file or cursor into the child list of parent after prev, at the head if prev is NULL;
+//caller holds the parent lock
+static void child_link(File *parent, File *prev, File *file) {
+    file->prev_sibling = prev;
+    file->sibling = prev != NULL ? prev->sibling : parent->child;
+    if (file->sibling != NULL) {
+        file->sibling->prev_sibling = file;
+    } else {
+        parent->last_child = file;
+    }
+    if (prev != NULL) {
+        prev->sibling = file;
+    } else {
+        parent->child = file;
+    }
+}
+
+//create the last name of path in parent
+static File *create_in(Ramfs *fs, File *parent, const Path *path, int type, int opened, int *exists, Batch *batch) {
+    *exists = 0;
+    //the last name ends the text, so it is terminated
+    const char *name = path->text + path->name;
+    size_t name_length = path->length - path->name;
     //create file or directory
-    File *file = (File *) malloc(sizeof(File));
+    File *file = (File *) arena_alloc(&fs->arena, sizeof(File));
+    if (file == NULL) {
+        return NULL;
+    }
     file->type = type;
     file->size = 0;
     file->parent = parent;
     file->child = NULL;
+    file->last_child = NULL;
     file->sibling = NULL;
-    file->content = NULL;
-    file->link_count=0;
-    file->name = (char *) malloc(strlen(name) + 1);
-    strcpy(file->name, name);
+    file->prev_sibling = NULL;
+    bmap_init(&file->content);
+    atomic_init(&file->linear, NULL);
+    atomic_init(&file->link_count, opened);
+    pthread_rwlock_init(&file->lock, NULL);
+    file->died = SNAP_LIVE;
+    file->versions = NULL;
+    file->ghosts = NULL;
+    file->retained = 0;
+    atomic_init(&file->touched, atomic_load_explicit(&fs->tier_clock, memory_order_relaxed));
+    file->packed = UINT64_MAX;
+    if (file_name(fs, file, name, name_length) == -1) {
+        free_file(file, fs);
+        return NULL;
+    }
     //add file or directory to parent directory
-    if (parent->child == NULL) {
-        parent->child = file;
-    } else {
-        File *child = parent->child;
-        while (child->sibling != NULL) {
-            child = child->sibling;
+    file->born = snap_change_begin(&fs->snaps);
+    file->content_gen = file->born;
+    pthread_rwlock_wrlock(&parent->lock);
+    int removed = atomic_load(&parent->link_count) == FILE_DEAD;
+    if (removed || dir_lookup(fs, parent, name, name_length) != NULL) {
+        //parent removed or name taken since the lookup
+        *exists = !removed;
+        pthread_rwlock_unlock(&parent->lock);
+        snap_change_end(&fs->snaps);
+        free_file(file, fs);
+        return NULL;
+    }
+    dcache_invalidate_begin(fs->dcache, path->text, path->length);
+    if (dir_insert(fs, parent, file) == -1) {
+        dcache_invalidate_end(fs->dcache, path->text, path->length);
+        pthread_rwlock_unlock(&parent->lock);
+        snap_change_end(&fs->snaps);
+        free_file(file, fs);
+        return NULL;
+    }
+    child_link(parent, parent->last_child, file);
+    dcache_invalidate_end(fs->dcache, path->text, path->length);
+    stats_gauge(&fs->stats, type == DIRECTORY ? STATS_DIRECTORIES : STATS_FILES, 1);
+    uint64_t lsn = journal_change(fs, type == DIRECTORY ? JOURNAL_MKDIR : JOURNAL_CREATE, path->text, 0, NULL, 0);
+    pthread_rwlock_unlock(&parent->lock);
+    snap_change_end(&fs->snaps);
+    if (journal_commit(fs, lsn, batch) == -1) {
+        //made in memory but not durable, the caller fails
+        if (opened) {
+            atomic_fetch_sub(&file->link_count, 1);
         }
-        child->sibling = file;
+        return NULL;
     }
-    free(parent_path);
     return file;
 }
 
-//find file
-File *find_file(const char *pathname) {
-    if (strcmp(pathname, "/")==0|| strcmp(pathname,"") == 0) {
-        return root;
+static void detach_file(Ramfs *fs, File *file) {
+    File *parent = file->parent;
+    dir_remove(fs, parent, file);
+    child_unlink(parent, file);
+}
+
+//finish removing a detached file: keep it as a ghost of its parent while a snapshot sees it,
+//free it otherwise once no reader can still see it; caller holds the parent lock
+static void remove_file(Ramfs *fs, File *file, uint64_t gen) {
+    stats_gauge(&fs->stats, file->type == DIRECTORY ? STATS_DIRECTORIES : STATS_FILES, -1);
+    file->died = gen;
+    if (!snap_needed(&fs->snaps, file->born, gen)) {
+        ebr_retire(&fs->ebr, file, free_file, fs);
+        return;
     }
-    char *tmp = (char *) malloc(strlen(pathname) + 1);
-    strcpy(tmp, pathname);
-    File *cur = root;//current file
-    char *path = strtok(tmp, "/");
-    while (path != NULL) {
-        if (cur->child == NULL) {
-            //child not found
-            cur = NULL;
-            break;
-        }
-        cur = cur->child;
-        while (cur != NULL) {
-            if (strcmp(cur->name, path) == 0) {
-                //child found
-                break;
-            }
-            cur = cur->sibling;
-        }
-        if (cur == NULL) {
-            //child not found
-            break;
-        }
-        path = strtok(NULL, "/");
+    File *parent = file->parent;
+    file->prev_sibling = NULL;
+    file->sibling = parent->ghosts;
+    if (parent->ghosts != NULL) {
+        parent->ghosts->prev_sibling = file;
     }
-    while (path != NULL) {
-        path = strtok(NULL, "/");
+    parent->ghosts = file;
+    retain(fs, file);
+}
+
+//find the file at the first length bytes of a cleaned path, consulting the path cache first;
+//call inside an ebr section, the result stays valid until ebr_exit
+File *find_file(Ramfs *fs, const char *path, size_t length) {
+    if (length == 0) {
+        return fs->root;
     }
-    //get the end name of the path and compare with the current file name
-    char *name = strrchr(pathname, '/');
-    name++;
-    if (cur != NULL && strcmp(cur->name, name) != 0) {
-        cur = NULL;
+    File *cur;
+    uint64_t token;
+    if (dcache_lookup(fs->dcache, path, length, &cur, &token)) {
+        return cur;
     }
-    free(tmp);
+    uint64_t start = stats_start(&fs->stats);
+    cur = walk_path(fs, path, length);
+    stats_op(&fs->stats, RAMFS_OP_LOOKUP, start, cur == NULL);
+    dcache_insert(fs->dcache, path, length, cur, token);
     return cur;
 }
 
-//clear file path
-int justify_path(const char *pathname) {
-    if (pathname == NULL || strlen(pathname) < 1) {
-        return -1;
+//parent directory of a path, reusing the previous one of the batch when it is the same;
+//call inside the ebr section of the batch
+static File *batch_parent(Ramfs *fs, Batch *batch, const Path *path) {
+    size_t length = path_parent(path);
+    File *parent = batch->parent;
+    if (parent != NULL && length == batch->parent_length && memcmp(path->text, batch->parent_path, length) == 0 &&
+        atomic_load(&parent->link_count) != FILE_DEAD) {
+        return parent;
     }
-    if (pathname[0] != '/') {
-        return -1;
+    memcpy(batch->parent_path, path->text, length);
+    parent = find_file(fs, batch->parent_path, length);
+    if (parent != NULL && parent->type != DIRECTORY) {
+        parent = NULL;
+    }
+    batch->parent = parent;
+    batch->parent_length = length;
+    return parent;
+}
+
+static File *batch_find(Ramfs *fs, Batch *batch, const Path *path) {
+    if (batch == NULL || path->length == 0) {
+        return find_file(fs, path->text, path->length);
+    }
+    File *parent = batch_parent(fs, batch, path);
+    return parent != NULL ? dir_lookup(fs, parent, path->text + path->name, path->length - path->name) : NULL;
+}
+
+static File *batch_create(Ramfs *fs, Batch *batch, const Path *path, int type, int opened, int *exists) {
+    if (batch == NULL || path->length == 0) {
+        return create_file(fs, path, type, opened, exists);
+    }
+    *exists = 0;
+    File *parent = batch_parent(fs, batch, path);
+    return parent != NULL ? create_in(fs, parent, path, type, opened, exists, batch) : NULL;
+}
+
+//walk the tree from root without taking locks, touching only index slots and inodes
+static File *walk_path(Ramfs *fs, const char *path, size_t length) {
+    Inode *cur = inode_get(&fs->inodes, fs->root->ino);//current inode
+    size_t pos = 0, name_length;
+    const char *name;
+    while (cur != NULL && (name = path_next(path, length, &pos, &name_length)) != NULL) {
+        cur = inode_lookup(fs, cur, name, name_length);
     }
-    //· <= 1024 ֽڡ˵ļϵͳ·ȴޣ
-    if (strlen(pathname) > 1024) {
+    return cur != NULL ? cur->file : NULL;
+}
+
+//publish a copy of the index with a new capacity, dropping tombstones
+static int dir_resize(Ramfs *fs, Inode *dir, size_t capacity) {
+    DirIndex *old = atomic_load(&dir->index);
+    DirIndex *index = (DirIndex *) arena_calloc(&fs->arena, dir_index_size(capacity));
+    if (index == NULL) {
         return -1;
     }
-    for (int i = 0; i < strlen(pathname); i++) {
-        //only contain letter   number   english point
-        if (!((pathname[i] >= 'a' && pathname[i] <= 'z') || (pathname[i] >= 'A' && pathname[i] <= 'Z') ||
-              (pathname[i] >= '0' && pathname[i] <= '9') || pathname[i] == '.' || pathname[i] == '/')) {
-            return -1;
+    index->capacity = capacity;
+    size_t mask = capacity - 1;
+    for (size_t i = 0; old != NULL && i < old->capacity; i++) {
+        uint32_t ino = atomic_load_explicit(&old->slots[i].ino, memory_order_relaxed);
+        if (ino == INODE_NONE || ino == DIR_TOMBSTONE) {
+            continue;
         }
-    }
-//    ļĿ¼ <= 32 ֽ
-    char *tmp = (char *) malloc(strlen(pathname) + 1);
-    memset(tmp, 0, strlen(pathname) + 1);
-    strcpy(tmp, pathname);
-    char *path = strtok(tmp, "/");
-    while (path != NULL) {
-        if (strlen(path) > 32) {
-            return -1;
+        uint32_t hash = atomic_load_explicit(&old->slots[i].hash, memory_order_relaxed);
+        size_t j = hash & mask;
+        while (atomic_load_explicit(&index->slots[j].ino, memory_order_relaxed) != INODE_NONE) {
+            j = (j + 1) & mask;
         }
-        path = strtok(NULL, "/");
+        atomic_store_explicit(&index->slots[j].hash, hash, memory_order_relaxed);
+        atomic_store_explicit(&index->slots[j].ino, ino, memory_order_relaxed);
+        index->count++;
+    }
+    index->used = index->count;
+    atomic_store_explicit(&dir->index, index, memory_order_release);
+    if (old != NULL) {
+        ebr_retire(&fs->ebr, old, free_index, fs);
     }
-    free(tmp);
     return 0;
 }
 
-//create directory
-int rmkdir(const char *pathname) {
-    int length = strlen(pathname);
-    //find . in pathname
-    for (int i = 0; i < length; ++i) {
-        if (pathname[i] == '.') {
+//find the inode of a child by name, lock-free; only inodes whose hash matches are read
+static Inode *inode_lookup(Ramfs *fs, Inode *dir, const char *name, size_t len) {
+    DirIndex *index = atomic_load_explicit(&dir->index, memory_order_acquire);
+    if (index == NULL) {
+        return NULL;
+    }
+    uint32_t hash = name_hash(name, len);
+    size_t mask = index->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        uint32_t ino = atomic_load_explicit(&index->slots[i].ino, memory_order_acquire);
+        if (ino == INODE_NONE) {
+            //end of probe sequence
+            return NULL;
+        }
+        if (ino == DIR_TOMBSTONE || atomic_load_explicit(&index->slots[i].hash, memory_order_relaxed) != hash) {
+            continue;
+        }
+        Inode *inode = inode_get(&fs->inodes, ino);
+        if (inode->name_length == len && memcmp(inode->name, name, len) == 0) {
+            return inode;
+        }
+    }
+}
+
+//find child by name, lock-free
+File *dir_lookup(Ramfs *fs, File *dir, const char *name, size_t len) {
+    Inode *inode = inode_lookup(fs, inode_get(&fs->inodes, dir->ino), name, len);
+    return inode != NULL ? inode->file : NULL;
+}
+
+//add child to index, the name must not exist yet; caller holds the directory lock
+int dir_insert(Ramfs *fs, File *dir, File *file) {
+    Inode *inode = inode_get(&fs->inodes, file->ino);
+    Inode *dir_inode = inode_get(&fs->inodes, dir->ino);
+    DirIndex *index = atomic_load(&dir_inode->index);
+    //keep load factor (tombstones included) below 3/4
+    if (index == NULL || (index->used + 1) * 4 > index->capacity * 3) {
+        size_t capacity = index == NULL ? DIR_INDEX_MIN : index->capacity;
+        size_t count = index == NULL ? 0 : index->count;
+        while ((count + 1) * 2 > capacity) {
+            capacity *= 2;
+        }
+        if (dir_resize(fs, dir_inode, capacity) == -1) {
             return -1;
         }
+        index = atomic_load(&dir_inode->index);
     }
-    //invalid path
-    if (justify_path(pathname) == -1) {
+    size_t mask = index->capacity - 1;
+    size_t i = inode->hash & mask;
+    uint32_t cur;
+    while ((cur = atomic_load(&index->slots[i].ino)) != INODE_NONE && cur != DIR_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (cur == INODE_NONE) {
+        index->used++;
+    }
+    //readers check the hash only after seeing the inode
+    atomic_store_explicit(&index->slots[i].hash, inode->hash, memory_order_relaxed);
+    atomic_store_explicit(&index->slots[i].ino, file->ino, memory_order_release);
+    index->count++;
+    return 0;
+}
+
+//remove child from index, caller holds the directory lock
+void dir_remove(Ramfs *fs, File *dir, File *file) {
+    Inode *dir_inode = inode_get(&fs->inodes, dir->ino);
+    DirIndex *index = atomic_load(&dir_inode->index);
+    size_t mask = index->capacity - 1;
+    size_t i = inode_get(&fs->inodes, file->ino)->hash & mask;
+    while (atomic_load(&index->slots[i].ino) != file->ino) {
+        i = (i + 1) & mask;
+    }
+    //a slot followed by an empty one ends no probe sequence, so clear it
+    if (atomic_load(&index->slots[(i + 1) & mask].ino) == INODE_NONE) {
+        atomic_store(&index->slots[i].ino, INODE_NONE);
+        index->used--;
+    } else {
+        atomic_store(&index->slots[i].ino, DIR_TOMBSTONE);
+    }
+    index->count--;
+    //shrink sparse indexes, ignore failure since the old slots still work
+    if (index->capacity > DIR_INDEX_MIN && index->count * 8 < index->capacity) {
+        dir_resize(fs, dir_inode, index->capacity / 2);
+    }
+}
+
+//create directory, batch is NULL outside rsubmit
+static int make_dir(Ramfs *fs, const char *pathname, Batch *batch) {
+    //invalid path, or . in pathname
+    Path path;
+    if (path_parse(&path, pathname) == -1 || path.dot) {
+        return -1;
+    }
+    if (ebr_enter(&fs->ebr) == -1) {
         return -1;
     }
-    //clean path
-    char *path = clean_path(pathname);
     //find file first
-    File *file = find_file(path);
+    File *file = batch_find(fs, batch, &path);
     if (file != NULL) {
         //file or directory already exists
-        free(path);
+        ebr_exit(&fs->ebr);
         return -1;
     }
     //create file or directory
-    file = create_file(path, DIRECTORY);
+    int exists;
+    file = batch_create(fs, batch, &path, DIRECTORY, 0, &exists);
+    ebr_exit(&fs->ebr);
     if (file == NULL) {
         //create file or directory failed
-        free(path);
         return -1;
     }
-    free(path);
     return 0;
 }
 
+int rfs_mkdir(Ramfs *fs, const char *pathname) {
+    uint64_t start = stats_start(&fs->stats);
+    int result = make_dir(fs, pathname, NULL);
+    stats_op(&fs->stats, RAMFS_OP_MKDIR, start, result == -1);
+    return result;
+}
+
 //delete directory
-int rrmdir(const char *pathname) {
-    //find . in pathname
-    for (int i = 0; i < strlen(pathname); ++i) {
-        if (pathname[i] == '.') {
-            return -1;
-        }
-    }
-    //invalid path
-    if (strcmp(pathname, "/") == 0) {
+static int remove_dir(Ramfs *fs, const char *pathname) {
+    //invalid path, . in pathname or the root
+    Path path;
+    if (path_parse(&path, pathname) == -1 || path.dot || path.length == 0) {
         return -1;
     }
-    if (justify_path(pathname) == -1) {
+    if (ebr_enter(&fs->ebr) == -1) {
         return -1;
     }
-    char *path = clean_path(pathname);
-    //find file first
-    File *file = find_file(path);
-    if (file == NULL || file->link_count >= 1||file->type==FILE) {
-        //file or directory not found
-        free(path);
-        return -1;
-    }
-    if (file->child != NULL) {
-        //directory not empty
-        free(path);
-        return -1;
+    uint64_t gen = snap_change_begin(&fs->snaps);
+    for (;;) {
+        //find file first
+        File *file = find_file(fs, path.text, path.length);
+        if (file == NULL || file == fs->root || file->type==FILE) {
+            //file or directory not found
+            break;
+        }
+        File *parent = file->parent;
+        pthread_rwlock_wrlock(&parent->lock);
+        pthread_rwlock_wrlock(&file->lock);
+        if (file->child != NULL) {
+            //directory not empty
+            pthread_rwlock_unlock(&file->lock);
+            pthread_rwlock_unlock(&parent->lock);
+            break;
+        }
+        if (file_kill(file) == -1) {
+            int removed = atomic_load(&file->link_count) == FILE_DEAD;
+            pthread_rwlock_unlock(&file->lock);
+            pthread_rwlock_unlock(&parent->lock);
+            if (removed) {
+                //removed meanwhile, look again
+                continue;
+            }
+            //link count >=1,can not delete
+            break;
+        }
+        //delete file or directory
+        dcache_invalidate_begin(fs->dcache, path.text, path.length);
+        detach_file(fs, file);
+        dcache_invalidate_end(fs->dcache, path.text, path.length);
+        pthread_rwlock_unlock(&file->lock);
+        remove_file(fs, file, gen);
+        uint64_t lsn = journal_change(fs, JOURNAL_RMDIR, path.text, 0, NULL, 0);
+        pthread_rwlock_unlock(&parent->lock);
+        snap_change_end(&fs->snaps);
+        ebr_exit(&fs->ebr);
+        return journal_commit(fs, lsn, NULL);
     }
-    //delete file or directory
-    File *parent = file->parent;
-    if (parent->child == file) {
-        parent->child = file->sibling;
+    snap_change_end(&fs->snaps);
+    ebr_exit(&fs->ebr);
+    return -1;
+}
+
+int rfs_rmdir(Ramfs *fs, const char *pathname) {
+    uint64_t start = stats_start(&fs->stats);
+    int result = remove_dir(fs, pathname);
+    stats_op(&fs->stats, RAMFS_OP_RMDIR, start, result == -1);
+    return result;
+}
+
+//batch is NULL outside rsubmit
+static int unlink_path(Ramfs *fs, const char *pathname, Batch *batch) {
+    Path path;
+    if (path_parse(&path, pathname) == -1) {
+        return -1;
+    }
+    //find file first
+    if (ebr_enter(&fs->ebr) == -1) {
+        return -1;
     }
-    else {
-        File *child = parent->child;
-        while (child->sibling != file) {
-            child = child->sibling;
+    uint64_t gen = snap_change_begin(&fs->snaps);
+    for (;;) {
+        File *file = batch_find(fs, batch, &path);
+        if (file == NULL || file->type == DIRECTORY) {
+            //file or directory not found
+            break;
         }
-        child->sibling = file->sibling;
+        File *parent = file->parent;
+        pthread_rwlock_wrlock(&parent->lock);
+        if (file_kill(file) == -1) {
+            int removed = atomic_load(&file->link_count) == FILE_DEAD;
+            pthread_rwlock_unlock(&parent->lock);
+            if (removed) {
+                //removed meanwhile, look again
+                continue;
+            }
+            //link count >=1,can not delete
+            break;
+        }
+        //delete file
+        dcache_invalidate_begin(fs->dcache, path.text, path.length);
+        detach_file(fs, file);
+        dcache_invalidate_end(fs->dcache, path.text, path.length);
+        remove_file(fs, file, gen);
+        uint64_t lsn = journal_change(fs, JOURNAL_UNLINK, path.text, 0, NULL, 0);
+        pthread_rwlock_unlock(&parent->lock);
+        snap_change_end(&fs->snaps);
+        ebr_exit(&fs->ebr);
+        return journal_commit(fs, lsn, batch);
     }
-    free(file->name);
-    free(file);
-    free(path);
-    return 0;
+    snap_change_end(&fs->snaps);
+    ebr_exit(&fs->ebr);
+    return -1;
 }
 
-int runlink(const char *pathname) {
-    if (justify_path(pathname) == -1) {
+int rfs_unlink(Ramfs *fs, const char *pathname) {
+    uint64_t start = stats_start(&fs->stats);
+    int result = unlink_path(fs, pathname, NULL);
+    stats_op(&fs->stats, RAMFS_OP_UNLINK, start, result == -1);
+    return result;
+}
+
+
+//allocate the page holding slots [index * FD_PAGE, (index + 1) * FD_PAGE), caller holds the table lock
+static FdPage *fd_page(Ramfs *fs, int index) {
+    FdPage *page = (FdPage *) arena_calloc(&fs->arena, sizeof(FdPage));
+    if (page == NULL) {
+        return NULL;
+    }
+    //fd 0 is never handed out
+    if (index == 0) {
+        page->used[0] = 1;
+    }
+    //slots past MAX_FD_COUNT on the last page stay marked as used
+    for (int i = 0; i < FD_PAGE; i++) {
+        if (index * FD_PAGE + i >= MAX_FD_COUNT) {
+            page->used[i / 64] |= (uint64_t) 1 << (i % 64);
+        }
+    }
+    atomic_store(&fs->fd_table.pages[index], page);
+    return page;
+}
+
+//put fd1 into the lowest free slot, return the fd number or -1 if the table is full
+int fd_alloc(Ramfs *fs, Fd *fd1) {
+    pthread_mutex_lock(&fs->fd_table.lock);
+    //lowest page with a free slot
+    int index = -1;
+    for (int i = 0; i < (int) (sizeof(fs->fd_table.full) / sizeof(uint64_t)); i++) {
+        if (~fs->fd_table.full[i] != 0) {
+            index = i * 64 + __builtin_ctzll(~fs->fd_table.full[i]);
+            break;
+        }
+    }
+    FdPage *page = NULL;
+    if (index != -1 && index < FD_PAGE_COUNT) {
+        page = atomic_load(&fs->fd_table.pages[index]);
+        if (page == NULL) {
+            page = fd_page(fs, index);
+        }
+    }
+    if (page == NULL) {
+        pthread_mutex_unlock(&fs->fd_table.lock);
         return -1;
     }
-    //find file first
-    char *path = clean_path(pathname);
+    //lowest free slot of the page, the page is not full so one exists
+    int word = 0;
+    while (~page->used[word] == 0) {
+        word++;
+    }
+    int bit = __builtin_ctzll(~page->used[word]);
+    int slot = word * 64 + bit;
+    page->used[word] |= (uint64_t) 1 << bit;
+    atomic_store(&page->fds[slot], fd1);
+    //mark the page full if that was its last free slot
+    int full = 1;
+    for (int i = word; i < FD_PAGE / 64 && full; i++) {
+        full = ~page->used[i] == 0;
+    }
+    if (full) {
+        fs->fd_table.full[index / 64] |= (uint64_t) 1 << (index % 64);
+    }
+    int fd = (int) (atomic_load(&page->gens[slot]) << FD_SLOT_BITS) | (index * FD_PAGE + slot);
+    pthread_mutex_unlock(&fs->fd_table.lock);
+    stats_gauge(&fs->stats, STATS_OPEN_FDS, 1);
+    return fd;
+}
 
-    File *file = find_file(path);
-    if (file == NULL) {
-        //file or directory not found
-        free(path);
+//look up an fd number, NULL if it is not open or was closed since it was handed out;
+//call inside an ebr section, the descriptor stays valid until ebr_exit
+Fd *fd_get(Ramfs *fs, int fd) {
+    if (fd < 0) {
+        return NULL;
+    }
+    int slot = fd & FD_SLOT_MASK;
+    if (slot >= MAX_FD_COUNT) {
+        return NULL;
+    }
+    FdPage *page = atomic_load(&fs->fd_table.pages[slot >> FD_PAGE_SHIFT]);
+    if (page == NULL) {
+        return NULL;
+    }
+    slot &= FD_PAGE - 1;
+    uint32_t gen = (uint32_t) fd >> FD_SLOT_BITS;
+    if (atomic_load(&page->gens[slot]) != gen) {
+        //stale fd from before an rclose
+        return NULL;
+    }
+    Fd *fd1 = atomic_load(&page->fds[slot]);
+    //the slot must not have been closed while it was read
+    if (atomic_load(&page->gens[slot]) != gen) {
+        return NULL;
+    }
+    return fd1;
+}
+
+//free the slot of an open fd and start its next generation, -1 if it was already closed
+int fd_release(Ramfs *fs, int fd) {
+    int index = (fd & FD_SLOT_MASK) >> FD_PAGE_SHIFT;
+    int slot = fd & (FD_PAGE - 1);
+    FdPage *page = atomic_load(&fs->fd_table.pages[index]);
+    pthread_mutex_lock(&fs->fd_table.lock);
+    if (atomic_load(&page->gens[slot]) != (uint32_t) fd >> FD_SLOT_BITS) {
+        pthread_mutex_unlock(&fs->fd_table.lock);
+        return -1;
+    }
+    atomic_store(&page->fds[slot], NULL);
+    atomic_store(&page->gens[slot], (atomic_load(&page->gens[slot]) + 1) & FD_GEN_MASK);
+    page->used[slot / 64] &= ~((uint64_t) 1 << (slot % 64));
+    fs->fd_table.full[index / 64] &= ~((uint64_t) 1 << (index % 64));
+    pthread_mutex_unlock(&fs->fd_table.lock);
+    stats_gauge(&fs->stats, STATS_OPEN_FDS, -1);
+    return 0;
+}
+
+static int close_fd(Ramfs *fs, int fd) {
+    if (ebr_enter(&fs->ebr) == -1) {
         return -1;
     }
-    if (file->link_count >= 1||file->type==DIRECTORY) {
-        free(path);
-        return -1;//link count >=1,can not delete
+    Fd *fd1 = fd_get(fs, fd);
+    if (fd1 == NULL || fd_release(fs, fd) == -1) {
+        ebr_exit(&fs->ebr);
+        return -1;
     }
-    //delete file
-    File *parent = file->parent;
-    if (parent->child == file) {
-        parent->child = file->sibling;
-    } else {
-        File *child = parent->child;
-        while (child->sibling != file) {
-            child = child->sibling;
+    File *file = fd1->file;
+    if (file->type == DIRECTORY) {
+        //wait for a running rreaddir, later ones find the descriptor released
+        pthread_mutex_lock(&fd1->lock);
+        if (fd1->cursor != NULL) {
+            pthread_rwlock_wrlock(&file->lock);
+            child_unlink(file, fd1->cursor);
+            pthread_rwlock_unlock(&file->lock);
+            //only walks holding the directory lock ever reach a cursor
+            arena_free(&fs->arena, fd1->cursor, sizeof(File));
+            fd1->cursor = NULL;
         }
-        child->sibling = file->sibling;
+        pthread_mutex_unlock(&fd1->lock);
     }
-    free(file->content);
-    free(file->name);
-    free(file);
-    free(path);
+    atomic_fetch_sub(&file->link_count, 1);//link count -1
+    if (fd1->snapshot) {
+        //the frozen copy belongs to the descriptor
+        ebr_retire(&fs->ebr, file, free_file, fs);
+    }
+    //calls still running on the descriptor finish before it is freed
+    ebr_retire(&fs->ebr, fd1, free_fd, fs);
+    ebr_exit(&fs->ebr);
     return 0;
 }
 
+int rfs_close(Ramfs *fs, int fd) {
+    uint64_t start = stats_start(&fs->stats);
+    int result = close_fd(fs, fd);
+    stats_op(&fs->stats, RAMFS_OP_CLOSE, start, result == -1);
+    return result;
+}
 
-int rclose(int fd) {
-    if (fd < 0 || fd >= MAX_FD_COUNT) {
+int rfs_opendir(Ramfs *fs, const char *pathname) {
+    int fd = rfs_open(fs, pathname, O_RDONLY);
+    RamfsStat st;
+    if (fd >= 0 && (rfs_fstat(fs, fd, &st) == -1 || st.type != DIRECTORY)) {
+        rfs_close(fs, fd);
         return -1;
     }
-    Fd *fd1 = fd_table.fds[fd];
-    if (fd1 == NULL) {
+    return fd;
+}
+
+static int read_dir(Ramfs *fs, int fd, RamfsDirent *entries, int count) {
+    if (entries == NULL || count <= 0) {
         return -1;
     }
-    File *file = fd1->file;
-    file->link_count--;//link count -1
-    free(fd1);
-    fd_table.fds[fd] = NULL;
-    return 0;
+    if (ebr_enter(&fs->ebr) == -1) {
+        return -1;
+    }
+    Fd *fd1 = fd_get(fs, fd);
+    if (fd1 == NULL || fd1->file->type != DIRECTORY || fd1->snapshot) {
+        ebr_exit(&fs->ebr);
+        return -1;
+    }
+    File *dir = fd1->file;
+    pthread_mutex_lock(&fd1->lock);
+    if (fd_get(fs, fd) != fd1) {
+        //closed meanwhile, rclose already dropped the cursor
+        pthread_mutex_unlock(&fd1->lock);
+        ebr_exit(&fs->ebr);
+        return -1;
+    }
+    File *cursor = fd1->cursor;
+    if (cursor == NULL) {
+        cursor = (File *) arena_calloc(&fs->arena, sizeof(File));
+        if (cursor == NULL) {
+            pthread_mutex_unlock(&fd1->lock);
+            ebr_exit(&fs->ebr);
+            return -1;
+        }
+        cursor->type = DIR_CURSOR;
+        cursor->parent = dir;
+        //no snapshot ever sees a cursor
+        cursor->born = SNAP_LIVE;
+        cursor->died = SNAP_LIVE;
+    }
+    //one lock round per batch; the cursor moves behind the last entry returned
+    pthread_rwlock_wrlock(&dir->lock);
+    if (fd1->cursor == NULL) {
+        child_link(dir, NULL, cursor);
+        fd1->cursor = cursor;
+    }
+    int n = 0;
+    File *last = cursor;
+    for (File *file = cursor->sibling; file != NULL && n < count; file = file->sibling) {
+        last = file;
+        if (file->type == DIR_CURSOR) {
+            //another descriptor listing the same directory
+            continue;
+        }
+        entries[n].type = file->type;
+        strcpy(entries[n].name, inode_get(&fs->inodes, file->ino)->name);
+        n++;
+    }
+    if (last != cursor) {
+        child_unlink(dir, cursor);
+        child_link(dir, last, cursor);
+    }
+    pthread_rwlock_unlock(&dir->lock);
+    pthread_mutex_unlock(&fd1->lock);
+    ebr_exit(&fs->ebr);
+    return n;
+}
+
+int rfs_readdir(Ramfs *fs, int fd, RamfsDirent *entries, int count) {
+    uint64_t start = stats_start(&fs->stats);
+    int result = read_dir(fs, fd, entries, count);
+    stats_op(&fs->stats, RAMFS_OP_READDIR, start, result == -1);
+    return result;
+}
+
+int rfs_closedir(Ramfs *fs, int fd) {
+    RamfsStat st;
+    if (rfs_fstat(fs, fd, &st) == -1 || st.type != DIRECTORY) {
+        return -1;
+    }
+    return rfs_close(fs, fd);
 }
 
 
-off_t rseek(int fd, off_t offset, int whence) {
-    if (fd < 0 || fd >= MAX_FD_COUNT) {
+static off_t seek_fd(Ramfs *fs, int fd, off_t offset, int whence) {
+    if (ebr_enter(&fs->ebr) == -1) {
         return -1;
     }
-    Fd *fd1 = fd_table.fds[fd];
+    Fd *fd1 = fd_get(fs, fd);
     if (fd1 == NULL) {
+        ebr_exit(&fs->ebr);
         return -1;
     }
+    pthread_mutex_lock(&fd1->lock);
     File *file = fd1->file;
+    off_t result = -1;
     if (whence == SEEK_SET) {
-        if (offset < 0) {
-            return -1;
+        if (offset >= 0) {
+            fd1->offset = offset;
+            result = fd1->offset;
         }
-        fd1->offset = offset;
     } else if (whence == SEEK_CUR) {
-        if (offset + fd1->offset < 0) { //offset+fd1->offset < 0
-            return -1;
+        if (offset + fd1->offset >= 0) { //offset+fd1->offset < 0
+            fd1->offset += offset;
+            result = fd1->offset;
         }
-        fd1->offset += offset;
     } else if (whence == SEEK_END) {
-        if (offset + fd1->file->size < 0) { //offset+fd1->file->size < 0
+        pthread_rwlock_rdlock(&file->lock);
+        if (offset + file->size >= 0) { //offset+fd1->file->size < 0
+            fd1->offset = file->size + offset;
+            result = fd1->offset;
+        }
+        pthread_rwlock_unlock(&file->lock);
+    } else if (whence == SEEK_DATA || whence == SEEK_HOLE) {
+        pthread_rwlock_rdlock(&file->lock);
+        //like lseek, offsets at or past the end have neither data nor a hole
+        if (offset >= 0 && offset < file->size) {
+            size_t next = bmap_seek(&file->content, offset, whence == SEEK_DATA);
+            if (whence == SEEK_HOLE && next > (size_t) file->size) {
+                //the end of the file is an implicit hole
+                next = file->size;
+            }
+            if (next < (size_t) file->size || whence == SEEK_HOLE) {
+                fd1->offset = (off_t) next;
+                result = fd1->offset;
+            }
+        }
+        pthread_rwlock_unlock(&file->lock);
+    }
+    pthread_mutex_unlock(&fd1->lock);
+    ebr_exit(&fs->ebr);
+    return result;
+}
+
+off_t rfs_seek(Ramfs *fs, int fd, off_t offset, int whence) {
+    uint64_t start = stats_start(&fs->stats);
+    off_t result = seek_fd(fs, fd, offset, whence);
+    stats_op(&fs->stats, RAMFS_OP_SEEK, start, result == -1);
+    return result;
+}
+
+//total length of an iovec array, -1 if the array is invalid or the total exceeds the largest file
+static ssize_t iov_total(const struct riovec *iov, int iovcnt) {
+    if (iovcnt < 0 || iovcnt > RIOV_MAX || (iov == NULL && iovcnt > 0)) {
+        return -1;
+    }
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if ((iov[i].iov_base == NULL && iov[i].iov_len > 0) || iov[i].iov_len > (size_t) FILE_SIZE_MAX - total) {
             return -1;
         }
-        fd1->offset = file->size + offset;
-    } else {
+        total += iov[i].iov_len;
+    }
+    return (ssize_t) total;
+}
+
+//read file content at offset into iov, offset -1 reads at the descriptor offset and advances it
+static ssize_t read_at(Ramfs *fs, int fd, const struct riovec *iov, int iovcnt, off_t offset) {
+    if (iovcnt < 0 || iovcnt > RIOV_MAX) {
+        return -1;
+    }
+    if (ebr_enter(&fs->ebr) == -1) {
+        return -1;
+    }
+    Fd *fd1 = fd_get(fs, fd);
+    if (fd1 == NULL || (fd1->flags & O_WRONLY) || fd1->file->type == DIRECTORY) {
+        ebr_exit(&fs->ebr);
         return -1;
     }
-    return fd1->offset;
+    File *file = fd1->file;
+    //positional reads leave the descriptor alone
+    if (offset == -1) {
+        pthread_mutex_lock(&fd1->lock);
+    }
+    pthread_rwlock_rdlock(&file->lock);
+    if (file->content.spilled > 0) {
+        //paging blocks back in changes the map
+        pthread_rwlock_unlock(&file->lock);
+        pthread_rwlock_wrlock(&file->lock);
+    }
+    file_touch(fs, file);
+    off_t pos = offset == -1 ? fd1->offset : offset;
+    ssize_t result;
+    //empty file or end of file
+    if (file->size == 0 || pos >= file->size) {
+        result = 0;
+    } else if ((result = iov_total(iov, iovcnt)) != -1) {
+        //one bounds check for the whole batch; pos is never negative and below the size here
+        size_t count = (size_t) result;
+        if (count > (size_t) (file->size - pos)) {
+            count = (size_t) (file->size - pos);
+        }
+        size_t done = 0;
+        int failed = tier_access(fs, file) && file_fault(fs, file, pos, count) == -1;
+        for (int i = 0; i < iovcnt && done < count && !failed; i++) {
+            size_t len = iov[i].iov_len < count - done ? iov[i].iov_len : count - done;
+            failed = bmap_read(&fs->store, &file->content, pos + done, iov[i].iov_base, len) == -1;
+            done += len;
+        }
+        if (failed) {
+            //the backing file failed
+            result = -1;
+        } else {
+            if (offset == -1) {
+                fd1->offset += (long) count;
+            }
+            result = (long) count;
+        }
+    }
+    pthread_rwlock_unlock(&file->lock);
+    if (offset == -1) {
+        pthread_mutex_unlock(&fd1->lock);
+    }
+    ebr_exit(&fs->ebr);
+    return result;
 }
 
-ssize_t rread(int fd, void *buf, size_t count) {
-    if (fd < 0 || fd >= MAX_FD_COUNT) {
+static ssize_t do_readv(Ramfs *fs, int fd, const struct riovec *iov, int iovcnt, off_t offset) {
+    uint64_t start = stats_start(&fs->stats);
+    ssize_t result = read_at(fs, fd, iov, iovcnt, offset);
+    stats_op(&fs->stats, RAMFS_OP_READ, start, result == -1);
+    if (result > 0) {
+        stats_bytes(&fs->stats, 0, (size_t) result);
+    }
+    return result;
+}
+
+//write iov to the file at offset, offset -1 writes at the descriptor offset and advances it
+static ssize_t write_at(Ramfs *fs, int fd, const struct riovec *iov, int iovcnt, off_t offset, Batch *batch) {
+    ssize_t total = iov_total(iov, iovcnt);
+    if (total == -1) {
         return -1;
     }
-    Fd *fd1 = fd_table.fds[fd];
-    if (fd1 == NULL) {
+    if (ebr_enter(&fs->ebr) == -1) {
         return -1;
     }
-    if (fd1->flags&O_WRONLY) {
+    Fd *fd1 = fd_get(fs, fd);
+    if (fd1 == NULL || (!(fd1->flags & O_WRONLY || fd1->flags & O_RDWR))) {
+        ebr_exit(&fs->ebr);
         return -1;
     }
     File *file = fd1->file;
-    if (file->type == DIRECTORY) {
+    if (file == NULL || file->type == DIRECTORY) {
+        ebr_exit(&fs->ebr);
         return -1;
     }
-    //empty file
-    if (file->size == 0 || fd1->file->content == NULL) {
-        return 0;
+    uint64_t gen = snap_change_begin(&fs->snaps);
+    if (offset == -1) {
+        pthread_mutex_lock(&fd1->lock);
+    }
+    pthread_rwlock_wrlock(&file->lock);
+    file_touch(fs, file);
+    off_t pos = offset == -1 ? fd1->offset : offset;
+    ssize_t result = -1;
+    uint64_t lsn = 0;
+    drop_linear(file, &fs->store);
+    //files stay below FILE_SIZE_MAX; the map grows once for the whole batch
+    if (total <= FILE_SIZE_MAX - pos && file_preserve(fs, file, gen) == 0 && bmap_reserve(&file->content, &fs->store, pos + total) == 0 &&
+        (!tier_access(fs, file) || file_fault(fs, file, pos, total) == 0)) {
+        size_t done = 0;
+        int written;
+        //only the blocks touched by this write are allocated
+        for (written = 0; written < iovcnt; written++) {
+            if (bmap_write(&file->content, &fs->store, pos + done, iov[written].iov_base, iov[written].iov_len) == -1) {
+                break;
+            }
+            done += iov[written].iov_len;
+        }
+        //blocks the write completed, the block it ends inside is indexed once it is filled
+        if (dedup_enabled(&fs->dedup)) {
+            for (size_t index = pos >> BLOCK_SHIFT; (index + 1) << BLOCK_SHIFT <= pos + done; index++) {
+                dedup_block(&file->content, &fs->store, index);
+            }
+        }
+        //out of memory part way keeps the buffers already written
+        if (done > 0 || total == 0) {
+            //done is at most total, so the end stays below FILE_SIZE_MAX
+            if (pos + (off_t) done > file->size) {
+                file->size = pos + (off_t) done;//new size
+            }
+            if (offset == -1) {
+                fd1->offset += (long) done;
+            }
+            result = (long) done;
+            lsn = journal_file(fs, JOURNAL_WRITE, file, pos, iov, written);
+        }
+    }
+    pthread_rwlock_unlock(&file->lock);
+    if (offset == -1) {
+        pthread_mutex_unlock(&fd1->lock);
+    }
+    snap_change_end(&fs->snaps);
+    ebr_exit(&fs->ebr);
+    if (result != -1 && journal_commit(fs, lsn, batch) == -1) {
+        result = -1;
     }
-    //check the buf
+    return result;
+}
+
+static ssize_t do_writev(Ramfs *fs, int fd, const struct riovec *iov, int iovcnt, off_t offset, Batch *batch) {
+    uint64_t start = stats_start(&fs->stats);
+    ssize_t result = write_at(fs, fd, iov, iovcnt, offset, batch);
+    stats_op(&fs->stats, RAMFS_OP_WRITE, start, result == -1);
+    if (result > 0) {
+        stats_bytes(&fs->stats, 1, (size_t) result);
+    }
+    return result;
+}
+
+ssize_t rfs_read(Ramfs *fs, int fd, void *buf, size_t count) {
+    struct riovec iov = {buf, count};
+    return do_readv(fs, fd, &iov, 1, -1);
+}
+
+ssize_t rfs_write(Ramfs *fs, int fd, const void *buf, size_t count) {
     if (buf == NULL) {
         return -1;
     }
-    if (fd1->offset + count > file->size) {
-        count = file->size - fd1->offset;
+    struct riovec iov = {(void *) buf, count};
+    return do_writev(fs, fd, &iov, 1, -1, NULL);
+}
+
+ssize_t rfs_pread(Ramfs *fs, int fd, void *buf, size_t count, off_t offset) {
+    if (offset < 0) {
+        return -1;
+    }
+    struct riovec iov = {buf, count};
+    return do_readv(fs, fd, &iov, 1, offset);
+}
+
+ssize_t rfs_pwrite(Ramfs *fs, int fd, const void *buf, size_t count, off_t offset) {
+    if (buf == NULL || offset < 0) {
+        return -1;
     }
-    //check whether the buf size
-    memcpy(buf, file->content + fd1->offset, count);
-    fd1->offset += (long) count;
-    return (long) count;
+    struct riovec iov = {(void *) buf, count};
+    return do_writev(fs, fd, &iov, 1, offset, NULL);
 }
 
-ssize_t rwrite(int fd, const void *buf, size_t count) {
-    if (fd < 0 || fd >= MAX_FD_COUNT) {
+ssize_t rfs_readv(Ramfs *fs, int fd, const struct riovec *iov, int iovcnt) {
+    return do_readv(fs, fd, iov, iovcnt, -1);
+}
+
+ssize_t rfs_writev(Ramfs *fs, int fd, const struct riovec *iov, int iovcnt) {
+    return do_writev(fs, fd, iov, iovcnt, -1, NULL);
+}
+
+//set the size of the file behind a writable descriptor to length, or with allocate give the
+//length bytes at offset blocks and grow the size to cover them; the blocks are capacity apart
+//from the size, which a shorter size drops and a longer one reads as zeros
+static int resize_fd(Ramfs *fs, int fd, off_t offset, off_t length, int allocate) {
+    if (offset < 0 || length < 0 || length > FILE_SIZE_MAX - offset || (allocate && length == 0)) {
         return -1;
     }
-    Fd *fd1 = fd_table.fds[fd];
-    if (fd1 == NULL || (!(fd1->flags & O_WRONLY || fd1->flags & O_RDWR))) {
+    if (ebr_enter(&fs->ebr) == -1) {
+        return -1;
+    }
+    Fd *fd1 = fd_get(fs, fd);
+    if (fd1 == NULL || !(fd1->flags & O_WRONLY || fd1->flags & O_RDWR) || fd1->file->type == DIRECTORY) {
+        ebr_exit(&fs->ebr);
         return -1;
     }
     File *file = fd1->file;
-    if (file == NULL || file->type == DIRECTORY || buf == NULL) {
+    uint64_t gen = snap_change_begin(&fs->snaps);
+    pthread_rwlock_wrlock(&file->lock);
+    file_touch(fs, file);
+    off_t end = offset + length;
+    off_t size = !allocate || end > file->size ? end : file->size;
+    int result = -1;
+    uint64_t lsn = 0;
+    if (file_preserve(fs, file, gen) == 0) {
+        if (allocate) {
+            result = bmap_allocate(&file->content, &fs->store, (size_t) offset, (size_t) length);
+        } else {
+            result = size < file->size ? bmap_truncate(&file->content, &fs->store, (size_t) size) : 0;
+        }
+        if (result == 0 && size != file->size) {
+            drop_linear(file, &fs->store);
+            file->size = size;
+            lsn = journal_file(fs, JOURNAL_TRUNCATE, file, (uint64_t) size, NULL, 0);
+        }
+    }
+    pthread_rwlock_unlock(&file->lock);
+    snap_change_end(&fs->snaps);
+    ebr_exit(&fs->ebr);
+    if (result == 0 && journal_commit(fs, lsn, NULL) == -1) {
+        result = -1;
+    }
+    return result;
+}
+
+int rfs_ftruncate(Ramfs *fs, int fd, off_t length) {
+    uint64_t start = stats_start(&fs->stats);
+    int result = resize_fd(fs, fd, 0, length, 0);
+    stats_op(&fs->stats, RAMFS_OP_WRITE, start, result == -1);
+    return result;
+}
+
+int rfs_fallocate(Ramfs *fs, int fd, off_t offset, off_t length) {
+    uint64_t start = stats_start(&fs->stats);
+    int result = resize_fd(fs, fd, offset, length, 1);
+    stats_op(&fs->stats, RAMFS_OP_WRITE, start, result == -1);
+    return result;
+}
+
+//run one submitted operation on descriptor fd
+static ssize_t submit_one(Ramfs *fs, RamfsSubmission *sub, int fd, Batch *batch) {
+    uint64_t start;
+    ssize_t result;
+    struct riovec iov = {sub->buf, sub->count};
+    switch (sub->op) {
+        case RAMFS_SUBMIT_OPEN:
+            start = stats_start(&fs->stats);
+            result = open_path(fs, sub->path, sub->open_flags, batch);
+            stats_op(&fs->stats, RAMFS_OP_OPEN, start, result == -1);
+            return result;
+        case RAMFS_SUBMIT_CLOSE:
+            return rfs_close(fs, fd);
+        case RAMFS_SUBMIT_READ:
+            return sub->offset >= -1 ? do_readv(fs, fd, &iov, 1, sub->offset) : -1;
+        case RAMFS_SUBMIT_WRITE:
+            return sub->buf != NULL && sub->offset >= -1 ? do_writev(fs, fd, &iov, 1, sub->offset, batch) : -1;
+        case RAMFS_SUBMIT_MKDIR:
+            start = stats_start(&fs->stats);
+            result = make_dir(fs, sub->path, batch);
+            stats_op(&fs->stats, RAMFS_OP_MKDIR, start, result == -1);
+            return result;
+        case RAMFS_SUBMIT_UNLINK:
+            start = stats_start(&fs->stats);
+            result = unlink_path(fs, sub->path, batch);
+            stats_op(&fs->stats, RAMFS_OP_UNLINK, start, result == -1);
+            return result;
+        default:
+            return -1;
+    }
+}
+
+int rfs_submit(Ramfs *fs, RamfsSubmission *ops, int count) {
+    if (count < 0 || (ops == NULL && count > 0)) {
+        return -1;
+    }
+    Batch batch;
+    batch.parent = NULL;
+    batch.parent_length = 0;
+    //records of every operation, to fail the changes whose records never reached the disk
+    uint64_t *lsns = fs->journal != NULL && count > 0 ? (uint64_t *) calloc(count, sizeof(uint64_t)) : NULL;
+    //one section for the batch keeps the shared parent directory alive
+    if (ebr_enter(&fs->ebr) == -1) {
+        free(lsns);
+        return -1;
+    }
+    //without the record list every change waits for its own record
+    batch.deferred = lsns != NULL;
+    int done = 0;
+    int failed = 0; //an operation of the running chain failed
+    int chain_fd = -1; //descriptor opened by the running chain
+    for (int i = 0; i < count; i++) {
+        RamfsSubmission *sub = &ops[i];
+        int linked = sub->fd == RAMFS_FD_LINKED;
+        int fd = linked ? chain_fd : sub->fd;
+        //a failed chain still closes the descriptor it opened
+        if (failed && !(sub->op == RAMFS_SUBMIT_CLOSE && linked && chain_fd != -1)) {
+            sub->result = RAMFS_SUBMIT_CANCELED;
+        } else {
+            batch.lsn = 0;
+            sub->result = submit_one(fs, sub, fd, &batch);
+            if (lsns != NULL) {
+                lsns[i] = batch.lsn;
+            }
+            if (sub->result < 0) {
+                failed = 1;
+            } else {
+                done++;
+                if (sub->op == RAMFS_SUBMIT_OPEN) {
+                    chain_fd = (int) sub->result;
+                } else if (sub->op == RAMFS_SUBMIT_CLOSE && fd == chain_fd) {
+                    chain_fd = -1;
+                }
+            }
+        }
+        if (!(sub->flags & RAMFS_SUBMIT_LINK)) {
+            failed = 0;
+            chain_fd = -1;
+        }
+    }
+    ebr_exit(&fs->ebr);
+    if (lsns != NULL) {
+        //one wait for the whole batch, concurrent batches share the sync
+        uint64_t last = 0;
+        for (int i = 0; i < count; i++) {
+            last = lsns[i] > last ? lsns[i] : last;
+        }
+        if (last != 0 && journal_wait(fs->journal, last) == -1) {
+            //made in memory but not durable, as a single call would report it
+            for (int i = 0; i < count; i++) {
+                if (lsns[i] != 0 && ops[i].result >= 0) {
+                    if (ops[i].op == RAMFS_SUBMIT_OPEN) {
+                        rfs_close(fs, (int) ops[i].result);
+                    }
+                    ops[i].result = -1;
+                    done--;
+                }
+            }
+        }
+        free(lsns);
+    }
+    return done;
+}
+
+ssize_t rfs_view(Ramfs *fs, int fd, size_t count, RamfsView *view) {
+    memset(view, 0, sizeof(RamfsView));
+    if (ebr_enter(&fs->ebr) == -1) {
+        return -1;
+    }
+    Fd *fd1 = fd_get(fs, fd);
+    if (fd1 == NULL || (fd1->flags & O_WRONLY) || fd1->file->type == DIRECTORY) {
+        ebr_exit(&fs->ebr);
         return -1;
     }
-    if (fd1->offset + count > file->size) {
-        if (file->content == NULL) {
-            file->content = malloc(fd1->offset + count);
+    File *file = fd1->file;
+    pthread_mutex_lock(&fd1->lock);
+    pthread_rwlock_rdlock(&file->lock);
+    file_touch(fs, file);
+    ssize_t result = 0;
+    if (fd1->offset < file->size && count > 0) {
+        if (count > (size_t) (file->size - fd1->offset)) {
+            count = (size_t) (file->size - fd1->offset);
+        }
+        //one span per block, plus the zeros past a short single block
+        size_t offset = fd1->offset;
+        size_t max = ((offset + count - 1) >> BLOCK_SHIFT) - (offset >> BLOCK_SHIFT) + 2;
+        view->spans = (RamfsSpan *) malloc(max * (sizeof(RamfsSpan) + sizeof(void *)));
+        if (view->spans == NULL) {
+            result = -1;
         } else {
-            char *tmp = malloc(fd1->offset + count);
-            memset(tmp, 0, fd1->offset + count);
-            memcpy(tmp, file->content, file->size);
-            free(file->content);
-            file->content = tmp;
+            view->pins = (void **) (view->spans + max);
+            atomic_fetch_add(&fs->views, 1);
+            while (view->length < count) {
+                size_t start = offset & (BLOCK_SIZE - 1);
+                size_t len = BLOCK_SIZE - start < count - view->length ? BLOCK_SIZE - start : count - view->length;
+                Block *block = bmap_find(&file->content, offset >> BLOCK_SHIFT);
+                RamfsSpan *span = &view->spans[view->count];
+                if (block != NULL && (block->stored != 0 || block_spilled(block))) {
+                    //the view gets its own unpacked copy, the file stays compressed or paged out
+                    Block *copy = block_alloc(&fs->store, block->capacity);
+                    if (copy == NULL) {
+                        break;
+                    }
+                    if (block_read(&fs->store, block, 0, copy->data, block->capacity) == -1) {
+                        block_put(copy, &fs->store);
+                        break;
+                    }
+                    block = copy;
+                } else if (block != NULL) {
+                    //pinned blocks are copied by the next write instead of changing under the view
+                    block_get(block);
+                }
+                if (block != NULL && start < block->capacity) {
+                    span->data = block->data + start;
+                    span->length = block->capacity - start < len ? block->capacity - start : len;
+                    view->pins[view->count] = block;
+                } else {
+                    span->data = bmap_zeros;
+                    span->length = len;
+                    view->pins[view->count] = NULL;
+                    if (block != NULL) {
+                        block_put(block, &fs->store);
+                    }
+                }
+                view->count++;
+                view->length += span->length;
+                offset += span->length;
+            }
+            if (view->length < count) {
+                //out of memory for an unpacked copy, or the backing file failed
+                rfs_view_release(fs, view);
+                result = -1;
+            } else {
+                fd1->offset = (off_t) offset;
+                result = (ssize_t) view->length;
+            }
         }
-        file->size = (int) fd1->offset + (int) count;//new size
     }
-    memcpy(file->content + fd1->offset, buf, count);
-    fd1->offset += (long) count;
-    return (long) count;
+    pthread_rwlock_unlock(&file->lock);
+    pthread_mutex_unlock(&fd1->lock);
+    ebr_exit(&fs->ebr);
+    return result;
 }
 
+void rfs_view_release(Ramfs *fs, RamfsView *view) {
+    if (view->spans != NULL) {
+        atomic_fetch_sub(&fs->views, 1);
+    }
+    for (size_t i = 0; i < view->count; i++) {
+        if (view->pins[i] != NULL) {
+            block_put((Block *) view->pins[i], &fs->store);
+        }
+    }
+    free(view->spans);
+    memset(view, 0, sizeof(RamfsView));
+}
 
-char *clean_path(const char *pathname) {
-    int length = strlen(pathname);
-    char *tmp = (char *) malloc(length + 1);
-    memset(tmp, 0, strlen(pathname) + 1);
-    int i;
-    for (i = length - 1; i >= 0; i--) {
-        if (pathname[i] == '/') {
-            continue;
+//live rmmap mapping; the same block mapped again only counts up
+typedef struct mapping {
+    const void *addr; //data of the mapped block, NULL if the slot is empty
+    Block *block; //block holding one reference per rmmap
+    size_t count; //rmmap calls not undone by rmunmap yet
+} Mapping;
+
+static size_t mapping_slot(Ramfs *fs, const void *addr) {
+    //block data is 8-byte aligned, the low bits carry nothing
+    return (size_t) (((uintptr_t) addr >> 3) * 11400714819323198485ull) & (fs->mapping_capacity - 1);
+}
+
+//slot of addr, or of the empty slot ending its probe sequence; caller holds mapping_lock
+static Mapping *mapping_find(Ramfs *fs, const void *addr) {
+    size_t i = mapping_slot(fs, addr);
+    while (fs->mappings[i].addr != NULL && fs->mappings[i].addr != addr) {
+        i = (i + 1) & (fs->mapping_capacity - 1);
+    }
+    return &fs->mappings[i];
+}
+
+//double the table, -1 if out of memory; caller holds mapping_lock
+static int mapping_grow(Ramfs *fs) {
+    size_t capacity = fs->mapping_capacity == 0 ? 64 : fs->mapping_capacity * 2;
+    Mapping *old = fs->mappings;
+    size_t old_capacity = fs->mapping_capacity;
+    fs->mappings = (Mapping *) calloc(capacity, sizeof(Mapping));
+    if (fs->mappings == NULL) {
+        fs->mappings = old;
+        return -1;
+    }
+    fs->mapping_capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].addr != NULL) {
+            *mapping_find(fs, old[i].addr) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+//empty a slot and move later entries of its cluster back so every probe sequence stays unbroken;
+//caller holds mapping_lock
+static void mapping_remove(Ramfs *fs, Mapping *slot) {
+    size_t hole = (size_t) (slot - fs->mappings);
+    size_t i = hole;
+    fs->mappings[hole].addr = NULL;
+    fs->mapping_count--;
+    for (;;) {
+        i = (i + 1) & (fs->mapping_capacity - 1);
+        if (fs->mappings[i].addr == NULL) {
+            return;
+        }
+        //an entry whose home lies cyclically in (hole, i] is still reachable where it is
+        size_t home = mapping_slot(fs, fs->mappings[i].addr);
+        if (((i - home) & (fs->mapping_capacity - 1)) >= ((i - hole) & (fs->mapping_capacity - 1))) {
+            fs->mappings[hole] = fs->mappings[i];
+            fs->mappings[i].addr = NULL;
+            hole = i;
+        }
+    }
+}
+
+//count one more mapping of block, -1 if out of memory
+static int mapping_add(Ramfs *fs, Block *block) {
+    pthread_mutex_lock(&fs->mapping_lock);
+    int result = 0;
+    if ((fs->mapping_count + 1) * 4 > fs->mapping_capacity * 3 && mapping_grow(fs) == -1) {
+        result = -1;
+    } else {
+        Mapping *slot = mapping_find(fs, block->data);
+        if (slot->addr == NULL) {
+            slot->addr = block->data;
+            slot->block = block;
+            slot->count = 0;
+            fs->mapping_count++;
+        }
+        slot->count++;
+    }
+    pthread_mutex_unlock(&fs->mapping_lock);
+    return result;
+}
+
+static void mapping_forget(Ramfs *fs) {
+    pthread_mutex_lock(&fs->mapping_lock);
+    free(fs->mappings);
+    fs->mappings = NULL;
+    fs->mapping_capacity = 0;
+    fs->mapping_count = 0;
+    pthread_mutex_unlock(&fs->mapping_lock);
+}
+
+const void *rfs_mmap(Ramfs *fs, int fd, size_t *length) {
+    if (ebr_enter(&fs->ebr) == -1) {
+        return NULL;
+    }
+    Fd *fd1 = fd_get(fs, fd);
+    if (fd1 == NULL || (fd1->flags & O_WRONLY) || fd1->file->type == DIRECTORY) {
+        ebr_exit(&fs->ebr);
+        return NULL;
+    }
+    File *file = fd1->file;
+    pthread_rwlock_rdlock(&file->lock);
+    file_touch(fs, file);
+    Block *block = (Block *) file->content.root;
+    if (file->content.height != 0 || block == NULL || block->capacity < (size_t) file->size ||
+        block_external(block) || block->stored != 0) {
+        //the content is not one arena block, share a contiguous copy until the next write
+        block = atomic_load(&file->linear);
+        if (block == NULL) {
+            Block *copy = block_alloc(&fs->store, file->size);
+            if (copy != NULL && bmap_read(&fs->store, &file->content, 0, copy->data, file->size) == -1) {
+                //the backing file failed
+                block_put(copy, &fs->store);
+            } else if (copy != NULL) {
+                if (atomic_compare_exchange_strong(&file->linear, &block, copy)) {
+                    block = copy;
+                } else {
+                    //another reader published its copy first
+                    block_put(copy, &fs->store);
+                }
+            }
+        }
+    }
+    if (block != NULL) {
+        if (mapping_add(fs, block) == -1) {
+            block = NULL;
         } else {
-            break;
+            block_get(block);
+            *length = file->size;
         }
     }
-    memcpy(tmp, pathname, i + 1);
-    tmp[i + 1] = '\0';
-    return tmp;
-}
\ No newline at end of file
+    pthread_rwlock_unlock(&file->lock);
+    ebr_exit(&fs->ebr);
+    return block != NULL ? block->data : NULL;
+}
+
+int rfs_munmap(Ramfs *fs, const void *addr) {
+    if (addr == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&fs->mapping_lock);
+    Mapping *slot = fs->mapping_capacity != 0 ? mapping_find(fs, addr) : NULL;
+    if (slot == NULL || slot->addr == NULL) {
+        //never mapped, already unmapped, or not the start of a mapping
+        pthread_mutex_unlock(&fs->mapping_lock);
+        return -1;
+    }
+    Block *block = slot->block;
+    if (--slot->count == 0) {
+        mapping_remove(fs, slot);
+    }
+    pthread_mutex_unlock(&fs->mapping_lock);
+    block_put(block, &fs->store);
+    return 0;
+}
+
+//fill st from a file, caller holds the file lock
+static void file_stat(File *file, RamfsStat *st) {
+    st->type = file->type;
+    st->size = file->size;
+    st->allocated = file->content.allocated;
+}
+
+static int stat_path(Ramfs *fs, const char *pathname, RamfsStat *st) {
+    Path path;
+    if (path_parse(&path, pathname) == -1) {
+        return -1;
+    }
+    if (ebr_enter(&fs->ebr) == -1) {
+        return -1;
+    }
+    File *file = find_file(fs, path.text, path.length);
+    if (file != NULL) {
+        pthread_rwlock_rdlock(&file->lock);
+        file_stat(file, st);
+        pthread_rwlock_unlock(&file->lock);
+    }
+    ebr_exit(&fs->ebr);
+    return file != NULL ? 0 : -1;
+}
+
+int rfs_stat(Ramfs *fs, const char *pathname, RamfsStat *st) {
+    uint64_t start = stats_start(&fs->stats);
+    int result = stat_path(fs, pathname, st);
+    stats_op(&fs->stats, RAMFS_OP_STAT, start, result == -1);
+    return result;
+}
+
+static int stat_fd(Ramfs *fs, int fd, RamfsStat *st) {
+    if (ebr_enter(&fs->ebr) == -1) {
+        return -1;
+    }
+    Fd *fd1 = fd_get(fs, fd);
+    if (fd1 != NULL) {
+        pthread_rwlock_rdlock(&fd1->file->lock);
+        file_stat(fd1->file, st);
+        pthread_rwlock_unlock(&fd1->file->lock);
+    }
+    ebr_exit(&fs->ebr);
+    return fd1 != NULL ? 0 : -1;
+}
+
+int rfs_fstat(Ramfs *fs, int fd, RamfsStat *st) {
+    uint64_t start = stats_start(&fs->stats);
+    int result = stat_fd(fs, fd, st);
+    stats_op(&fs->stats, RAMFS_OP_STAT, start, result == -1);
+    return result;
+}
+
+
+//child of dir named name as snapshot snap saw it
+static File *snap_child(Ramfs *fs, File *dir, const char *name, size_t len, uint64_t snap) {
+    File *file = dir_lookup(fs, dir, name, len);
+    if (file != NULL && file->born <= snap) {
+        return file;
+    }
+    //removed since, or replaced by a newer file of the same name
+    pthread_rwlock_rdlock(&dir->lock);
+    for (file = dir->ghosts; file != NULL; file = file->sibling) {
+        const Inode *inode = inode_get(&fs->inodes, file->ino);
+        if (file->born <= snap && snap < file->died && inode->name_length == len &&
+            memcmp(inode->name, name, len) == 0) {
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&dir->lock);
+    return file;
+}
+
+//walk a cleaned path in a snapshot, call inside an ebr and a change section
+static File *snap_find(Ramfs *fs, const Path *path, uint64_t snap) {
+    File *cur = fs->root;
+    size_t pos = 0, name_length;
+    const char *name;
+    while (cur != NULL && (name = path_next(path->text, path->length, &pos, &name_length)) != NULL) {
+        cur = snap_child(fs, cur, name, name_length, snap);
+    }
+    return cur;
+}
+
+//size and content of a file as snapshot snap saw them, caller holds the file lock
+static void snap_content(File *file, uint64_t snap, off_t *size, const BlockMap **content) {
+    *size = file->size;
+    *content = &file->content;
+    if (file->content_gen <= snap) {
+        return;
+    }
+    for (FileVersion *version = file->versions; version != NULL; version = version->next) {
+        if (version->from <= snap) {
+            *size = version->size;
+            *content = &version->content;
+            return;
+        }
+    }
+}
+
+//drop the ghosts and versions no live snapshot sees any more; no change or snapshot lookup
+//runs during a sweep, the locks keep out checkpoints walking older snapshots;
+//ghosts come before their parents on the list. ctx is the instance
+static void snap_sweep(void *ctx) {
+    Ramfs *fs = (Ramfs *) ctx;
+    File **link = &fs->retained_head;
+    File *prev = NULL;
+    while (*link != NULL) {
+        File *file = *link;
+        int ghost = file->died != SNAP_LIVE;
+        if (ghost && !snap_needed(&fs->snaps, file->born, file->died)) {
+            File *parent = file->parent;
+            pthread_rwlock_wrlock(&parent->lock);
+            if (file->prev_sibling != NULL) {
+                file->prev_sibling->sibling = file->sibling;
+            } else {
+                parent->ghosts = file->sibling;
+            }
+            if (file->sibling != NULL) {
+                file->sibling->prev_sibling = file->prev_sibling;
+            }
+            pthread_rwlock_unlock(&parent->lock);
+            *link = file->retained_next;
+            //live lookups that found the file before it was removed may still hold it
+            ebr_retire(&fs->ebr, file, free_file, fs);
+            continue;
+        }
+        //a version is current from its own generation until the next newer one
+        pthread_rwlock_wrlock(&file->lock);
+        uint64_t until = file->content_gen;
+        FileVersion **version_link = &file->versions;
+        while (*version_link != NULL) {
+            FileVersion *version = *version_link;
+            uint64_t from = version->from;
+            if (!snap_needed(&fs->snaps, from, until)) {
+                *version_link = version->next;
+                bmap_free(&version->content, &fs->store);
+                arena_free(&fs->arena, version, sizeof(FileVersion));
+            } else {
+                version_link = &version->next;
+            }
+            until = from;
+        }
+        pthread_rwlock_unlock(&file->lock);
+        if (!ghost && file->versions == NULL) {
+            file->retained = 0;
+            *link = file->retained_next;
+            continue;
+        }
+        prev = file;
+        link = &file->retained_next;
+    }
+    fs->retained_tail = prev;
+}
+
+int rfs_snapshot(Ramfs *fs) {
+    uint64_t start = stats_start(&fs->stats);
+    int snap = snap_take(&fs->snaps, NULL, NULL);
+    stats_op(&fs->stats, RAMFS_OP_SNAPSHOT, start, snap == -1);
+    return snap;
+}
+
+int rfs_snapshot_release(Ramfs *fs, int snap) {
+    return snap_release(&fs->snaps, snap, snap_sweep, fs);
+}
+
+int rfs_snapshot_stat(Ramfs *fs, int snap, const char *pathname, RamfsStat *st) {
+    Path path;
+    if (path_parse(&path, pathname) == -1) {
+        return -1;
+    }
+    if (ebr_enter(&fs->ebr) == -1) {
+        return -1;
+    }
+    snap_change_begin(&fs->snaps);
+    File *file = snap_live(&fs->snaps, snap) ? snap_find(fs, &path, snap) : NULL;
+    if (file != NULL) {
+        const BlockMap *content;
+        off_t size;
+        pthread_rwlock_rdlock(&file->lock);
+        snap_content(file, snap, &size, &content);
+        st->type = file->type;
+        st->size = size;
+        st->allocated = content->allocated;
+        pthread_rwlock_unlock(&file->lock);
+    }
+    snap_change_end(&fs->snaps);
+    ebr_exit(&fs->ebr);
+    return file != NULL ? 0 : -1;
+}
+
+int rfs_snapshot_open(Ramfs *fs, int snap, const char *pathname) {
+    Path path;
+    if (path_parse(&path, pathname) == -1) {
+        return -1;
+    }
+    if (ebr_enter(&fs->ebr) == -1) {
+        return -1;
+    }
+    snap_change_begin(&fs->snaps);
+    File *file = snap_live(&fs->snaps, snap) ? snap_find(fs, &path, snap) : NULL;
+    File *copy = NULL;
+    if (file != NULL) {
+        //the descriptor reads a private copy sharing the blocks, so it outlives the snapshot
+        copy = (File *) arena_calloc(&fs->arena, sizeof(File));
+    }
+    if (copy != NULL) {
+        const BlockMap *content;
+        copy->type = file->type;
+        atomic_init(&copy->link_count, 1);
+        pthread_rwlock_init(&copy->lock, NULL);
+        copy->died = SNAP_LIVE;
+        pthread_rwlock_rdlock(&file->lock);
+        snap_content(file, snap, &copy->size, &content);
+        bmap_clone(&copy->content, content);
+        pthread_rwlock_unlock(&file->lock);
+    }
+    snap_change_end(&fs->snaps);
+    Fd *fd1 = copy != NULL ? (Fd *) arena_alloc(&fs->arena, sizeof(Fd)) : NULL;
+    if (fd1 == NULL) {
+        if (copy != NULL) {
+            free_file(copy, fs);
+        }
+        ebr_exit(&fs->ebr);
+        return -1;
+    }
+    fd1->flags = O_RDONLY;
+    fd1->file = copy;
+    fd1->offset = 0;
+    fd1->snapshot = 1;
+    fd1->cursor = NULL;
+    pthread_mutex_init(&fd1->lock, NULL);
+    int fd = fd_alloc(fs, fd1);
+    if (fd == -1) {
+        free_fd(fd1, fs);
+        free_file(copy, fs);
+    }
+    ebr_exit(&fs->ebr);
+    return fd;
+}
+
+//files and directories as snapshot snap saw them inside dir, caller frees the array
+static File **snap_children(File *dir, uint64_t snap, size_t *count) {
+    size_t capacity = 16;
+    File **children = (File **) malloc(capacity * sizeof(File *));
+    *count = 0;
+    pthread_rwlock_rdlock(&dir->lock);
+    //live children first, then the removed ones the snapshot still saw
+    for (int pass = 0; pass < 2 && children != NULL; pass++) {
+        for (File *file = pass == 0 ? dir->child : dir->ghosts; file != NULL; file = file->sibling) {
+            if (file->born > snap || snap >= file->died) {
+                continue;
+            }
+            if (*count == capacity) {
+                capacity *= 2;
+                File **grown = (File **) realloc(children, capacity * sizeof(File *));
+                if (grown == NULL) {
+                    free(children);
+                    children = NULL;
+                    break;
+                }
+                children = grown;
+            }
+            children[(*count)++] = file;
+        }
+    }
+    pthread_rwlock_unlock(&dir->lock);
+    return children;
+}
+
+//add file and everything below it to the image, parent is the record of its directory
+static int checkpoint_file(Ramfs *fs, ImageWriter *writer, File *file, uint32_t parent, uint64_t snap) {
+    const BlockMap *content;
+    BlockMap clone;
+    off_t size;
+    pthread_rwlock_rdlock(&file->lock);
+    snap_content(file, snap, &size, &content);
+    //the clone keeps the blocks while they are written out without the lock
+    bmap_clone(&clone, content);
+    pthread_rwlock_unlock(&file->lock);
+    int64_t record = image_add(writer, parent, file->type, inode_get(&fs->inodes, file->ino)->name, size,
+                               &fs->store, &clone);
+    bmap_free(&clone, &fs->store);
+    if (record == -1) {
+        return -1;
+    }
+    if (file->type == FILE) {
+        return 0;
+    }
+    size_t count;
+    File **children = snap_children(file, snap, &count);
+    if (children == NULL) {
+        return -1;
+    }
+    int result = 0;
+    for (size_t i = 0; i < count && result == 0; i++) {
+        result = checkpoint_file(fs, writer, children[i], (uint32_t) record, snap);
+    }
+    free(children);
+    return result;
+}
+
+//instance of a checkpoint and the lsn of the last journal record its snapshot holds
+typedef struct checkpoint_mark {
+    Ramfs *fs;
+    uint64_t lsn;
+} CheckpointMark;
+
+//snap_take mark, no change is in progress so every record up to here is in the snapshot; ctx is a CheckpointMark
+static void mark_checkpoint(void *ctx) {
+    CheckpointMark *mark = (CheckpointMark *) ctx;
+    mark->lsn = mark->fs->journal != NULL ? journal_lsn(mark->fs->journal) : 0;
+}
+
+static int checkpoint_to(Ramfs *fs, const char *pathname) {
+    pthread_mutex_lock(&fs->checkpoint_lock);
+    //the files a snapshot sees stay allocated until it is released, so no lock is held for long
+    CheckpointMark mark = {fs, 0};
+    int snap = snap_take(&fs->snaps, mark_checkpoint, &mark);
+    if (snap == -1) {
+        pthread_mutex_unlock(&fs->checkpoint_lock);
+        return -1;
+    }
+    ImageWriter *writer = image_create(pathname, mark.lsn);
+    int result = -1;
+    if (writer != NULL) {
+        if (checkpoint_file(fs, writer, fs->root, 0, snap) == 0) {
+            result = image_finish(writer);
+        } else {
+            image_abort(writer);
+        }
+    }
+    rfs_snapshot_release(fs, snap);
+    //recovery replays only what came after this image
+    if (result == 0 && fs->journal != NULL && strcmp(pathname, fs->checkpoint_path) == 0) {
+        result = journal_compact(fs->journal, mark.lsn);
+    }
+    pthread_mutex_unlock(&fs->checkpoint_lock);
+    return result;
+}
+
+int rfs_checkpoint(Ramfs *fs, const char *pathname) {
+    uint64_t start = stats_start(&fs->stats);
+    int result = checkpoint_to(fs, pathname);
+    stats_op(&fs->stats, RAMFS_OP_CHECKPOINT, start, result == -1);
+    return result;
+}
+
+//rebuild the tree from a mapped image, the blocks stay in the mapping until they are written
+static int restore_image(Ramfs *fs, Image *image) {
+    size_t count = image->header->record_count;
+    File **files = (File **) malloc(count * sizeof(File *));
+    if (files == NULL) {
+        return -1;
+    }
+    files[0] = fs->root;
+    if (image->records[0].type != DIRECTORY) {
+        free(files);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const ImageRecord *record = &image->records[i];
+        File *file = fs->root;
+        if (i > 0) {
+            File *parent = files[record->parent];
+            const char *name = image->names + record->name_offset;
+            //the image is trusted for layout but not for names
+            if (parent->type != DIRECTORY || record->name_length == 0 || record->name_length > PATH_NAME_MAX ||
+                memchr(name, '/', record->name_length) != NULL ||
+                dir_lookup(fs, parent, name, record->name_length) != NULL) {
+                free(files);
+                return -1;
+            }
+            file = (File *) arena_calloc(&fs->arena, sizeof(File));
+            if (file == NULL || file_name(fs, file, name, record->name_length) == -1) {
+                if (file != NULL) {
+                    arena_free(&fs->arena, file, sizeof(File));
+                }
+                free(files);
+                return -1;
+            }
+            file->type = (int) record->type;
+            file->parent = parent;
+            bmap_init(&file->content);
+            pthread_rwlock_init(&file->lock, NULL);
+            file->died = SNAP_LIVE;
+            //cold from the start like a new file, so the tier thread may pack it without a touch
+            atomic_init(&file->touched, atomic_load_explicit(&fs->tier_clock, memory_order_relaxed));
+            file->packed = UINT64_MAX;
+            if (dir_insert(fs, parent, file) == -1) {
+                free_file(file, fs);
+                free(files);
+                return -1;
+            }
+            child_link(parent, parent->last_child, file);
+            stats_gauge(&fs->stats, file->type == DIRECTORY ? STATS_DIRECTORIES : STATS_FILES, 1);
+        }
+        files[i] = file;
+        if (record->size > (uint64_t) FILE_SIZE_MAX) {
+            free(files);
+            return -1;
+        }
+        file->size = (off_t) record->size;
+        for (uint64_t j = 0; j < record->extent_count; j++) {
+            const ImageExtent *extent = &image->extents[record->extent_first + j];
+            if (bmap_attach(&file->content, &fs->store, extent->index, image->base + extent->offset,
+                            extent->length) == -1) {
+                free(files);
+                return -1;
+            }
+        }
+    }
+    free(files);
+    return 0;
+}
+
+//1 while descriptors, views or rmmap mappings point into the tree, which a restore would free under them
+static int fs_in_use(Ramfs *fs) {
+    pthread_mutex_lock(&fs->mapping_lock);
+    size_t mapped = fs->mapping_count;
+    pthread_mutex_unlock(&fs->mapping_lock);
+    return mapped != 0 || atomic_load(&fs->views) != 0 || stats_gauge_sum(&fs->stats, STATS_OPEN_FDS) != 0;
+}
+
+int rfs_restore(Ramfs *fs, const char *pathname) {
+    if (fs->durability != RAMFS_DURABILITY_NONE) {
+        return -1;
+    }
+    if (fs_in_use(fs)) {
+        errno = EBUSY;
+        return -1;
+    }
+    Image *image = image_open(pathname);
+    if (image == NULL) {
+        return -1;
+    }
+    tier_stop(fs);
+    reset_ramfs(fs);
+    fs->image = image;
+    int result = restore_image(fs, image);
+    if (result == -1) {
+        //never leave half a tree behind
+        reset_ramfs(fs);
+    }
+    tier_start(fs);
+    return result;
+}
+
+//apply a journal record to the instance ctx through the public calls; the journal opens after replay,
+//so nothing is journaled twice
+static void replay_entry(const JournalEntry *entry, void *ctx) {
+    Ramfs *fs = (Ramfs *) ctx;
+    int fd;
+    switch (entry->op) {
+        case JOURNAL_MKDIR:
+            rfs_mkdir(fs, entry->path);
+            break;
+        case JOURNAL_RMDIR:
+            rfs_rmdir(fs, entry->path);
+            break;
+        case JOURNAL_UNLINK:
+            rfs_unlink(fs, entry->path);
+            break;
+        case JOURNAL_CREATE:
+            fd = rfs_open(fs, entry->path, O_CREAT | O_WRONLY);
+            rfs_close(fs, fd);
+            break;
+        case JOURNAL_TRUNCATE:
+            fd = rfs_open(fs, entry->path, O_WRONLY);
+            rfs_ftruncate(fs, fd, (off_t) entry->offset);
+            rfs_close(fs, fd);
+            break;
+        case JOURNAL_WRITE:
+            fd = rfs_open(fs, entry->path, O_WRONLY);
+            rfs_pwrite(fs, fd, entry->data, entry->length, (off_t) entry->offset);
+            rfs_close(fs, fd);
+            break;
+        default:
+            break;
+    }
+}
+
+//restore the last checkpoint and replay the journal on top of it, then keep journaling
+static int recover(Ramfs *fs) {
+    uint64_t lsn = 0;
+    Image *image = image_open(fs->checkpoint_path);
+    if (image != NULL) {
+        fs->image = image;
+        lsn = image->header->journal_lsn;
+        if (restore_image(fs, image) == -1) {
+            return -1;
+        }
+    } else if (errno != ENOENT) {
+        //a checkpoint that can not be read must not be taken for an empty tree
+        return -1;
+    }
+    fs->journal = journal_open(fs->journal_path, fs->durability, lsn, replay_entry, fs);
+    return fs->journal != NULL ? 0 : -1;
+}
+
+//the public levels are the journal modes
+typedef char durability_async_check[RAMFS_DURABILITY_ASYNC == JOURNAL_ASYNC ? 1 : -1];
+typedef char durability_sync_check[RAMFS_DURABILITY_SYNC == JOURNAL_SYNC ? 1 : -1];
+
+int rfs_durability(Ramfs *fs, const char *checkpoint_path, const char *journal_path, int level) {
+    if (level < RAMFS_DURABILITY_NONE || level > RAMFS_DURABILITY_SYNC ||
+        (level != RAMFS_DURABILITY_NONE && (checkpoint_path == NULL || journal_path == NULL))) {
+        return -1;
+    }
+    //flush the old journal while its paths are still known
+    journal_close(fs->journal);
+    fs->journal = NULL;
+    free(fs->checkpoint_path);
+    free(fs->journal_path);
+    fs->checkpoint_path = NULL;
+    fs->journal_path = NULL;
+    fs->durability = level;
+    if (level != RAMFS_DURABILITY_NONE) {
+        fs->checkpoint_path = strdup(checkpoint_path);
+        fs->journal_path = strdup(journal_path);
+        if (fs->checkpoint_path == NULL || fs->journal_path == NULL) {
+            fs->durability = RAMFS_DURABILITY_NONE;
+        }
+    }
+    return rfs_init(fs) == -1 || fs->durability != level ? -1 : 0;
+}
+
+//milliseconds of the monotonic clock
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+//replace the raw blocks of a file untouched since before cold by compressed copies,
+//block by block so that readers and writers wait for one block at most; caller is inside an ebr section
+static void compress_file(Ramfs *fs, File *file, uint64_t cold) {
+    uint64_t touched = atomic_load_explicit(&file->touched, memory_order_relaxed);
+    pthread_rwlock_rdlock(&file->lock);
+    //content a snapshot version shares would be kept twice
+    int skip = touched > cold || file->packed == touched || file->versions != NULL;
+    pthread_rwlock_unlock(&file->lock);
+    size_t offset = 0;
+    while (!skip) {
+        if (atomic_load(&file->link_count) == FILE_DEAD ||
+            atomic_load_explicit(&file->touched, memory_order_relaxed) != touched) {
+            return;
+        }
+        pthread_rwlock_rdlock(&file->lock);
+        size_t next = bmap_seek(&file->content, offset, 1);
+        Block *block = next != (size_t) -1 ? bmap_find(&file->content, next >> BLOCK_SHIFT) : NULL;
+        //shared and indexed blocks stay raw, a view or another file may point into them
+        int candidate = block != NULL && block->stored == 0 && !block_external(block) &&
+                        atomic_load(&block->indexed) == 0 && atomic_load(&block->refs) == 1;
+        if (candidate) {
+            block_get(block);
+        }
+        pthread_rwlock_unlock(&file->lock);
+        if (block == NULL) {
+            break;
+        }
+        size_t index = next >> BLOCK_SHIFT;
+        offset = (index + 1) << BLOCK_SHIFT;
+        if (!candidate) {
+            continue;
+        }
+        Block *packed = block_pack(&fs->store, block);
+        if (packed != NULL) {
+            pthread_rwlock_wrlock(&file->lock);
+            //the pin keeps the block alive, so the same address is the same unchanged block
+            if (bmap_find(&file->content, index) != block || atomic_load(&block->refs) != 2 ||
+                atomic_load_explicit(&file->touched, memory_order_relaxed) != touched ||
+                bmap_share(&file->content, &fs->store, index, packed) == -1) {
+                block_put(packed, &fs->store);
+            }
+            pthread_rwlock_unlock(&file->lock);
+        }
+        block_put(block, &fs->store);
+    }
+    pthread_rwlock_wrlock(&file->lock);
+    if (atomic_load_explicit(&file->touched, memory_order_relaxed) == touched) {
+        drop_linear(file, &fs->store);
+        file->packed = touched;
+    }
+    pthread_rwlock_unlock(&file->lock);
+}
+
+//files and directories in dir now, caller is inside an ebr section and frees the array; NULL if out of memory
+static File **dir_children(File *dir, size_t *count) {
+    size_t capacity = 16;
+    File **children = (File **) malloc(capacity * sizeof(File *));
+    *count = 0;
+    pthread_rwlock_rdlock(&dir->lock);
+    for (File *file = dir->child; file != NULL && children != NULL; file = file->sibling) {
+        if (file->type == DIR_CURSOR) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity *= 2;
+            File **grown = (File **) realloc(children, capacity * sizeof(File *));
+            if (grown == NULL) {
+                free(children);
+                children = NULL;
+                break;
+            }
+            children = grown;
+        }
+        children[(*count)++] = file;
+    }
+    pthread_rwlock_unlock(&dir->lock);
+    return children;
+}
+
+//path of a child named by inode inside the directory at dir, NULL if out of memory
+static char *child_path(const char *dir, size_t dir_length, const Inode *inode) {
+    char *path = (char *) malloc(dir_length + inode->name_length + 2);
+    if (path != NULL) {
+        memcpy(path, dir, dir_length);
+        path[dir_length] = '/';
+        memcpy(path + dir_length + 1, inode->name, inode->name_length);
+        path[dir_length + 1 + inode->name_length] = '\0';
+    }
+    return path;
+}
+
+//append path to a list of paths, -1 if out of memory
+static int push_path(char ***paths, size_t *count, size_t *capacity, char *path) {
+    if (path == NULL) {
+        return -1;
+    }
+    if (*count == *capacity) {
+        size_t grown_capacity = *capacity == 0 ? 16 : *capacity * 2;
+        char **grown = (char **) realloc(*paths, grown_capacity * sizeof(char *));
+        if (grown == NULL) {
+            free(path);
+            return -1;
+        }
+        *paths = grown;
+        *capacity = grown_capacity;
+    }
+    (*paths)[(*count)++] = path;
+    return 0;
+}
+
+//call visit on every regular file of the tree while the tier thread runs. A directory is listed in
+//one ebr section and every file visited in one of its own, so a pass over the whole tree never holds
+//back reclamation for long; in between they are known by path only and may be removed meanwhile.
+//-1 if out of memory or visit failed
+static int tier_walk(Ramfs *fs, int (*visit)(Ramfs *fs, File *file, const char *path, void *ctx), void *ctx) {
+    char **dirs = NULL, **files = NULL;
+    size_t dir_count = 0, dir_capacity = 0, file_count = 0, file_capacity = 0;
+    int result = push_path(&dirs, &dir_count, &dir_capacity, strdup(""));
+    while (result == 0 && dir_count > 0 && atomic_load(&fs->tier_running)) {
+        char *dir_path = dirs[--dir_count];
+        size_t dir_length = strlen(dir_path);
+        if (ebr_enter(&fs->ebr) == -1) {
+            free(dir_path);
+            result = -1;
+            break;
+        }
+        File *dir = walk_path(fs, dir_path, dir_length);
+        size_t count = 0;
+        File **children = dir != NULL && dir->type == DIRECTORY ? dir_children(dir, &count) : NULL;
+        for (size_t i = 0; children != NULL && result == 0 && i < count; i++) {
+            char *path = child_path(dir_path, dir_length, inode_get(&fs->inodes, children[i]->ino));
+            if (children[i]->type == DIRECTORY) {
+                result = push_path(&dirs, &dir_count, &dir_capacity, path);
+            } else {
+                result = push_path(&files, &file_count, &file_capacity, path);
+            }
+        }
+        ebr_exit(&fs->ebr);
+        free(children);
+        free(dir_path);
+        for (size_t i = 0; i < file_count; i++) {
+            if (result == 0 && atomic_load(&fs->tier_running) && ebr_enter(&fs->ebr) == 0) {
+                File *file = walk_path(fs, files[i], strlen(files[i]));
+                if (file != NULL && file->type == FILE) {
+                    result = visit(fs, file, files[i], ctx);
+                }
+                ebr_exit(&fs->ebr);
+            }
+            free(files[i]);
+        }
+        file_count = 0;
+    }
+    while (dir_count > 0) {
+        free(dirs[--dir_count]);
+    }
+    free(dirs);
+    free(files);
+    return result;
+}
+
+//tier_walk visit compressing a file untouched since the tier clock at ctx
+static int compress_visit(Ramfs *fs, File *file, const char *path, void *ctx) {
+    (void) path;
+    compress_file(fs, file, *(const uint64_t *) ctx);
+    return 0;
+}
+
+//page out the blocks of file until need bytes of memory are freed, return the bytes freed;
+//caller is inside an ebr section
+static int64_t spill_file(Ramfs *fs, File *file, int64_t need) {
+    pthread_rwlock_rdlock(&file->lock);
+    //content a snapshot version shares would stay in memory anyway
+    int skip = file->versions != NULL;
+    pthread_rwlock_unlock(&file->lock);
+    int64_t freed = 0;
+    size_t offset = 0;
+    while (!skip && freed < need && atomic_load(&file->link_count) != FILE_DEAD) {
+        pthread_rwlock_rdlock(&file->lock);
+        size_t next = bmap_seek(&file->content, offset, 1);
+        Block *block = next != (size_t) -1 ? bmap_find(&file->content, next >> BLOCK_SHIFT) : NULL;
+        //the same blocks as for compression stay, and those already outside the arena
+        int candidate = block != NULL && !block_external(block) && atomic_load(&block->indexed) == 0 &&
+                        atomic_load(&block->refs) == 1;
+        if (candidate) {
+            block_get(block);
+        }
+        pthread_rwlock_unlock(&file->lock);
+        if (block == NULL) {
+            break;
+        }
+        size_t index = next >> BLOCK_SHIFT;
+        offset = (index + 1) << BLOCK_SHIFT;
+        if (!candidate) {
+            continue;
+        }
+        Block *spilled = block_spill(&fs->store, block);
+        if (spilled == NULL) {
+            //the backing file or the arena is full, the next pass tries again
+            block_put(block, &fs->store);
+            break;
+        }
+        pthread_rwlock_wrlock(&file->lock);
+        if (bmap_find(&file->content, index) != block || atomic_load(&block->refs) != 2 ||
+            bmap_share(&file->content, &fs->store, index, spilled) == -1) {
+            block_put(spilled, &fs->store);
+        } else {
+            freed += block->stored != 0 ? block->stored : (int64_t) block->capacity;
+        }
+        pthread_rwlock_unlock(&file->lock);
+        block_put(block, &fs->store);
+    }
+    if (freed > 0) {
+        pthread_rwlock_wrlock(&file->lock);
+        drop_linear(file, &fs->store);
+        pthread_rwlock_unlock(&file->lock);
+    }
+    return freed;
+}
+
+//a regular file and its tier clock when the budget pass started
+typedef struct lru_entry {
+    char *path;
+    uint64_t touched;
+} LruEntry;
+
+//the files of a budget pass
+typedef struct lru_list {
+    LruEntry *files;
+    size_t count;
+    size_t capacity;
+} LruList;
+
+static int compare_touched(const void *a, const void *b) {
+    uint64_t x = ((const LruEntry *) a)->touched, y = ((const LruEntry *) b)->touched;
+    return x < y ? -1 : x > y;
+}
+
+//tier_walk visit appending a file to the LruList at ctx, -1 if out of memory
+static int collect_visit(Ramfs *fs, File *file, const char *path, void *ctx) {
+    (void) fs;
+    LruList *list = (LruList *) ctx;
+    if (list->count == list->capacity) {
+        size_t grown_capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        LruEntry *grown = (LruEntry *) realloc(list->files, grown_capacity * sizeof(LruEntry));
+        if (grown == NULL) {
+            return -1;
+        }
+        list->files = grown;
+        list->capacity = grown_capacity;
+    }
+    list->files[list->count].path = strdup(path);
+    if (list->files[list->count].path == NULL) {
+        return -1;
+    }
+    list->files[list->count].touched = atomic_load_explicit(&file->touched, memory_order_relaxed);
+    list->count++;
+    return 0;
+}
+
+//page out the least recently used files while the content in memory is over budget,
+//every file inside an ebr section of its own
+static void spill_lru(Ramfs *fs, size_t budget) {
+    int64_t resident = stats_gauge_sum(&fs->stats, STATS_BLOCK_BYTES);
+    if (resident <= (int64_t) budget) {
+        return;
+    }
+    //an eighth below the budget, so the next writes do not start another pass at once
+    int64_t target = (int64_t) (budget - budget / 8);
+    LruList list = {NULL, 0, 0};
+    if (tier_walk(fs, collect_visit, &list) == 0) {
+        qsort(list.files, list.count, sizeof(LruEntry), compare_touched);
+        for (size_t i = 0; i < list.count && resident > target && atomic_load(&fs->tier_running); i++) {
+            if (ebr_enter(&fs->ebr) == -1) {
+                break;
+            }
+            File *file = walk_path(fs, list.files[i].path, strlen(list.files[i].path));
+            if (file != NULL && file->type == FILE) {
+                resident -= spill_file(fs, file, resident - target);
+            }
+            ebr_exit(&fs->ebr);
+        }
+    }
+    for (size_t i = 0; i < list.count; i++) {
+        free(list.files[i].path);
+    }
+    free(list.files);
+}
+
+//time between passes of the tier thread, caller holds the tier lock
+static long tier_interval(Ramfs *fs) {
+    long interval = 1000;
+    if (fs->compress_idle_ms > 0) {
+        //a quarter of the idle time
+        interval = fs->compress_idle_ms / 4;
+        interval = interval < 1 ? 1 : interval > 1000 ? 1000 : interval;
+    }
+    if (atomic_load(&fs->memory_budget) != 0 && interval > SPILL_INTERVAL_MS) {
+        interval = SPILL_INTERVAL_MS;
+    }
+    return interval;
+}
+
+//advance the tier clock, then compress cold files and page out files over the memory budget;
+//arg is the instance
+static void *tier_main(void *arg) {
+    Ramfs *fs = (Ramfs *) arg;
+    //the clock goes on from where the last run stopped, so a restart does not make every file cold
+    uint64_t start = monotonic_ms() - atomic_load(&fs->tier_clock);
+    pthread_mutex_lock(&fs->tier_lock);
+    while (atomic_load(&fs->tier_running)) {
+        long interval = tier_interval(fs);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval / 1000;
+        deadline.tv_nsec += interval % 1000 * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&fs->tier_cond, &fs->tier_lock, &deadline);
+        if (!atomic_load(&fs->tier_running)) {
+            break;
+        }
+        uint64_t idle_ms = (uint64_t) fs->compress_idle_ms;
+        size_t budget = atomic_load(&fs->memory_budget);
+        pthread_mutex_unlock(&fs->tier_lock);
+        uint64_t now = monotonic_ms() - start;
+        atomic_store_explicit(&fs->tier_clock, now, memory_order_relaxed);
+        if (idle_ms > 0 && now >= idle_ms) {
+            uint64_t cold = now - idle_ms;
+            tier_walk(fs, compress_visit, &cold);
+        }
+        if (budget != 0) {
+            spill_lru(fs, budget);
+        }
+        pthread_mutex_lock(&fs->tier_lock);
+    }
+    pthread_mutex_unlock(&fs->tier_lock);
+    return NULL;
+}
+
+static void tier_stop(Ramfs *fs) {
+    pthread_mutex_lock(&fs->tier_lock);
+    int running = atomic_exchange(&fs->tier_running, 0);
+    pthread_cond_signal(&fs->tier_cond);
+    pthread_mutex_unlock(&fs->tier_lock);
+    if (running) {
+        pthread_join(fs->tier_thread, NULL);
+    }
+}
+
+//start the tier thread if it has work and is not running, -1 if it can not be started
+static int tier_start(Ramfs *fs) {
+    if (atomic_load(&fs->tier_running) || (fs->compress_idle_ms == 0 && atomic_load(&fs->memory_budget) == 0)) {
+        return 0;
+    }
+    atomic_store(&fs->tier_running, 1);
+    if (pthread_create(&fs->tier_thread, NULL, tier_main, fs) != 0) {
+        atomic_store(&fs->tier_running, 0);
+        return -1;
+    }
+    return 0;
+}
+
+int rfs_compress(Ramfs *fs, int idle_ms) {
+    //the default instance may be set up before init_ramfs
+    if (idle_ms < 0 || fs_prepare(fs) == -1) {
+        return -1;
+    }
+    pthread_mutex_lock(&fs->tier_lock);
+    fs->compress_idle_ms = idle_ms;
+    pthread_cond_signal(&fs->tier_cond);
+    pthread_mutex_unlock(&fs->tier_lock);
+    if (idle_ms == 0 && atomic_load(&fs->memory_budget) == 0) {
+        tier_stop(fs);
+    } else if (tier_start(fs) == -1) {
+        pthread_mutex_lock(&fs->tier_lock);
+        fs->compress_idle_ms = 0;
+        pthread_mutex_unlock(&fs->tier_lock);
+        return -1;
+    }
+    return 0;
+}
+
+int rfs_memory_budget(Ramfs *fs, size_t budget, const char *backing_path) {
+    if (fs_prepare(fs) == -1 || (backing_path == NULL && budget != 0 && !spill_enabled(&fs->spill))) {
+        return -1;
+    }
+    if (backing_path != NULL) {
+        //the tier thread may be writing a page of the old file, it waits until the new one is open
+        tier_stop(fs);
+        int opened = spill_open(&fs->spill, backing_path);
+        tier_start(fs);
+        if (opened == -1) {
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&fs->tier_lock);
+    atomic_store(&fs->memory_budget, budget);
+    pthread_cond_signal(&fs->tier_cond);
+    pthread_mutex_unlock(&fs->tier_lock);
+    if (budget == 0 && fs->compress_idle_ms == 0) {
+        tier_stop(fs);
+    } else if (tier_start(fs) == -1) {
+        atomic_store(&fs->memory_budget, 0);
+        return -1;
+    }
+    return 0;
+}
+
+//the public stats struct mirrors the slab classes
+typedef char slab_class_count_check[RAMFS_SLAB_CLASSES == SLAB_CLASS_COUNT ? 1 : -1];
+
+void rfs_slab_stats(Ramfs *fs, SlabStats *stats) {
+    memset(stats, 0, sizeof(SlabStats));
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        SlabClass *cls = &fs->arena.classes[i];
+        pthread_mutex_lock(&cls->lock);
+        stats->classes[i].object_size = arena_class_size(i);
+        stats->classes[i].slabs = cls->slabs;
+        stats->classes[i].capacity = cls->capacity;
+        stats->classes[i].in_use = cls->in_use;
+        pthread_mutex_unlock(&cls->lock);
+        stats->slab_bytes += stats->classes[i].slabs * SLAB_SIZE;
+        stats->object_bytes += stats->classes[i].in_use * arena_class_size(i);
+    }
+    pthread_mutex_lock(&fs->arena.large_lock);
+    stats->large_count = fs->arena.large_count;
+    stats->large_bytes = fs->arena.large_bytes;
+    pthread_mutex_unlock(&fs->arena.large_lock);
+}
+
+void rfs_dcache_stats(Ramfs *fs, DcacheStats *stats) {
+    if (fs->dcache == NULL) {
+        memset(stats, 0, sizeof(DcacheStats));
+        return;
+    }
+    dcache_stats(fs->dcache, stats);
+}
+
+void rfs_stats(Ramfs *fs, RamfsStats *stats) {
+    memset(stats, 0, sizeof(RamfsStats));
+    stats_collect(&fs->stats, stats);
+    SlabStats slab;
+    rfs_slab_stats(fs, &slab);
+    stats->memory_bytes = slab.slab_bytes + slab.large_bytes + inode_table_bytes(&fs->inodes);
+    stats->image_bytes = fs->image != NULL ? fs->image->length : 0;
+}
+
+void rfs_dedup(Ramfs *fs, int on) {
+    if (fs_prepare(fs) == 0) {
+        dedup_enable(&fs->dedup, on);
+    }
+}
+
+void rfs_dedup_stats(Ramfs *fs, RamfsDedupStats *stats) {
+    dedup_stats(&fs->dedup, stats);
+}
+
+Ramfs *ramfs_create() {
+    Ramfs *fs = (Ramfs *) calloc(1, sizeof(Ramfs));
+    if (fs == NULL) {
+        return NULL;
+    }
+    if (fs_prepare(fs) == -1) {
+        free(fs);
+        return NULL;
+    }
+    reset_ramfs(fs);
+    return fs;
+}
+
+void ramfs_destroy(Ramfs *fs) {
+    if (fs == NULL || fs == &fs_default) {
+        return;
+    }
+    share_destroy(&fs->share);
+    tier_stop(fs);
+    journal_close(fs->journal);
+    //callbacks still waiting for a grace period point into the arena
+    ebr_drain(&fs->ebr);
+    //every file, index, block and descriptor goes with the arena, none is freed on its own
+    mapping_forget(fs);
+    arena_reset(&fs->arena);
+    image_close(fs->image);
+    dcache_destroy(fs->dcache);
+    ebr_destroy(&fs->ebr);
+    inode_destroy(&fs->inodes);
+    snap_destroy(&fs->snaps);
+    dedup_destroy(&fs->dedup);
+    compress_destroy(&fs->cache);
+    spill_destroy(&fs->spill);
+    stats_destroy(&fs->stats);
+    free(fs->checkpoint_path);
+    free(fs->journal_path);
+    pthread_mutex_destroy(&fs->retained_lock);
+    pthread_mutex_destroy(&fs->checkpoint_lock);
+    pthread_mutex_destroy(&fs->tier_lock);
+    pthread_cond_destroy(&fs->tier_cond);
+    pthread_mutex_destroy(&fs->mapping_lock);
+    free(fs);
+}
+
+int rfs_share(Ramfs *fs, const char *image_path) {
+    return share_join(&fs->share, fs, image_path);
+}
+
+int rfs_share_refresh(Ramfs *fs) {
+    return share_refresh(&fs->share, fs);
+}
+
+int rfs_share_begin(Ramfs *fs) {
+    return share_begin(&fs->share, fs);
+}
+
+int rfs_share_commit(Ramfs *fs) {
+    return share_commit(&fs->share, fs);
+}
+
+int rfs_share_abort(Ramfs *fs) {
+    return share_abort(&fs->share, fs);
+}
+
+Ramfs *ramfs_default() {
+    return &fs_default;
+}
+
+//the calls without an instance argument work on the default instance
+int init_ramfs() {
+    return rfs_init(&fs_default);
+}
+
+int ropen(const char *pathname, int flags) {
+    return rfs_open(&fs_default, pathname, flags);
+}
+
+int rmkdir(const char *pathname) {
+    return rfs_mkdir(&fs_default, pathname);
+}
+
+int rrmdir(const char *pathname) {
+    return rfs_rmdir(&fs_default, pathname);
+}
+
+int runlink(const char *pathname) {
+    return rfs_unlink(&fs_default, pathname);
+}
+
+int rclose(int fd) {
+    return rfs_close(&fs_default, fd);
+}
+
+int ropendir(const char *pathname) {
+    return rfs_opendir(&fs_default, pathname);
+}
+
+int rreaddir(int fd, RamfsDirent *entries, int count) {
+    return rfs_readdir(&fs_default, fd, entries, count);
+}
+
+int rclosedir(int fd) {
+    return rfs_closedir(&fs_default, fd);
+}
+
+off_t rseek(int fd, off_t offset, int whence) {
+    return rfs_seek(&fs_default, fd, offset, whence);
+}
+
+ssize_t rread(int fd, void *buf, size_t count) {
+    return rfs_read(&fs_default, fd, buf, count);
+}
+
+ssize_t rwrite(int fd, const void *buf, size_t count) {
+    return rfs_write(&fs_default, fd, buf, count);
+}
+
+ssize_t rpread(int fd, void *buf, size_t count, off_t offset) {
+    return rfs_pread(&fs_default, fd, buf, count, offset);
+}
+
+ssize_t rpwrite(int fd, const void *buf, size_t count, off_t offset) {
+    return rfs_pwrite(&fs_default, fd, buf, count, offset);
+}
+
+ssize_t rreadv(int fd, const struct riovec *iov, int iovcnt) {
+    return rfs_readv(&fs_default, fd, iov, iovcnt);
+}
+
+ssize_t rwritev(int fd, const struct riovec *iov, int iovcnt) {
+    return rfs_writev(&fs_default, fd, iov, iovcnt);
+}
+
+int rftruncate(int fd, off_t length) {
+    return rfs_ftruncate(&fs_default, fd, length);
+}
+
+int rfallocate(int fd, off_t offset, off_t length) {
+    return rfs_fallocate(&fs_default, fd, offset, length);
+}
+
+int rsubmit(RamfsSubmission *ops, int count) {
+    return rfs_submit(&fs_default, ops, count);
+}
+
+ssize_t rview(int fd, size_t count, RamfsView *view) {
+    return rfs_view(&fs_default, fd, count, view);
+}
+
+void rview_release(RamfsView *view) {
+    rfs_view_release(&fs_default, view);
+}
+
+const void *rmmap(int fd, size_t *length) {
+    return rfs_mmap(&fs_default, fd, length);
+}
+
+int rmunmap(const void *addr) {
+    return rfs_munmap(&fs_default, addr);
+}
+
+int rstat(const char *pathname, RamfsStat *st) {
+    return rfs_stat(&fs_default, pathname, st);
+}
+
+int rfstat(int fd, RamfsStat *st) {
+    return rfs_fstat(&fs_default, fd, st);
+}
+
+int rsnapshot() {
+    return rfs_snapshot(&fs_default);
+}
+
+int rsnapshot_release(int snap) {
+    return rfs_snapshot_release(&fs_default, snap);
+}
+
+int rsnapshot_stat(int snap, const char *pathname, RamfsStat *st) {
+    return rfs_snapshot_stat(&fs_default, snap, pathname, st);
+}
+
+int rsnapshot_open(int snap, const char *pathname) {
+    return rfs_snapshot_open(&fs_default, snap, pathname);
+}
+
+int rcheckpoint(const char *pathname) {
+    return rfs_checkpoint(&fs_default, pathname);
+}
+
+int rrestore(const char *pathname) {
+    return rfs_restore(&fs_default, pathname);
+}
+
+int ramfs_share(const char *image_path) {
+    return rfs_share(&fs_default, image_path);
+}
+
+int rshare_refresh() {
+    return rfs_share_refresh(&fs_default);
+}
+
+int rshare_begin() {
+    return rfs_share_begin(&fs_default);
+}
+
+int rshare_commit() {
+    return rfs_share_commit(&fs_default);
+}
+
+int rshare_abort() {
+    return rfs_share_abort(&fs_default);
+}
+
+int ramfs_durability(const char *checkpoint_path, const char *journal_path, int level) {
+    return rfs_durability(&fs_default, checkpoint_path, journal_path, level);
+}
+
+int ramfs_compress(int idle_ms) {
+    return rfs_compress(&fs_default, idle_ms);
+}
+
+int ramfs_memory_budget(size_t budget, const char *backing_path) {
+    return rfs_memory_budget(&fs_default, budget, backing_path);
+}
+
+void ramfs_slab_stats(SlabStats *stats) {
+    rfs_slab_stats(&fs_default, stats);
+}
+
+void ramfs_dcache_stats(DcacheStats *stats) {
+    rfs_dcache_stats(&fs_default, stats);
+}
+
+void ramfs_stats(RamfsStats *stats) {
+    rfs_stats(&fs_default, stats);
+}
+
+void ramfs_dedup(int on) {
+    rfs_dedup(&fs_default, on);
+}
+
+void ramfs_dedup_stats(RamfsDedupStats *stats) {
+    rfs_dedup_stats(&fs_default, stats);
+}
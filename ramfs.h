@@ -10,17 +10,382 @@
 #define SEEK_SET 0
 #define SEEK_CUR 1
 #define SEEK_END 2
+//next offset inside written data, and next offset inside a hole or the end of the file
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
 
 typedef intptr_t ssize_t;
 typedef uintptr_t size_t;
 typedef long off_t;
 
+//returns the lowest free descriptor slot; the bits above the slot number count reuses of the slot,
+//so a descriptor used after rclose is rejected even once its slot has been handed out again
 int ropen(const char *pathname, int flags);
 int rclose(int fd);
 ssize_t rwrite(int fd, const void *buf, size_t count);
 ssize_t rread(int fd, void *buf, size_t count);
 off_t rseek(int fd, off_t offset, int whence);
+
+//file or directory attributes
+typedef struct ramfs_stat {
+    int type; //0 file, 1 directory
+    off_t size; //logical size, holes included
+    size_t allocated; //bytes of content memory, holes cost nothing
+} RamfsStat;
+
+int rstat(const char *pathname, RamfsStat *st);
+int rfstat(int fd, RamfsStat *st);
+
+//longest file or directory name
+#define RAMFS_NAME_MAX 32
+
+//directory entry returned by rreaddir
+typedef struct ramfs_dirent {
+    int type; //0 file, 1 directory
+    char name[RAMFS_NAME_MAX + 1];
+} RamfsDirent;
+
+//open a directory for listing, return a descriptor or -1 if pathname is not a directory
+int ropendir(const char *pathname);
+//fill up to count entries and return how many, 0 once every entry was returned, -1 on error;
+//the cursor is a marker in the directory's list of children, so a batch costs the same in a
+//directory of millions, and entries removed before the cursor reaches them are never returned;
+//entries created after ropendir may be missed. Works on any directory descriptor but snapshots
+int rreaddir(int fd, RamfsDirent *entries, int count);
+int rclosedir(int fd);
+
+//take a consistent point-in-time snapshot of the whole tree in O(1), return its id or -1;
+//files and blocks are shared with the live tree and copied only when it changes them
+int rsnapshot();
+//drop a snapshot, descriptors opened in it stay readable
+int rsnapshot_release(int snap);
+//open a file or directory as the snapshot saw it, read-only
+int rsnapshot_open(int snap, const char *pathname);
+int rsnapshot_stat(int snap, const char *pathname, RamfsStat *st);
+
+//write a consistent image of the whole tree to pathname, replacing it atomically
+int rcheckpoint(const char *pathname);
+//replace the file system by the image at pathname; the image is mapped, not read, so its pages
+//are faulted in on first access and the file must stay unchanged until the next init_ramfs;
+//-1 while a journal is kept, recovery restores the journal's own checkpoint. The old tree is freed
+//at once, so no other call may run meanwhile; -1 with errno EBUSY while descriptors, views or rmmap
+//mappings are live
+int rrestore(const char *pathname);
+
+//share one file system between processes through the checkpoint image at image_path, kept in
+//memory if it is under /dev/shm: every process restores the same image, so file content is mapped
+//once for all of them and read without copies. The first process to join publishes its tree,
+//later ones replace theirs by the shared one. Works like rrestore, -1 while a journal is kept;
+//NULL stops sharing and keeps the tree. No share call may run while another thread uses the file
+//system, and those replacing the tree fail with EBUSY as rrestore does
+int ramfs_share(const char *image_path);
+//restore the image published since the last refresh, 1 if there was one, 0 if the tree is current
+int rshare_refresh();
+//take the writer lock shared by every process and refresh; changes until rshare_commit are
+//local, and changes made outside of rshare_begin and rshare_commit are dropped by the next refresh
+int rshare_begin();
+//publish the tree as a new image, which rewrites the whole tree, refresh and release the writer lock;
+//while descriptors, views or mappings are live the tree stays in private memory until the next refresh
+int rshare_commit();
+//drop the changes since rshare_begin and release the writer lock
+int rshare_abort();
+
+//durability levels of ramfs_durability
+#define RAMFS_DURABILITY_NONE 0 //no journal, a crash loses everything since the last rcheckpoint
+#define RAMFS_DURABILITY_ASYNC 1 //the journal is synced every few milliseconds in the background
+#define RAMFS_DURABILITY_SYNC 2 //changes return once journaled, concurrent changes share one fsync
+
+//journal every change to journal_path from now on; init_ramfs recovers by restoring the checkpoint
+//rcheckpoint last wrote to checkpoint_path and replaying the journal on top, and each rcheckpoint
+//to checkpoint_path drops the journal records it holds. Runs init_ramfs itself, -1 if recovery
+//failed; a change whose record can not be journaled returns -1 though it was made in memory
+int ramfs_durability(const char *checkpoint_path, const char *journal_path, int level);
+
+//most buffers accepted by one rreadv or rwritev
+#define RIOV_MAX 1024
+
+//buffer of a vectored read or write
+struct riovec {
+    void *iov_base; //start of the buffer
+    size_t iov_len; //bytes in the buffer
+};
+
+//read and write at offset without using or moving the descriptor offset
+ssize_t rpread(int fd, void *buf, size_t count, off_t offset);
+ssize_t rpwrite(int fd, const void *buf, size_t count, off_t offset);
+//scatter read and gather write of iovcnt buffers in one call, at the descriptor offset
+ssize_t rreadv(int fd, const struct riovec *iov, int iovcnt);
+ssize_t rwritev(int fd, const struct riovec *iov, int iovcnt);
+
+//set the size of a file open for writing to length in place: a shorter file drops its content past
+//length, a longer one reads as zeros up to it and allocates nothing
+int rftruncate(int fd, off_t length);
+//allocate the content of length bytes at offset up front and grow the file to cover them, so a
+//writer that knows its final size allocates once; RamfsStat.allocated counts the capacity
+int rfallocate(int fd, off_t offset, off_t length);
+
+//operations of rsubmit
+#define RAMFS_SUBMIT_OPEN 1 //path, open_flags; the result is the new descriptor
+#define RAMFS_SUBMIT_CLOSE 2 //fd
+#define RAMFS_SUBMIT_READ 3 //fd, buf, count, offset; offset -1 uses the descriptor offset
+#define RAMFS_SUBMIT_WRITE 4 //fd, buf, count, offset; offset -1 uses the descriptor offset
+#define RAMFS_SUBMIT_MKDIR 5 //path
+#define RAMFS_SUBMIT_UNLINK 6 //path
+
+//flag of a submitted operation: the next one runs only if this one succeeds
+#define RAMFS_SUBMIT_LINK 1
+//fd of an operation in a chain: the descriptor opened earlier in the same chain
+#define RAMFS_FD_LINKED (-2)
+//result of an operation skipped because an earlier one in its chain failed
+#define RAMFS_SUBMIT_CANCELED (-2)
+
+//one operation of a batch
+typedef struct ramfs_submission {
+    int op; //RAMFS_SUBMIT_OPEN ...
+    int flags; //RAMFS_SUBMIT_LINK or 0
+    const char *path;
+    int open_flags; //flags of ropen
+    int fd; //descriptor or RAMFS_FD_LINKED
+    void *buf;
+    size_t count;
+    off_t offset;
+    ssize_t result; //set by rsubmit: what the single call returns, or RAMFS_SUBMIT_CANCELED
+} RamfsSubmission;
+
+//run count operations in order and return how many succeeded, -1 on bad arguments. Operations
+//in the same directory as the previous path look their names up in it directly, and the journal
+//is waited for once for the whole batch. A failed chain cancels the rest of the chain but a
+//linked close, so the descriptor it opened is not leaked
+int rsubmit(RamfsSubmission *ops, int count);
+
+#define RAMFS_AIO_MAX_WORKERS 64
+
+//engine running submitted batches on a pool of worker threads
+typedef struct ramfs_aio RamfsAio;
+
+//a finished batch of raio_submit
+typedef struct ramfs_completion {
+    void *user_data; //as passed to raio_submit
+    RamfsSubmission *ops; //the batch, every result filled in
+    int count;
+    int result; //what rsubmit returned for the batch
+} RamfsCompletion;
+
+//start an engine of workers threads, NULL on error
+RamfsAio *raio_create(int workers);
+//queue a batch to run as by rsubmit on a worker, -1 on error; ops must stay valid until its completion
+int raio_submit(RamfsAio *aio, RamfsSubmission *ops, int count, void *user_data);
+//take up to max finished batches without blocking, return how many
+int raio_poll(RamfsAio *aio, RamfsCompletion *completions, int max);
+//like raio_poll, but block until at least one batch finished
+int raio_wait(RamfsAio *aio, RamfsCompletion *completions, int max);
+//eventfd that is readable while finished batches wait to be polled, for poll or epoll
+int raio_fd(RamfsAio *aio);
+//run the queued batches, stop the workers and drop completions never polled
+void raio_destroy(RamfsAio *aio);
 int rmkdir(const char *pathname);
 int rrmdir(const char *pathname);
 int runlink(const char *pathname);
-void init_ramfs();
+//start the file system over, must not run concurrently with any other call; -1 if out of memory
+//or recovery failed, which leaves an empty tree without durability
+int init_ramfs();
+
+//contiguous piece of file content
+typedef struct ramfs_span {
+    const void *data; //read-only bytes inside the file system
+    size_t length; //byte count
+} RamfsSpan;
+
+//read-only view of file content, no bytes are copied
+typedef struct ramfs_view {
+    RamfsSpan *spans; //spans in file order
+    size_t count; //number of spans
+    size_t length; //total bytes of all spans
+    void **pins; //storage held by the view
+} RamfsView;
+
+//like rread, but fills view with spans into the file storage instead of copying;
+//the spans keep their content through later writes, truncation and unlink until rview_release
+ssize_t rview(int fd, size_t count, RamfsView *view);
+void rview_release(RamfsView *view);
+
+//map the whole file read-only, length receives its size; the mapping is a snapshot that
+//stays valid until rmunmap, a file spanning several blocks is copied once per change
+const void *rmmap(int fd, size_t *length);
+//undo one rmmap returning addr, from any thread; -1 if addr is not a live mapping
+int rmunmap(const void *addr);
+
+//path lookup cache counters
+typedef struct dcache_stats {
+    uint64_t hits; //lookups answered with a cached file
+    uint64_t negative_hits; //lookups answered with a cached "not found"
+    uint64_t misses; //lookups that walked the tree
+    uint64_t inserts; //walk results stored
+    uint64_t invalidations; //entries dropped by create, rmdir or unlink
+} DcacheStats;
+
+void ramfs_dcache_stats(DcacheStats *stats);
+
+#define RAMFS_SLAB_CLASSES 12
+
+//occupancy of one slab size class
+typedef struct slab_class_stats {
+    size_t object_size; //bytes per object
+    size_t slabs; //slabs held
+    size_t capacity; //objects the slabs can hold
+    size_t in_use; //objects allocated
+} SlabClassStats;
+
+//occupancy of the allocator behind files, names, directory indexes, blocks and descriptors
+typedef struct slab_stats {
+    SlabClassStats classes[RAMFS_SLAB_CLASSES];
+    size_t slab_bytes; //memory held by slabs
+    size_t object_bytes; //slab memory handed out
+    size_t large_count; //allocations too big for a slab
+    size_t large_bytes; //memory held by them
+} SlabStats;
+
+void ramfs_slab_stats(SlabStats *stats);
+
+//share full blocks with equal content between files from now on, or stop indexing new ones;
+//a shared block is copied when a file writes it. Costs a hash of every block a write completes
+void ramfs_dedup(int on);
+
+//blocks shared by deduplication
+typedef struct ramfs_dedup_stats {
+    size_t blocks; //distinct blocks in the index
+    size_t references; //references to them, each one a block copy without deduplication
+    size_t saved_bytes; //memory the extra references would take as copies
+    double ratio; //references per block, 1 when nothing is shared
+    uint64_t merged; //written blocks replaced by an equal indexed one since init_ramfs
+} RamfsDedupStats;
+
+void ramfs_dedup_stats(RamfsDedupStats *stats);
+
+//compress the content of files nobody read or wrote for idle_ms in a background thread, 0 stops;
+//reads decompress through a small cache of recently used blocks, a write stores its blocks as is
+int ramfs_compress(int idle_ms);
+
+//keep file content in memory below about budget bytes from now on, 0 lifts the limit; a background
+//thread pages the least recently used files out to backing_path and reads and writes page their
+//blocks back in. The namespace stays in memory. backing_path may be NULL once a file is open,
+//-1 if it can not be created or is changed while blocks live in the old one
+int ramfs_memory_budget(size_t budget, const char *backing_path);
+
+//operations counted by ramfs_stats
+#define RAMFS_OP_OPEN 0
+#define RAMFS_OP_CLOSE 1
+#define RAMFS_OP_READ 2 //rread, rpread, rreadv
+#define RAMFS_OP_WRITE 3 //rwrite, rpwrite, rwritev, rftruncate, rfallocate
+#define RAMFS_OP_SEEK 4
+#define RAMFS_OP_STAT 5 //rstat, rfstat
+#define RAMFS_OP_MKDIR 6
+#define RAMFS_OP_RMDIR 7
+#define RAMFS_OP_UNLINK 8
+#define RAMFS_OP_LOOKUP 9 //path walks on path cache misses, not found counts as an error
+#define RAMFS_OP_SNAPSHOT 10
+#define RAMFS_OP_CHECKPOINT 11
+#define RAMFS_OP_READDIR 12
+#define RAMFS_OP_DECOMPRESS 13 //blocks unpacked on misses of the decompression cache
+#define RAMFS_OP_COUNT 14
+
+//log-linear latency histogram: values below 8 ns get a bucket each, above that every power of two
+//is split into 8 buckets, so a bucket is within 12.5% of the latencies in it
+#define RAMFS_HIST_SUB_BITS 3
+#define RAMFS_HIST_BUCKETS 312
+//every thread times one call in RAMFS_STATS_SAMPLE, reading the clock costs more than counting
+#define RAMFS_STATS_SAMPLE 8
+
+typedef struct ramfs_op_stats {
+    uint64_t calls;
+    uint64_t errors; //calls that returned -1
+    uint64_t timed; //calls sampled into total_ns and histogram
+    uint64_t total_ns; //time spent in the timed calls
+    uint64_t histogram[RAMFS_HIST_BUCKETS]; //timed calls by latency in ns
+} RamfsOpStats;
+
+//counters since init_ramfs and gauges of the file system now
+typedef struct ramfs_stats {
+    RamfsOpStats ops[RAMFS_OP_COUNT]; //by RAMFS_OP_*
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    int64_t files; //regular files in the tree
+    int64_t directories; //directories in the tree, the root included
+    int64_t open_fds;
+    int64_t block_bytes; //file content held in memory, versions kept for snapshots included
+    int64_t compressed_bytes; //memory of compressed blocks, part of block_bytes
+    int64_t compressed_raw_bytes; //their content before compression
+    int64_t spilled_bytes; //file content paged out to the backing file, not part of block_bytes
+    uint64_t tier_hits; //reads and writes under a memory budget that found their blocks in memory
+    uint64_t tier_faults; //reads and writes that read paged out blocks back first
+    uint64_t spills; //blocks paged out
+    size_t image_bytes; //checkpoint image mapped by rrestore or recovery
+    size_t memory_bytes; //memory held by the allocator, blocks included
+} RamfsStats;
+
+//collect the counters of every thread; counting is per thread, so it stays on under load
+void ramfs_stats(RamfsStats *stats);
+
+//upper bound of the latency in ns that a fraction q (0..1) of the calls stayed below
+uint64_t ramfs_stats_percentile(const RamfsOpStats *op, double q);
+
+//independent file system with its own tree, descriptors, snapshots and path cache
+typedef struct ramfs Ramfs;
+
+//new empty file system next to the default one the calls above use, NULL if out of memory or
+//too many are live. It has its own durability, deduplication, compression, memory budget and counters
+Ramfs *ramfs_create();
+//free the whole file system at once, its descriptors become invalid; no call may still use it
+void ramfs_destroy(Ramfs *fs);
+
+//the default file system, for the calls below
+Ramfs *ramfs_default();
+
+//the calls above on fs instead of the default file system; descriptors, snapshot ids, views and
+//rmmap addresses belong to the file system that returned them
+int rfs_init(Ramfs *fs);
+int rfs_open(Ramfs *fs, const char *pathname, int flags);
+int rfs_close(Ramfs *fs, int fd);
+ssize_t rfs_write(Ramfs *fs, int fd, const void *buf, size_t count);
+ssize_t rfs_read(Ramfs *fs, int fd, void *buf, size_t count);
+off_t rfs_seek(Ramfs *fs, int fd, off_t offset, int whence);
+ssize_t rfs_pread(Ramfs *fs, int fd, void *buf, size_t count, off_t offset);
+ssize_t rfs_pwrite(Ramfs *fs, int fd, const void *buf, size_t count, off_t offset);
+ssize_t rfs_readv(Ramfs *fs, int fd, const struct riovec *iov, int iovcnt);
+ssize_t rfs_writev(Ramfs *fs, int fd, const struct riovec *iov, int iovcnt);
+int rfs_ftruncate(Ramfs *fs, int fd, off_t length);
+int rfs_fallocate(Ramfs *fs, int fd, off_t offset, off_t length);
+int rfs_stat(Ramfs *fs, const char *pathname, RamfsStat *st);
+int rfs_fstat(Ramfs *fs, int fd, RamfsStat *st);
+int rfs_mkdir(Ramfs *fs, const char *pathname);
+int rfs_rmdir(Ramfs *fs, const char *pathname);
+int rfs_unlink(Ramfs *fs, const char *pathname);
+int rfs_opendir(Ramfs *fs, const char *pathname);
+int rfs_readdir(Ramfs *fs, int fd, RamfsDirent *entries, int count);
+int rfs_closedir(Ramfs *fs, int fd);
+int rfs_submit(Ramfs *fs, RamfsSubmission *ops, int count);
+int rfs_snapshot(Ramfs *fs);
+int rfs_snapshot_release(Ramfs *fs, int snap);
+int rfs_snapshot_open(Ramfs *fs, int snap, const char *pathname);
+int rfs_snapshot_stat(Ramfs *fs, int snap, const char *pathname, RamfsStat *st);
+int rfs_checkpoint(Ramfs *fs, const char *pathname);
+int rfs_restore(Ramfs *fs, const char *pathname);
+int rfs_share(Ramfs *fs, const char *image_path);
+int rfs_share_refresh(Ramfs *fs);
+int rfs_share_begin(Ramfs *fs);
+int rfs_share_commit(Ramfs *fs);
+int rfs_share_abort(Ramfs *fs);
+ssize_t rfs_view(Ramfs *fs, int fd, size_t count, RamfsView *view);
+void rfs_view_release(Ramfs *fs, RamfsView *view);
+const void *rfs_mmap(Ramfs *fs, int fd, size_t *length);
+int rfs_munmap(Ramfs *fs, const void *addr);
+void rfs_dcache_stats(Ramfs *fs, DcacheStats *stats);
+void rfs_slab_stats(Ramfs *fs, SlabStats *stats);
+int rfs_durability(Ramfs *fs, const char *checkpoint_path, const char *journal_path, int level);
+void rfs_dedup(Ramfs *fs, int on);
+void rfs_dedup_stats(Ramfs *fs, RamfsDedupStats *stats);
+int rfs_compress(Ramfs *fs, int idle_ms);
+int rfs_memory_budget(Ramfs *fs, size_t budget, const char *backing_path);
+void rfs_stats(Ramfs *fs, RamfsStats *stats);
+//engine whose batches run on fs, stop it before destroying fs
+RamfsAio *rfs_aio_create(Ramfs *fs, int workers);
@@ -0,0 +1,176 @@
+//
+// Shared file system. Cooperating processes map one checkpoint image, the
+// offset-based form of the whole tree, and rebuild only the namespace from
+// it; file content stays in the mapping, so every process reads the same
+// page cache pages and a file costs its memory once however many processes
+// read it. An image under /dev/shm keeps all of it in memory.
+//
+// Writers take an exclusive lock on a file next to the image, change their
+// own tree and publish it as a new image renamed over the old one. Readers
+// never wait for a writer: the old image stays mapped and readable until
+// a refresh replaces it by the one published since.
+//
+// A refresh swaps the whole tree as rrestore does, it does not merge the
+// published changes into the live one. So the calls here must not run while
+// another thread of the process uses the file system, and a refresh is refused
+// with EBUSY while descriptors, views or rmmap mappings of the old tree are live.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "ramfs.h"
+#include "share.h"
+
+void share_init(Share *share) {
+    share->path = NULL;
+    share->lock_fd = -1;
+    share->writing = 0;
+    share->mapped_dev = 0;
+    share->mapped_ino = 0;
+    pthread_mutex_init(&share->lock, NULL);
+}
+
+//forget the joined image, caller holds share->lock
+static void leave(Share *share) {
+    if (share->lock_fd != -1) {
+        close(share->lock_fd);
+    }
+    share->lock_fd = -1;
+    free(share->path);
+    share->path = NULL;
+    share->writing = 0;
+    share->mapped_dev = 0;
+    share->mapped_ino = 0;
+}
+
+void share_destroy(Share *share) {
+    //an uncommitted change is dropped with the tree, closing the lock file releases the writer lock
+    leave(share);
+    pthread_mutex_destroy(&share->lock);
+}
+
+//restore the image at share->path into fs unless it is the one the tree came from;
+//1 if restored, 0 if already current, -1 on error
+static int refresh(Share *share, Ramfs *fs) {
+    //the open descriptor keeps the inode alive, so its number is not reused while it is compared
+    int fd = open(share->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat before, after;
+    int result = fstat(fd, &before) == -1 ? -1 : 0;
+    if (result == 0 && (before.st_dev != share->mapped_dev || before.st_ino != share->mapped_ino)) {
+        result = rfs_restore(fs, share->path) == -1 ? -1 : 1;
+    }
+    if (result == 1) {
+        //an image published in between may be the one mapped, then the next refresh restores it again
+        if (stat(share->path, &after) == 0 && after.st_dev == before.st_dev && after.st_ino == before.st_ino) {
+            share->mapped_dev = before.st_dev;
+            share->mapped_ino = before.st_ino;
+        } else {
+            share->mapped_dev = 0;
+            share->mapped_ino = 0;
+        }
+    }
+    close(fd);
+    return result;
+}
+
+int share_join(Share *share, Ramfs *fs, const char *image_path) {
+    pthread_mutex_lock(&share->lock);
+    //a descriptor inherited through fork shares its lock with the parent, so every join opens its own
+    leave(share);
+    if (image_path == NULL) {
+        pthread_mutex_unlock(&share->lock);
+        return 0;
+    }
+    share->path = strdup(image_path);
+    char *lock_path = share->path != NULL ? (char *) malloc(strlen(image_path) + sizeof(".lock")) : NULL;
+    if (lock_path != NULL) {
+        sprintf(lock_path, "%s.lock", image_path);
+        share->lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        free(lock_path);
+    }
+    int result = share->lock_fd == -1 || flock(share->lock_fd, LOCK_EX) == -1 ? -1 : 0;
+    if (result == 0) {
+        //the first process to join publishes its tree as the shared one
+        struct stat st;
+        if (stat(share->path, &st) == -1) {
+            result = errno == ENOENT ? rfs_checkpoint(fs, share->path) : -1;
+        }
+        if (result == 0 && refresh(share, fs) == -1) {
+            result = -1;
+        }
+        flock(share->lock_fd, LOCK_UN);
+    }
+    if (result == -1) {
+        leave(share);
+    }
+    pthread_mutex_unlock(&share->lock);
+    return result;
+}
+
+int share_refresh(Share *share, Ramfs *fs) {
+    pthread_mutex_lock(&share->lock);
+    int result = -1;
+    if (share->path != NULL) {
+        //the writer's own changes would be dropped, they are published by share_commit
+        result = share->writing ? 0 : refresh(share, fs);
+    }
+    pthread_mutex_unlock(&share->lock);
+    return result;
+}
+
+int share_begin(Share *share, Ramfs *fs) {
+    pthread_mutex_lock(&share->lock);
+    int result = -1;
+    if (share->path != NULL && !share->writing && flock(share->lock_fd, LOCK_EX) == 0) {
+        //changes start from the newest published tree
+        if (refresh(share, fs) == -1) {
+            flock(share->lock_fd, LOCK_UN);
+        } else {
+            share->writing = 1;
+            result = 0;
+        }
+    }
+    pthread_mutex_unlock(&share->lock);
+    return result;
+}
+
+int share_commit(Share *share, Ramfs *fs) {
+    pthread_mutex_lock(&share->lock);
+    int result = -1;
+    if (share->writing) {
+        result = rfs_checkpoint(fs, share->path);
+        //the published content moves out of private memory back into the shared mapping; while
+        //descriptors are open the tree stays private, it is equal to the image until the next refresh
+        if (result == 0 && refresh(share, fs) == -1 && errno != EBUSY) {
+            result = -1;
+        }
+        share->writing = 0;
+        flock(share->lock_fd, LOCK_UN);
+    }
+    pthread_mutex_unlock(&share->lock);
+    return result;
+}
+
+int share_abort(Share *share, Ramfs *fs) {
+    pthread_mutex_lock(&share->lock);
+    int result = -1;
+    if (share->writing) {
+        //restoring the image again drops every change since share_begin
+        share->mapped_dev = 0;
+        share->mapped_ino = 0;
+        result = refresh(share, fs) == -1 ? -1 : 0;
+        share->writing = 0;
+        flock(share->lock_fd, LOCK_UN);
+    }
+    pthread_mutex_unlock(&share->lock);
+    return result;
+}
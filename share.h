@@ -0,0 +1,36 @@
+//
+// Sharing one file system between processes through a checkpoint image, behind ramfs_share.
+//
+#ifndef SHARE_H
+#define SHARE_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+struct ramfs;
+
+//sharing state of one file system instance
+typedef struct share {
+    char *path; //image joined by rfs_share, NULL before
+    //lock file next to the image, held exclusively from rfs_share_begin to rfs_share_commit or rfs_share_abort
+    int lock_fd;
+    int writing;
+    //image the tree was restored from; a published image is a new file, so another inode means a newer tree
+    dev_t mapped_dev;
+    ino_t mapped_ino;
+    pthread_mutex_t lock; //guards the state above, the calls themselves are serialized
+} Share;
+
+void share_init(Share *share);
+
+//stop sharing and free the state
+void share_destroy(Share *share);
+
+//the calls of rfs_share, rfs_share_refresh, rfs_share_begin, rfs_share_commit and rfs_share_abort on fs
+int share_join(Share *share, struct ramfs *fs, const char *image_path);
+int share_refresh(Share *share, struct ramfs *fs);
+int share_begin(Share *share, struct ramfs *fs);
+int share_commit(Share *share, struct ramfs *fs);
+int share_abort(Share *share, struct ramfs *fs);
+
+#endif //SHARE_H
@@ -0,0 +1,208 @@
+//
+// Size class slab allocator. Every filesystem object comes from one arena,
+// so dropping a whole filesystem is a single arena_reset.
+//
+#include <stdlib.h>
+#include <string.h>
+#include "slab.h"
+
+static const size_t class_size[SLAB_CLASS_COUNT] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024};
+
+//header at the start of every slab
+typedef struct slab {
+    struct slab *next; //next slab in the partial or full list
+    struct slab *prev; //previous slab in the partial or full list
+    void *free; //free objects of this slab
+    char *unused; //objects past this point were never handed out
+    char *end; //end of the last object
+    size_t in_use; //objects handed out
+    int index; //size class
+} Slab;
+
+//header in front of a large allocation
+typedef struct large_alloc {
+    struct large_alloc *next;
+    struct large_alloc *prev;
+    size_t size; //bytes requested
+} LargeAlloc;
+
+#define SLAB_HEADER ((sizeof(Slab) + 15) & ~(size_t) 15)
+#define LARGE_HEADER ((sizeof(LargeAlloc) + 15) & ~(size_t) 15)
+
+//size class serving size bytes
+static int class_index(size_t size) {
+    int index = 0;
+    while (class_size[index] < size) {
+        index++;
+    }
+    return index;
+}
+
+static void slab_unlink(Slab **list, Slab *slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+static void slab_push(Slab **list, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static Slab *slab_create(SlabClass *cls, int index) {
+    void *mem = NULL;
+    if (posix_memalign(&mem, SLAB_SIZE, SLAB_SIZE) != 0) {
+        return NULL;
+    }
+    Slab *slab = (Slab *) mem;
+    size_t objects = (SLAB_SIZE - SLAB_HEADER) / class_size[index];
+    slab->free = NULL;
+    slab->unused = (char *) mem + SLAB_HEADER;
+    slab->end = slab->unused + objects * class_size[index];
+    slab->in_use = 0;
+    slab->index = index;
+    slab_push(&cls->partial, slab);
+    cls->slabs++;
+    cls->capacity += objects;
+    return slab;
+}
+
+static void slab_destroy(SlabClass *cls, Slab *slab) {
+    cls->slabs--;
+    cls->capacity -= (size_t) (slab->end - ((char *) slab + SLAB_HEADER)) / class_size[slab->index];
+    free(slab);
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    if (size > SLAB_MAX_OBJECT) {
+        LargeAlloc *large = (LargeAlloc *) malloc(LARGE_HEADER + size);
+        if (large == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&arena->large_lock);
+        large->size = size;
+        large->prev = NULL;
+        large->next = arena->large;
+        if (arena->large != NULL) {
+            arena->large->prev = large;
+        }
+        arena->large = large;
+        arena->large_count++;
+        arena->large_bytes += size;
+        pthread_mutex_unlock(&arena->large_lock);
+        return (char *) large + LARGE_HEADER;
+    }
+    int index = class_index(size);
+    SlabClass *cls = &arena->classes[index];
+    pthread_mutex_lock(&cls->lock);
+    Slab *slab = cls->partial;
+    if (slab == NULL && (slab = slab_create(cls, index)) == NULL) {
+        pthread_mutex_unlock(&cls->lock);
+        return NULL;
+    }
+    void *object;
+    if (slab->free != NULL) {
+        object = slab->free;
+        slab->free = *(void **) object;
+    } else {
+        object = slab->unused;
+        slab->unused += class_size[index];
+    }
+    slab->in_use++;
+    cls->in_use++;
+    //a slab with no free object moves to the full list
+    if (slab->free == NULL && slab->unused == slab->end) {
+        slab_unlink(&cls->partial, slab);
+        slab_push(&cls->full, slab);
+    }
+    pthread_mutex_unlock(&cls->lock);
+    return object;
+}
+
+void *arena_calloc(Arena *arena, size_t size) {
+    void *ptr = arena_alloc(arena, size);
+    if (ptr != NULL) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+void arena_free(Arena *arena, void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (size > SLAB_MAX_OBJECT) {
+        LargeAlloc *large = (LargeAlloc *) ((char *) ptr - LARGE_HEADER);
+        pthread_mutex_lock(&arena->large_lock);
+        if (large->prev != NULL) {
+            large->prev->next = large->next;
+        } else {
+            arena->large = large->next;
+        }
+        if (large->next != NULL) {
+            large->next->prev = large->prev;
+        }
+        arena->large_count--;
+        arena->large_bytes -= large->size;
+        pthread_mutex_unlock(&arena->large_lock);
+        free(large);
+        return;
+    }
+    Slab *slab = (Slab *) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_SIZE - 1));
+    SlabClass *cls = &arena->classes[slab->index];
+    pthread_mutex_lock(&cls->lock);
+    int was_full = slab->free == NULL && slab->unused == slab->end;
+    *(void **) ptr = slab->free;
+    slab->free = ptr;
+    slab->in_use--;
+    cls->in_use--;
+    if (was_full) {
+        slab_unlink(&cls->full, slab);
+        slab_push(&cls->partial, slab);
+    }
+    //give an empty slab back unless it is the only one left for the class
+    if (slab->in_use == 0 && (slab->prev != NULL || slab->next != NULL)) {
+        slab_unlink(&cls->partial, slab);
+        slab_destroy(cls, slab);
+    }
+    pthread_mutex_unlock(&cls->lock);
+}
+
+void arena_reset(Arena *arena) {
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        SlabClass *cls = &arena->classes[i];
+        Slab *lists[2] = {cls->partial, cls->full};
+        for (int j = 0; j < 2; j++) {
+            Slab *slab = lists[j];
+            while (slab != NULL) {
+                Slab *next = slab->next;
+                free(slab);
+                slab = next;
+            }
+        }
+    }
+    LargeAlloc *large = arena->large;
+    while (large != NULL) {
+        LargeAlloc *next = large->next;
+        free(large);
+        large = next;
+    }
+    memset(arena, 0, sizeof(Arena));
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        pthread_mutex_init(&arena->classes[i].lock, NULL);
+    }
+    pthread_mutex_init(&arena->large_lock, NULL);
+}
+
+size_t arena_class_size(int index) {
+    return class_size[index];
+}
@@ -0,0 +1,55 @@
+//
+// Size class slab allocator. Every filesystem object comes from one arena,
+// so dropping a whole filesystem is a single arena_reset.
+//
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+//bytes per slab, slabs are aligned to their size so an object finds its slab by masking
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_CLASS_COUNT 12
+//largest object served from slabs, bigger ones are tracked as large allocations
+#define SLAB_MAX_OBJECT 1024
+
+struct slab;
+struct large_alloc;
+
+//slabs of one object size
+typedef struct slab_class {
+    struct slab *partial; //slabs with free objects
+    struct slab *full; //slabs without free objects
+    size_t slabs; //slabs held
+    size_t capacity; //objects the slabs can hold
+    size_t in_use; //objects handed out
+    pthread_mutex_t lock; //guards the slabs and counters of the class
+} SlabClass;
+
+typedef struct arena {
+    SlabClass classes[SLAB_CLASS_COUNT];
+    pthread_mutex_t large_lock; //guards the large allocation list
+    struct large_alloc *large; //allocations above SLAB_MAX_OBJECT
+    size_t large_count; //large allocations held
+    size_t large_bytes; //bytes held by large allocations
+} Arena;
+
+//allocate size bytes, NULL if out of memory
+void *arena_alloc(Arena *arena, size_t size);
+
+//allocate zeroed memory
+void *arena_calloc(Arena *arena, size_t size);
+
+//free memory from arena_alloc, size must be the size it was allocated with
+void arena_free(Arena *arena, void *ptr, size_t size);
+
+//release everything allocated from the arena at once, also prepares a zeroed arena for use;
+//no other thread may use the arena meanwhile
+void arena_reset(Arena *arena);
+
+//object size of a slab class
+size_t arena_class_size(int index);
+
+#endif //SLAB_H
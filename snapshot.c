@@ -0,0 +1,112 @@
+//
+// Snapshot generations. Every change to the tree runs inside a change section
+// and is stamped with the current generation; taking a snapshot closes the
+// generation, so snapshot n sees exactly the changes stamped n or lower.
+//
+// Changes hold the gate shared, so they run in parallel; snap_take and
+// snap_release hold it exclusive for a moment, which is also what makes a
+// snapshot a consistent point in time.
+//
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include "snapshot.h"
+
+void snap_init(Snapshots *snaps) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    //a steady stream of writes must not starve snapshots
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&snaps->gate, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    snaps->generation = 1;
+    snaps->ids = NULL;
+    snaps->count = 0;
+    snaps->capacity = 0;
+}
+
+void snap_destroy(Snapshots *snaps) {
+    snap_reset(snaps);
+    pthread_rwlock_destroy(&snaps->gate);
+}
+
+//index of the first live snapshot not below id
+static size_t snap_search(const Snapshots *snaps, uint64_t id) {
+    size_t low = 0, high = snaps->count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (snaps->ids[mid] < id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+uint64_t snap_change_begin(Snapshots *snaps) {
+    pthread_rwlock_rdlock(&snaps->gate);
+    return snaps->generation;
+}
+
+void snap_change_end(Snapshots *snaps) {
+    pthread_rwlock_unlock(&snaps->gate);
+}
+
+int snap_needed(const Snapshots *snaps, uint64_t from, uint64_t until) {
+    size_t i = snap_search(snaps, from);
+    return i < snaps->count && snaps->ids[i] < until;
+}
+
+int snap_take(Snapshots *snaps, void (*mark)(void *ctx), void *ctx) {
+    pthread_rwlock_wrlock(&snaps->gate);
+    int id = -1;
+    if (snaps->generation < INT_MAX) {
+        if (snaps->count == snaps->capacity) {
+            size_t capacity = snaps->capacity == 0 ? 8 : snaps->capacity * 2;
+            uint64_t *grown = (uint64_t *) realloc(snaps->ids, capacity * sizeof(uint64_t));
+            if (grown != NULL) {
+                snaps->ids = grown;
+                snaps->capacity = capacity;
+            }
+        }
+        if (snaps->count < snaps->capacity) {
+            if (mark != NULL) {
+                mark(ctx);
+            }
+            id = (int) snaps->generation;
+            snaps->ids[snaps->count++] = snaps->generation++;
+        }
+    }
+    pthread_rwlock_unlock(&snaps->gate);
+    return id;
+}
+
+int snap_release(Snapshots *snaps, int id, void (*sweep)(void *ctx), void *ctx) {
+    pthread_rwlock_wrlock(&snaps->gate);
+    size_t i = snap_search(snaps, (uint64_t) id);
+    if (id <= 0 || i == snaps->count || snaps->ids[i] != (uint64_t) id) {
+        pthread_rwlock_unlock(&snaps->gate);
+        return -1;
+    }
+    snaps->count--;
+    for (; i < snaps->count; i++) {
+        snaps->ids[i] = snaps->ids[i + 1];
+    }
+    sweep(ctx);
+    pthread_rwlock_unlock(&snaps->gate);
+    return 0;
+}
+
+int snap_live(const Snapshots *snaps, int id) {
+    size_t i = snap_search(snaps, (uint64_t) id);
+    return id > 0 && i < snaps->count && snaps->ids[i] == (uint64_t) id;
+}
+
+void snap_reset(Snapshots *snaps) {
+    free(snaps->ids);
+    snaps->ids = NULL;
+    snaps->count = 0;
+    snaps->capacity = 0;
+    snaps->generation = 1;
+}
@@ -0,0 +1,49 @@
+//
+// Snapshot generations stamped on every change to the tree.
+//
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+//generation of files and contents that were never removed or replaced
+#define SNAP_LIVE UINT64_MAX
+
+//generations and live snapshots of one file system
+typedef struct snapshots {
+    pthread_rwlock_t gate; //held shared by changes, exclusive by snap_take and snap_release
+    uint64_t generation; //generation stamped on changes now
+    uint64_t *ids; //ids of live snapshots, ascending
+    size_t count;
+    size_t capacity;
+} Snapshots;
+
+void snap_init(Snapshots *snaps);
+
+void snap_destroy(Snapshots *snaps);
+
+//start a change, return the generation to stamp it with; snapshots wait for the change to end
+uint64_t snap_change_begin(Snapshots *snaps);
+
+void snap_change_end(Snapshots *snaps);
+
+//1 if a live snapshot sees state that was current from generation from until generation until,
+//call inside a change section
+int snap_needed(const Snapshots *snaps, uint64_t from, uint64_t until);
+
+//close the current generation and return it as the id of a new snapshot, -1 if ids ran out;
+//mark, unless NULL, runs with ctx while no change is in progress right before the generation closes
+int snap_take(Snapshots *snaps, void (*mark)(void *ctx), void *ctx);
+
+//drop a snapshot and run sweep with ctx while no change is in progress, -1 if id is not a live snapshot
+int snap_release(Snapshots *snaps, int id, void (*sweep)(void *ctx), void *ctx);
+
+//1 if id is a live snapshot, call inside a change section
+int snap_live(const Snapshots *snaps, int id);
+
+//drop every snapshot, only call while no other thread uses the file system
+void snap_reset(Snapshots *snaps);
+
+#endif //SNAPSHOT_H
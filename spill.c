@@ -0,0 +1,165 @@
+//
+// Spilled blocks. A spilled block is a header whose content lives in one
+// BLOCK_SIZE page of the backing file; its data pointer is NULL and page
+// names the page. Like a block in a checkpoint image it is copied before it
+// is written, so the page of a live block never changes.
+//
+// Freed pages are reused before the file grows, so the file stays as large as
+// the most content ever paged out at once.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "spill.h"
+#include "stats.h"
+
+//page for a new spilled block
+static uint32_t page_take(Spill *spill) {
+    pthread_mutex_lock(&spill->lock);
+    uint32_t page = spill->free_count > 0 ? spill->free_pages[--spill->free_count] : spill->next_page++;
+    pthread_mutex_unlock(&spill->lock);
+    return page;
+}
+
+static void page_give(Spill *spill, uint32_t page) {
+    pthread_mutex_lock(&spill->lock);
+    if (spill->free_count == spill->free_capacity) {
+        size_t capacity = spill->free_capacity == 0 ? 64 : spill->free_capacity * 2;
+        uint32_t *grown = (uint32_t *) realloc(spill->free_pages, capacity * sizeof(uint32_t));
+        if (grown == NULL) {
+            //the page is lost until spill_reset
+            pthread_mutex_unlock(&spill->lock);
+            return;
+        }
+        spill->free_pages = grown;
+        spill->free_capacity = capacity;
+    }
+    spill->free_pages[spill->free_count++] = page;
+    pthread_mutex_unlock(&spill->lock);
+}
+
+void spill_init(Spill *spill) {
+    pthread_mutex_init(&spill->lock, NULL);
+    atomic_init(&spill->fd, -1);
+    spill->path = NULL;
+    spill->free_pages = NULL;
+    spill->free_count = 0;
+    spill->free_capacity = 0;
+    spill->next_page = 0;
+}
+
+void spill_destroy(Spill *spill) {
+    int fd = atomic_exchange(&spill->fd, -1);
+    if (fd != -1) {
+        close(fd);
+    }
+    free(spill->path);
+    spill->path = NULL;
+    free(spill->free_pages);
+    spill->free_pages = NULL;
+    pthread_mutex_destroy(&spill->lock);
+}
+
+Block *block_spill(BlockStore *store, const Block *block) {
+    Spill *spill = store->spill;
+    int fd = atomic_load(&spill->fd);
+    if (fd == -1 || block_spilled(block)) {
+        return NULL;
+    }
+    char content[BLOCK_SIZE];
+    const char *data = block->data;
+    if (block->stored != 0) {
+        block_read(store, block, 0, content, block->capacity);
+        data = content;
+    }
+    Block *result = (Block *) arena_alloc(store->arena, sizeof(Block));
+    if (result == NULL) {
+        return NULL;
+    }
+    uint32_t page = page_take(spill);
+    off_t offset = (off_t) page << BLOCK_SHIFT;
+    size_t done = 0;
+    while (done < block->capacity) {
+        ssize_t n = pwrite(fd, data + done, block->capacity - done, offset + (off_t) done);
+        if (n <= 0 && errno != EINTR) {
+            page_give(spill, page);
+            arena_free(store->arena, result, sizeof(Block));
+            return NULL;
+        }
+        done += n > 0 ? (size_t) n : 0;
+    }
+    result->capacity = block->capacity;
+    atomic_init(&result->refs, 1);
+    atomic_init(&result->indexed, 0);
+    result->data = NULL;
+    result->stored = 0;
+    result->page = page;
+    stats_gauge(store->stats, STATS_SPILLED_BYTES, (int64_t) block->capacity);
+    stats_tier(store->stats, STATS_TIER_SPILLS, 1);
+    return result;
+}
+
+int spill_read(Spill *spill, const Block *block, size_t start, void *buf, size_t count) {
+    int fd = atomic_load(&spill->fd);
+    off_t offset = ((off_t) block->page << BLOCK_SHIFT) + (off_t) start;
+    size_t done = 0;
+    while (done < count) {
+        ssize_t n = pread(fd, (char *) buf + done, count - done, offset + (off_t) done);
+        if (n == 0 || (n < 0 && errno != EINTR)) {
+            return -1;
+        }
+        done += n > 0 ? (size_t) n : 0;
+    }
+    return 0;
+}
+
+void spill_forget(BlockStore *store, const Block *block) {
+    stats_gauge(store->stats, STATS_SPILLED_BYTES, -(int64_t) block->capacity);
+    page_give(store->spill, block->page);
+}
+
+int spill_enabled(Spill *spill) {
+    return atomic_load(&spill->fd) != -1;
+}
+
+int spill_open(Spill *spill, const char *path) {
+    pthread_mutex_lock(&spill->lock);
+    int result = 0;
+    if (spill->path == NULL || strcmp(spill->path, path) != 0) {
+        char *copy = strdup(path);
+        int fd = -1;
+        if (spill->next_page == spill->free_count && copy != NULL) {
+            fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        }
+        if (fd == -1) {
+            free(copy);
+            result = -1;
+        } else {
+            int old = atomic_exchange(&spill->fd, fd);
+            if (old != -1) {
+                close(old);
+            }
+            free(spill->path);
+            spill->path = copy;
+            spill->free_count = 0;
+            spill->next_page = 0;
+        }
+    }
+    pthread_mutex_unlock(&spill->lock);
+    return result;
+}
+
+void spill_reset(Spill *spill) {
+    pthread_mutex_lock(&spill->lock);
+    spill->free_count = 0;
+    spill->next_page = 0;
+    int fd = atomic_load(&spill->fd);
+    if (fd != -1 && ftruncate(fd, 0) == -1) {
+        //the stale pages are overwritten before they are read again
+    }
+    pthread_mutex_unlock(&spill->lock);
+}
@@ -0,0 +1,51 @@
+//
+// Backing file that holds file content paged out of memory under ramfs_memory_budget.
+//
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "blockmap.h"
+
+//budget checks of the tier thread while a memory budget is set
+#define SPILL_INTERVAL_MS 10
+
+//backing file of one file system instance
+typedef struct spill {
+    pthread_mutex_t lock;
+    atomic_int fd; //backing file, -1 if none; only replaced while no page is in use
+    char *path;
+    uint32_t *free_pages; //pages freed for reuse
+    size_t free_count;
+    size_t free_capacity;
+    uint32_t next_page; //pages handed out so far, the file ends here
+} Spill;
+
+void spill_init(Spill *spill);
+
+//close the backing file and free the page list
+void spill_destroy(Spill *spill);
+
+//write the content of a block to the backing file and return a header pointing there with one
+//reference, NULL if no backing file is open, the write failed or out of memory
+Block *block_spill(BlockStore *store, const Block *block);
+
+//copy count bytes at start of a spilled block's content to buf, -1 if the backing file fails
+int spill_read(Spill *spill, const Block *block, size_t start, void *buf, size_t count);
+
+//give the page of a spilled block back before the block is freed
+void spill_forget(BlockStore *store, const Block *block);
+
+//1 once a backing file is open
+int spill_enabled(Spill *spill);
+
+//page out to path from now on, -1 if it can not be created or pages of the current file are in use;
+//no block_spill may run meanwhile, it would write to the old file
+int spill_open(Spill *spill, const char *path);
+
+//free every page, only call while no other thread uses the file system
+void spill_reset(Spill *spill);
+
+#endif //SPILL_H
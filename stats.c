@@ -0,0 +1,289 @@
+//
+// Operation counters and latency histograms. Every thread counts into its own
+// shard of each instance it uses, so counting is a plain load and store on a
+// cache line no other thread writes; ramfs_stats sums the shards. A shard is
+// folded into the retired totals of its instance when its thread exits.
+//
+// Reading the clock twice costs more than the rest of a small read, so only
+// one call in RAMFS_STATS_SAMPLE is timed; calls and errors are exact.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "ramfs.h"
+#include "stats.h"
+
+typedef struct op_counters {
+    atomic_ullong calls;
+    atomic_ullong errors;
+    atomic_ullong timed;
+    atomic_ullong total_ns;
+    atomic_ullong histogram[RAMFS_HIST_BUCKETS];
+} OpCounters;
+
+typedef struct shard {
+    OpCounters ops[RAMFS_OP_COUNT];
+    atomic_ullong bytes[2]; //read, written
+    atomic_llong gauges[STATS_GAUGE_COUNT];
+    atomic_ullong tier[STATS_TIER_COUNT];
+    unsigned tick; //calls started, picks the sampled ones
+    Stats *owner; //instance counted into
+    struct shard *next; //next shard of a live thread
+    struct shard *prev;
+} Shard;
+
+//only the owning thread writes a shard, so no atomic read-modify-write is needed
+static void bump(atomic_ullong *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static void bump_gauge(atomic_llong *gauge, int64_t n) {
+    atomic_store_explicit(gauge, atomic_load_explicit(gauge, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+//add the counters of src to dst, caller holds the stats lock
+static void fold(Shard *dst, Shard *src) {
+    for (int i = 0; i < RAMFS_OP_COUNT; i++) {
+        bump(&dst->ops[i].calls, atomic_load_explicit(&src->ops[i].calls, memory_order_relaxed));
+        bump(&dst->ops[i].errors, atomic_load_explicit(&src->ops[i].errors, memory_order_relaxed));
+        bump(&dst->ops[i].timed, atomic_load_explicit(&src->ops[i].timed, memory_order_relaxed));
+        bump(&dst->ops[i].total_ns, atomic_load_explicit(&src->ops[i].total_ns, memory_order_relaxed));
+        for (int j = 0; j < RAMFS_HIST_BUCKETS; j++) {
+            bump(&dst->ops[i].histogram[j], atomic_load_explicit(&src->ops[i].histogram[j], memory_order_relaxed));
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        bump(&dst->bytes[i], atomic_load_explicit(&src->bytes[i], memory_order_relaxed));
+    }
+    for (int i = 0; i < STATS_GAUGE_COUNT; i++) {
+        bump_gauge(&dst->gauges[i], atomic_load_explicit(&src->gauges[i], memory_order_relaxed));
+    }
+    for (int i = 0; i < STATS_TIER_COUNT; i++) {
+        bump(&dst->tier[i], atomic_load_explicit(&src->tier[i], memory_order_relaxed));
+    }
+}
+
+//thread exit: keep the counts, drop the shard
+static void shard_exit(void *ptr) {
+    Shard *shard = (Shard *) ptr;
+    Stats *stats = shard->owner;
+    pthread_mutex_lock(&stats->lock);
+    fold(stats->retired, shard);
+    if (shard->prev != NULL) {
+        shard->prev->next = shard->next;
+    } else {
+        stats->shards = shard->next;
+    }
+    if (shard->next != NULL) {
+        shard->next->prev = shard->prev;
+    }
+    pthread_mutex_unlock(&stats->lock);
+    free(shard);
+}
+
+int stats_init(Stats *stats) {
+    stats->shards = NULL;
+    stats->retired = (Shard *) calloc(1, sizeof(Shard));
+    if (stats->retired == NULL) {
+        return -1;
+    }
+    if (pthread_key_create(&stats->key, shard_exit) != 0) {
+        free(stats->retired);
+        stats->retired = NULL;
+        return -1;
+    }
+    pthread_mutex_init(&stats->lock, NULL);
+    return 0;
+}
+
+void stats_destroy(Stats *stats) {
+    //deleting the key runs no destructor, the shards of live threads are freed here
+    pthread_key_delete(stats->key);
+    while (stats->shards != NULL) {
+        Shard *next = stats->shards->next;
+        free(stats->shards);
+        stats->shards = next;
+    }
+    free(stats->retired);
+    stats->retired = NULL;
+    pthread_mutex_destroy(&stats->lock);
+}
+
+//shard of the calling thread, NULL if out of memory
+static Shard *shard_get(Stats *stats) {
+    Shard *shard = (Shard *) pthread_getspecific(stats->key);
+    if (shard != NULL) {
+        return shard;
+    }
+    shard = (Shard *) calloc(1, sizeof(Shard));
+    if (shard == NULL) {
+        return NULL;
+    }
+    shard->owner = stats;
+    pthread_mutex_lock(&stats->lock);
+    shard->next = stats->shards;
+    if (stats->shards != NULL) {
+        stats->shards->prev = shard;
+    }
+    stats->shards = shard;
+    pthread_mutex_unlock(&stats->lock);
+    pthread_setspecific(stats->key, shard);
+    return shard;
+}
+
+//histogram bucket of a latency
+static int bucket(uint64_t ns) {
+    if (ns < (1 << RAMFS_HIST_SUB_BITS)) {
+        return (int) ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    int index = (exponent - RAMFS_HIST_SUB_BITS + 1) << RAMFS_HIST_SUB_BITS |
+                (int) ((ns >> (exponent - RAMFS_HIST_SUB_BITS)) & ((1 << RAMFS_HIST_SUB_BITS) - 1));
+    return index < RAMFS_HIST_BUCKETS ? index : RAMFS_HIST_BUCKETS - 1;
+}
+
+//smallest latency of a bucket
+static uint64_t bucket_low(int index) {
+    if (index < (1 << RAMFS_HIST_SUB_BITS)) {
+        return (uint64_t) index;
+    }
+    int exponent = (index >> RAMFS_HIST_SUB_BITS) + RAMFS_HIST_SUB_BITS - 1;
+    uint64_t sub = (uint64_t) (index & ((1 << RAMFS_HIST_SUB_BITS) - 1));
+    return ((1ULL << RAMFS_HIST_SUB_BITS) | sub) << (exponent - RAMFS_HIST_SUB_BITS);
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+uint64_t stats_start(Stats *stats) {
+    Shard *shard = shard_get(stats);
+    if (shard == NULL || shard->tick++ % RAMFS_STATS_SAMPLE != 0) {
+        return 0;
+    }
+    return now_ns();
+}
+
+void stats_op(Stats *stats, int op, uint64_t start, int failed) {
+    Shard *shard = shard_get(stats);
+    if (shard == NULL) {
+        return;
+    }
+    OpCounters *counters = &shard->ops[op];
+    bump(&counters->calls, 1);
+    if (failed) {
+        bump(&counters->errors, 1);
+    }
+    if (start != 0) {
+        uint64_t ns = now_ns() - start;
+        bump(&counters->timed, 1);
+        bump(&counters->total_ns, ns);
+        bump(&counters->histogram[bucket(ns)], 1);
+    }
+}
+
+void stats_bytes(Stats *stats, int write, size_t count) {
+    Shard *shard = shard_get(stats);
+    if (shard != NULL) {
+        bump(&shard->bytes[write ? 1 : 0], count);
+    }
+}
+
+void stats_gauge(Stats *stats, int gauge, int64_t delta) {
+    Shard *shard = shard_get(stats);
+    if (shard != NULL) {
+        bump_gauge(&shard->gauges[gauge], delta);
+    }
+}
+
+void stats_tier(Stats *stats, int counter, uint64_t n) {
+    Shard *shard = shard_get(stats);
+    if (shard != NULL) {
+        bump(&shard->tier[counter], n);
+    }
+}
+
+int64_t stats_gauge_sum(Stats *stats, int gauge) {
+    pthread_mutex_lock(&stats->lock);
+    int64_t sum = atomic_load_explicit(&stats->retired->gauges[gauge], memory_order_relaxed);
+    for (Shard *shard = stats->shards; shard != NULL; shard = shard->next) {
+        sum += atomic_load_explicit(&shard->gauges[gauge], memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&stats->lock);
+    return sum;
+}
+
+void stats_collect(Stats *stats, RamfsStats *result) {
+    Shard *sum = (Shard *) calloc(1, sizeof(Shard));
+    if (sum == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&stats->lock);
+    fold(sum, stats->retired);
+    for (Shard *shard = stats->shards; shard != NULL; shard = shard->next) {
+        fold(sum, shard);
+    }
+    pthread_mutex_unlock(&stats->lock);
+    for (int i = 0; i < RAMFS_OP_COUNT; i++) {
+        result->ops[i].calls = atomic_load_explicit(&sum->ops[i].calls, memory_order_relaxed);
+        result->ops[i].errors = atomic_load_explicit(&sum->ops[i].errors, memory_order_relaxed);
+        result->ops[i].timed = atomic_load_explicit(&sum->ops[i].timed, memory_order_relaxed);
+        result->ops[i].total_ns = atomic_load_explicit(&sum->ops[i].total_ns, memory_order_relaxed);
+        for (int j = 0; j < RAMFS_HIST_BUCKETS; j++) {
+            result->ops[i].histogram[j] = atomic_load_explicit(&sum->ops[i].histogram[j], memory_order_relaxed);
+        }
+    }
+    result->bytes_read = atomic_load_explicit(&sum->bytes[0], memory_order_relaxed);
+    result->bytes_written = atomic_load_explicit(&sum->bytes[1], memory_order_relaxed);
+    result->files = atomic_load_explicit(&sum->gauges[STATS_FILES], memory_order_relaxed);
+    result->directories = atomic_load_explicit(&sum->gauges[STATS_DIRECTORIES], memory_order_relaxed);
+    result->open_fds = atomic_load_explicit(&sum->gauges[STATS_OPEN_FDS], memory_order_relaxed);
+    result->block_bytes = atomic_load_explicit(&sum->gauges[STATS_BLOCK_BYTES], memory_order_relaxed);
+    result->compressed_bytes = atomic_load_explicit(&sum->gauges[STATS_COMPRESSED_BYTES], memory_order_relaxed);
+    result->compressed_raw_bytes = atomic_load_explicit(&sum->gauges[STATS_COMPRESSED_RAW_BYTES], memory_order_relaxed);
+    result->spilled_bytes = atomic_load_explicit(&sum->gauges[STATS_SPILLED_BYTES], memory_order_relaxed);
+    result->tier_hits = atomic_load_explicit(&sum->tier[STATS_TIER_HITS], memory_order_relaxed);
+    result->tier_faults = atomic_load_explicit(&sum->tier[STATS_TIER_FAULTS], memory_order_relaxed);
+    result->spills = atomic_load_explicit(&sum->tier[STATS_TIER_SPILLS], memory_order_relaxed);
+    free(sum);
+}
+
+void stats_reset(Stats *stats) {
+    pthread_mutex_lock(&stats->lock);
+    for (Shard *shard = stats->shards; shard != NULL; shard = shard->next) {
+        Shard *next = shard->next, *prev = shard->prev;
+        memset(shard, 0, sizeof(Shard));
+        shard->owner = stats;
+        shard->next = next;
+        shard->prev = prev;
+    }
+    memset(stats->retired, 0, sizeof(Shard));
+    pthread_mutex_unlock(&stats->lock);
+}
+
+uint64_t ramfs_stats_percentile(const RamfsOpStats *op, double q) {
+    uint64_t total = op->timed;
+    if (total == 0) {
+        return 0;
+    }
+    //rank of the call at fraction q, counting from 1
+    uint64_t rank = (uint64_t) (q * (double) total);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > total) {
+        rank = total;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < RAMFS_HIST_BUCKETS - 1; i++) {
+        seen += op->histogram[i];
+        if (seen >= rank) {
+            return bucket_low(i + 1) - 1;
+        }
+    }
+    return UINT64_MAX;
+}
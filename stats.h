@@ -0,0 +1,67 @@
+//
+// Per-thread operation counters and latency histograms behind ramfs_stats.
+//
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+//gauges, kept as per-thread deltas summed on collection
+#define STATS_FILES 0
+#define STATS_DIRECTORIES 1
+#define STATS_OPEN_FDS 2
+#define STATS_BLOCK_BYTES 3
+#define STATS_COMPRESSED_BYTES 4
+#define STATS_COMPRESSED_RAW_BYTES 5
+#define STATS_SPILLED_BYTES 6
+#define STATS_GAUGE_COUNT 7
+
+//counters of the memory budget
+#define STATS_TIER_HITS 0
+#define STATS_TIER_FAULTS 1
+#define STATS_TIER_SPILLS 2
+#define STATS_TIER_COUNT 3
+
+struct ramfs_stats;
+struct shard;
+
+//counters of one file system instance
+typedef struct stats {
+    struct shard *shards; //shards of live threads
+    struct shard *retired; //counters of exited threads
+    pthread_mutex_t lock; //guards the list and retired
+    pthread_key_t key; //shard of the calling thread
+} Stats;
+
+//-1 if out of memory or out of thread keys
+int stats_init(Stats *stats);
+
+//free every shard, only call while no other thread uses the file system
+void stats_destroy(Stats *stats);
+
+//timestamp to pass to stats_op, 0 if this call is not sampled
+uint64_t stats_start(Stats *stats);
+
+//count a finished call of operation op that began at start
+void stats_op(Stats *stats, int op, uint64_t start, int failed);
+
+//count bytes moved by a read or write
+void stats_bytes(Stats *stats, int write, size_t count);
+
+void stats_gauge(Stats *stats, int gauge, int64_t delta);
+
+//count n events of a STATS_TIER_* counter
+void stats_tier(Stats *stats, int counter, uint64_t n);
+
+//current value of a gauge, cheaper than a full collection
+int64_t stats_gauge_sum(Stats *stats, int gauge);
+
+//sum the counters of every thread into result, gauges the caller fills stay untouched
+void stats_collect(Stats *stats, struct ramfs_stats *result);
+
+//zero everything, only call while no other thread uses the file system
+void stats_reset(Stats *stats);
+
+#endif //STATS_H
@@ -0,0 +1,727 @@
+#include "ramfs.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#define assert(cond)                                                           \
+  do {                                                                         \
+    if (cond)                                                                  \
+      ;                                                                        \
+    else {                                                                     \
+      puts("false");                                                           \
+      exit(EXIT_SUCCESS);                                                      \
+    }                                                                          \
+  } while (0)
+
+#define THREADS 8
+#define ROUNDS 2000
+#define SHARED 16
+#define AIO_CHAINS 256
+#define INSTANCES 4
+
+//every thread owns /t<id> and races on the shared files /s<n>
+void *worker(void *arg) {
+    int id = (int) (long) arg;
+    unsigned seed = id;
+    char path[64], buf[256], out[256];
+    sprintf(path, "/t%d", id);
+    assert(rmkdir(path) == 0);
+    for (int i = 0; i < ROUNDS; i++) {
+        //private file, its content must round trip exactly
+        sprintf(path, "/t%d/f%d", id, i % 32);
+        int fd = ropen(path, O_CREAT | O_RDWR | O_TRUNC);
+        assert(fd >= 0);
+        int len = rand_r(&seed) % sizeof(buf) + 1;
+        memset(buf, 'a' + id, len);
+        assert(rwrite(fd, buf, len) == len);
+        assert(rseek(fd, 0, SEEK_SET) == 0);
+        assert(rread(fd, out, sizeof(out)) == len);
+        assert(memcmp(buf, out, len) == 0);
+        assert(rpread(fd, out, len, 0) == len);
+        //cut in place, then reserved back to the old length with zeros past the cut
+        if (i % 4 == 1) {
+            assert(rftruncate(fd, len / 2) == 0);
+            assert(rfallocate(fd, 0, len) == 0);
+            assert(rpread(fd, out, sizeof(out), 0) == len);
+            assert(memcmp(buf, out, len / 2) == 0);
+            for (int j = len / 2; j < len; j++) {
+                assert(out[j] == 0);
+            }
+        }
+        assert(rclose(fd) == 0);
+        assert(rclose(fd) == -1);
+        if (i % 3 == 0) {
+            assert(runlink(path) == 0);
+        }
+        //a snapshot keeps the private file as it was while it is rewritten and unlinked
+        if (i % 64 == 0) {
+            sprintf(path, "/t%d/f%d", id, i % 32);
+            int snap = rsnapshot();
+            assert(snap > 0);
+            int seen = ropen(path, O_RDONLY);
+            ssize_t n = seen >= 0 ? rread(seen, buf, sizeof(buf)) : -1;
+            if (seen >= 0) {
+                assert(rclose(seen) == 0);
+            }
+            fd = ropen(path, O_CREAT | O_WRONLY | O_TRUNC);
+            assert(fd >= 0);
+            assert(rclose(fd) == 0);
+            int frozen = rsnapshot_open(snap, path);
+            assert(rsnapshot_release(snap) == 0);
+            assert((seen >= 0) == (frozen >= 0));
+            if (frozen >= 0) {
+                assert(rread(frozen, out, sizeof(out)) == n);
+                assert(memcmp(buf, out, n) == 0);
+                assert(rclose(frozen) == 0);
+            }
+        }
+        //private directories come and go
+        sprintf(path, "/t%d/d%d", id, i % 8);
+        if (rmkdir(path) == -1) {
+            assert(rrmdir(path) == 0);
+        }
+        //shared files are created, written, unlinked and reopened by everyone
+        sprintf(path, "/s%d", rand_r(&seed) % SHARED);
+        switch (rand_r(&seed) % 4) {
+            case 0:
+                if (i % 2 == 0) {
+                    fd = ropen(path, O_CREAT | O_WRONLY | O_APPEND);
+                    assert(fd >= 0);
+                    assert(rwrite(fd, buf, 16) == 16);
+                    assert(rclose(fd) == 0);
+                } else {
+                    //the same as one linked chain
+                    RamfsSubmission ops[3];
+                    memset(ops, 0, sizeof(ops));
+                    ops[0].op = RAMFS_SUBMIT_OPEN;
+                    ops[0].flags = RAMFS_SUBMIT_LINK;
+                    ops[0].path = path;
+                    ops[0].open_flags = O_CREAT | O_WRONLY | O_APPEND;
+                    ops[1].op = RAMFS_SUBMIT_WRITE;
+                    ops[1].flags = RAMFS_SUBMIT_LINK;
+                    ops[1].fd = RAMFS_FD_LINKED;
+                    ops[1].buf = buf;
+                    ops[1].count = 16;
+                    ops[1].offset = -1;
+                    ops[2].op = RAMFS_SUBMIT_CLOSE;
+                    ops[2].fd = RAMFS_FD_LINKED;
+                    assert(rsubmit(ops, 3) == 3);
+                    assert(ops[1].result == 16);
+                }
+                break;
+            case 1:
+                fd = ropen(path, O_RDONLY);
+                if (fd >= 0) {
+                    assert(rread(fd, out, 16) >= 0);
+                    //the view stays readable while others append and unlink
+                    RamfsView view;
+                    assert(rview(fd, sizeof(out), &view) >= 0);
+                    assert(rclose(fd) == 0);
+                    for (size_t j = 0; j < view.count; j++) {
+                        memcpy(out, view.spans[j].data, view.spans[j].length);
+                    }
+                    rview_release(&view);
+                }
+                break;
+            case 2:
+                //shrinks under readers and appenders
+                fd = ropen(path, O_WRONLY);
+                if (fd >= 0) {
+                    assert(rftruncate(fd, 8) == 0);
+                    assert(rclose(fd) == 0);
+                }
+                break;
+            default:
+                //fails while another thread has it open
+                runlink(path);
+                break;
+        }
+    }
+    return NULL;
+}
+
+//every thread gets a file system of its own and pairs of threads share a second one;
+//paths repeat those of the default tree, which must not see any of them
+static Ramfs *pairs[INSTANCES / 2];
+
+void *instance_worker(void *arg) {
+    int id = (int) (long) arg;
+    Ramfs *shared = pairs[id / 2];
+    Ramfs *own = ramfs_create();
+    assert(own != NULL);
+    char path[64], buf[64], out[64];
+    for (int i = 0; i < ROUNDS / 4; i++) {
+        sprintf(path, "/t0/f%d", i % 16);
+        assert(rfs_mkdir(own, "/t0") == (i == 0 ? 0 : -1));
+        int fd = rfs_open(own, path, O_CREAT | O_RDWR | O_TRUNC);
+        assert(fd >= 0);
+        int len = sprintf(buf, "own %d", i);
+        assert(rfs_write(own, fd, buf, len) == len);
+        assert(rfs_pread(own, fd, out, sizeof(out), 0) == len);
+        assert(memcmp(buf, out, len) == 0);
+        assert(rfs_close(own, fd) == 0);
+        //the shared instance sees the records of both threads
+        fd = rfs_open(shared, "/log", O_CREAT | O_WRONLY);
+        assert(fd >= 0);
+        assert(rfs_pwrite(shared, fd, buf, 8, (off_t) (i * 2 + id % 2) * 8) == 8);
+        assert(rfs_close(shared, fd) == 0);
+        if (i % 32 == 0) {
+            int snap = rfs_snapshot(own);
+            assert(snap > 0);
+            assert(rfs_unlink(own, path) == 0);
+            RamfsStat st;
+            assert(rfs_stat(own, path, &st) == -1);
+            assert(rfs_snapshot_stat(own, snap, path, &st) == 0 && st.size == len);
+            assert(rfs_snapshot_release(own, snap) == 0);
+        }
+    }
+    //files still in the tree and an open descriptor go with the instance
+    assert(rfs_open(own, "/t0/f1", O_RDONLY) >= 0);
+    ramfs_destroy(own);
+    return NULL;
+}
+
+//a cached "not found" is dropped by the create that makes the name, and the name index of one
+//directory keeps finding its live entries after most of its slots turned into tombstones
+static void check_lookups() {
+    char path[64];
+    DcacheStats before, after;
+    ramfs_dcache_stats(&before);
+    for (int i = 0; i < 2; i++) {
+        assert(ropen("/neg/f", O_RDONLY) == -1);
+        assert(ropen("/negf", O_RDONLY) == -1);
+    }
+    ramfs_dcache_stats(&after);
+    assert(after.negative_hits > before.negative_hits);
+    int fd = ropen("/negf", O_CREAT | O_WRONLY);
+    assert(fd >= 0 && rclose(fd) == 0);
+    fd = ropen("/negf", O_RDONLY);
+    assert(fd >= 0 && rclose(fd) == 0);
+    RamfsStat st;
+    for (int round = 0; round < 2; round++) {
+        //the second round finds the name gone with its parent, then made again
+        assert(rstat("/neg/f", &st) == -1);
+        assert(rmkdir("/neg") == 0);
+        assert(rstat("/neg/f", &st) == -1);
+        fd = ropen("/neg/f", O_CREAT | O_WRONLY);
+        assert(fd >= 0 && rclose(fd) == 0);
+        assert(rstat("/neg/f", &st) == 0);
+        assert(runlink("/neg/f") == 0 && rrmdir("/neg") == 0);
+    }
+    assert(runlink("/negf") == 0 && ropen("/negf", O_RDONLY) == -1);
+    assert(rmkdir("/churn") == 0);
+    for (int i = 0; i < 64; i++) {
+        sprintf(path, "/churn/keep%d", i);
+        fd = ropen(path, O_CREAT | O_WRONLY);
+        assert(fd >= 0 && rclose(fd) == 0);
+    }
+    for (int i = 0; i < 20000; i++) {
+        sprintf(path, "/churn/gone%d", i);
+        fd = ropen(path, O_CREAT | O_WRONLY);
+        assert(fd >= 0 && rclose(fd) == 0);
+        assert(runlink(path) == 0);
+        if (i % 1000 == 0) {
+            sprintf(path, "/churn/keep%d", i / 1000);
+            assert(rstat(path, &st) == 0);
+        }
+    }
+    for (int i = 0; i < 64; i++) {
+        sprintf(path, "/churn/keep%d", i);
+        assert(rstat(path, &st) == 0);
+        assert(runlink(path) == 0 && rstat(path, &st) == -1);
+        sprintf(path, "/churn/gone%d", i * 300);
+        assert(rstat(path, &st) == -1);
+    }
+    assert(rrmdir("/churn") == 0);
+}
+
+//mappings are counted per address and refused once undone; each one keeps its content
+//through later writes and goes back to the instance that made it
+static void check_mmap() {
+    static char data[3 * 4096];
+    size_t length;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char) ('a' + i % 26);
+    }
+    int fd = ropen("/map", O_CREAT | O_RDWR);
+    assert(fd >= 0 && rwrite(fd, data, 100) == 100);
+    const char *small = (const char *) rmmap(fd, &length);
+    assert(small != NULL && length == 100 && memcmp(small, data, 100) == 0);
+    assert(rmmap(fd, &length) == small);
+    assert(rmunmap(small + 1) == -1 && rmunmap(data) == -1);
+    assert(rmunmap(small) == 0);
+    assert(rpwrite(fd, "zz", 2, 0) == 2);
+    assert(memcmp(small, data, 100) == 0);
+    assert(rmunmap(small) == 0 && rmunmap(small) == -1);
+    //a file spanning blocks is mapped as one copy
+    assert(rpwrite(fd, data, sizeof(data), 0) == sizeof(data));
+    const char *big = (const char *) rmmap(fd, &length);
+    assert(big != NULL && length == sizeof(data) && memcmp(big, data, sizeof(data)) == 0);
+    assert(rftruncate(fd, 0) == 0 && memcmp(big, data, sizeof(data)) == 0);
+    assert(rmunmap(big) == 0 && rmunmap(big) == -1);
+    assert(rclose(fd) == 0 && runlink("/map") == 0);
+    //a mapping of another instance is unmapped there, the default one does not know it
+    Ramfs *other = ramfs_create();
+    assert(other != NULL);
+    fd = rfs_open(other, "/map", O_CREAT | O_RDWR);
+    assert(fd >= 0 && rfs_write(other, fd, data, 64) == 64);
+    const char *mapped = (const char *) rfs_mmap(other, fd, &length);
+    assert(mapped != NULL && length == 64);
+    assert(rmunmap(mapped) == -1);
+    assert(rfs_munmap(other, mapped) == 0 && rfs_munmap(other, mapped) == -1);
+    //a mapping goes with its instance
+    mapped = (const char *) rfs_mmap(other, fd, &length);
+    assert(mapped != NULL);
+    ramfs_destroy(other);
+    assert(rmunmap(mapped) == -1);
+}
+
+//vectored writes and reads land where one contiguous call would, whatever block boundaries
+//the buffers straddle, and a read is cut short at the end of the file
+static void check_vectored() {
+    static char data[20000], out[20000];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char) (i * 13 + 5);
+    }
+    int fd = ropen("/vec", O_CREAT | O_RDWR);
+    assert(fd >= 0);
+    //starts 6 bytes before the first boundary, an empty buffer in between
+    struct riovec in[4] = {{data, 10}, {data + 10, 0}, {data + 10, 4100}, {data + 4110, 8000}};
+    assert(rseek(fd, 4090, SEEK_SET) == 4090);
+    assert(rwritev(fd, in, 4) == 12110);
+    assert(rseek(fd, 0, SEEK_CUR) == 4090 + 12110);
+    RamfsStat st;
+    assert(rfstat(fd, &st) == 0 && st.size == 4090 + 12110);
+    memset(out, 1, sizeof(out));
+    struct riovec back[3] = {{out, 4096}, {out + 4096, 1}, {out + 4097, 15000}};
+    assert(rseek(fd, 0, SEEK_SET) == 0);
+    assert(rreadv(fd, back, 3) == 4090 + 12110);
+    for (int i = 0; i < 4090; i++) {
+        assert(out[i] == 0);
+    }
+    assert(memcmp(out + 4090, data, 12110) == 0);
+    assert(rreadv(fd, back, 3) == 0);
+    assert(rclose(fd) == 0 && runlink("/vec") == 0);
+}
+
+//a sparse file reports its written blocks as data and the rest, up to the end, as holes
+static void check_sparse() {
+    int fd = ropen("/sparse", O_CREAT | O_RDWR);
+    assert(fd >= 0);
+    //data in the second block and across the fourth and fifth, the end lies in a hole
+    assert(rpwrite(fd, "x", 1, 4096 + 100) == 1);
+    assert(rpwrite(fd, "yy", 2, 5 * 4096 - 1) == 2);
+    assert(rftruncate(fd, 8 * 4096) == 0);
+    assert(rseek(fd, 0, SEEK_DATA) == 4096);
+    assert(rseek(fd, 0, SEEK_HOLE) == 0);
+    assert(rseek(fd, 4096 + 100, SEEK_HOLE) == 2 * 4096);
+    assert(rseek(fd, 2 * 4096, SEEK_DATA) == 4 * 4096);
+    assert(rseek(fd, 4 * 4096 + 5, SEEK_DATA) == 4 * 4096 + 5);
+    assert(rseek(fd, 4 * 4096, SEEK_HOLE) == 6 * 4096);
+    assert(rseek(fd, 6 * 4096, SEEK_DATA) == -1);
+    assert(rseek(fd, 7 * 4096, SEEK_HOLE) == 7 * 4096);
+    //at or past the end there is neither
+    assert(rseek(fd, 8 * 4096, SEEK_HOLE) == -1 && rseek(fd, 8 * 4096, SEEK_DATA) == -1);
+    assert(rseek(fd, -1, SEEK_DATA) == -1);
+    RamfsStat st;
+    assert(rfstat(fd, &st) == 0 && st.size == 8 * 4096 && st.allocated == 3 * 4096);
+    //a hole reads as zeros
+    char out[8];
+    assert(rpread(fd, out, sizeof(out), 3 * 4096) == sizeof(out));
+    for (size_t i = 0; i < sizeof(out); i++) {
+        assert(out[i] == 0);
+    }
+    assert(rclose(fd) == 0 && runlink("/sparse") == 0);
+}
+
+#define LISTED 100
+#define CHURNERS 3
+
+static atomic_int listing;
+
+//creates and unlinks names next to the listed ones until the listing is over
+static void *churn_dir(void *arg) {
+    int id = (int) (long) arg;
+    char path[64];
+    for (int i = 0; atomic_load(&listing); i++) {
+        sprintf(path, "/rd/c%dx%d", id, i % 16);
+        int fd = ropen(path, O_CREAT | O_WRONLY);
+        assert(fd >= 0 && rclose(fd) == 0);
+        if (i % 2 == 0) {
+            assert(runlink(path) == 0);
+        }
+        sprintf(path, "/rd/c%dx%d", id, (i + 8) % 16);
+        runlink(path);
+    }
+    return NULL;
+}
+
+//listings running through a directory that changes under them return every entry that stays
+//exactly once; a name made again behind the cursor may come back, like with readdir
+static void check_readdir() {
+    char path[64];
+    assert(rmkdir("/rd") == 0);
+    for (int i = 0; i < LISTED; i++) {
+        sprintf(path, "/rd/s%d", i);
+        int fd = ropen(path, O_CREAT | O_WRONLY);
+        assert(fd >= 0 && rclose(fd) == 0);
+    }
+    atomic_store(&listing, 1);
+    pthread_t threads[CHURNERS];
+    for (long i = 0; i < CHURNERS; i++) {
+        assert(pthread_create(&threads[i], NULL, churn_dir, (void *) i) == 0);
+    }
+    for (int pass = 0; pass < 200; pass++) {
+        int seen[LISTED] = {0};
+        int fd = ropendir("/rd");
+        assert(fd >= 0);
+        RamfsDirent entries[7];
+        int n;
+        while ((n = rreaddir(fd, entries, 7)) > 0) {
+            for (int i = 0; i < n; i++) {
+                int a, b;
+                if (sscanf(entries[i].name, "s%d", &a) == 1) {
+                    assert(a >= 0 && a < LISTED && seen[a]++ == 0);
+                } else {
+                    assert(sscanf(entries[i].name, "c%dx%d", &a, &b) == 2 && a < CHURNERS && b < 16);
+                }
+            }
+        }
+        assert(n == 0 && rclosedir(fd) == 0);
+        for (int i = 0; i < LISTED; i++) {
+            assert(seen[i] == 1);
+        }
+    }
+    atomic_store(&listing, 0);
+    for (int i = 0; i < CHURNERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < CHURNERS; i++) {
+        for (int j = 0; j < 16; j++) {
+            sprintf(path, "/rd/c%dx%d", i, j);
+            runlink(path);
+        }
+    }
+    for (int i = 0; i < LISTED; i++) {
+        sprintf(path, "/rd/s%d", i);
+        assert(runlink(path) == 0);
+    }
+    assert(rrmdir("/rd") == 0);
+}
+
+#define CRASH_CHECKPOINT "/tmp/ramfs_stress.ckpt"
+#define CRASH_JOURNAL "/tmp/ramfs_stress.jnl"
+
+//a process killed without shutting down leaves its synced changes in the journal; recovery
+//replays them on top of the checkpoint, cuts off a torn last record and keeps journaling after it
+static void check_journal() {
+    unlink(CRASH_CHECKPOINT);
+    unlink(CRASH_JOURNAL);
+    static char data[5000];
+    memset(data, 'j', sizeof(data));
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(ramfs_durability(CRASH_CHECKPOINT, CRASH_JOURNAL, RAMFS_DURABILITY_SYNC) == 0);
+        assert(rmkdir("/jd") == 0);
+        int fd = ropen("/jd/kept", O_CREAT | O_WRONLY);
+        assert(fd >= 0 && rwrite(fd, data, sizeof(data)) == sizeof(data) && rclose(fd) == 0);
+        assert(rcheckpoint(CRASH_CHECKPOINT) == 0);
+        fd = ropen("/jd/after", O_CREAT | O_WRONLY);
+        assert(fd >= 0 && rwrite(fd, "after", 5) == 5);
+        assert(rftruncate(fd, 3) == 0);
+        assert(rpwrite(fd, "torn", 4, 0) == 4);
+        //dies with the descriptor open and nothing closed
+        _exit(3);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 3);
+    //the last record loses its final bytes
+    struct stat st;
+    assert(stat(CRASH_JOURNAL, &st) == 0 && truncate(CRASH_JOURNAL, st.st_size - 2) == 0);
+    assert(ramfs_durability(CRASH_CHECKPOINT, CRASH_JOURNAL, RAMFS_DURABILITY_SYNC) == 0);
+    char out[sizeof(data)];
+    RamfsStat rst;
+    int fd = ropen("/jd/kept", O_RDONLY);
+    assert(fd >= 0 && rread(fd, out, sizeof(out)) == sizeof(data) && memcmp(out, data, sizeof(data)) == 0);
+    assert(rclose(fd) == 0);
+    fd = ropen("/jd/after", O_RDWR);
+    assert(fd >= 0 && rfstat(fd, &rst) == 0 && rst.size == 3);
+    assert(rread(fd, out, sizeof(out)) == 3 && memcmp(out, "aft", 3) == 0);
+    //appended behind the cut, replayed by the next recovery
+    assert(rpwrite(fd, "new", 3, 3) == 3 && rclose(fd) == 0);
+    assert(init_ramfs() == 0);
+    fd = ropen("/jd/after", O_RDONLY);
+    assert(fd >= 0 && rread(fd, out, sizeof(out)) == 6 && memcmp(out, "aftnew", 6) == 0);
+    assert(rclose(fd) == 0);
+    assert(ramfs_durability(NULL, NULL, RAMFS_DURABILITY_NONE) == 0);
+    assert(rstat("/jd", &rst) == -1);
+    unlink(CRASH_CHECKPOINT);
+    unlink(CRASH_JOURNAL);
+}
+
+//files with equal blocks share them; overwriting one copy takes it private and drops exactly one
+//reference, the other files keep the shared content
+static void check_dedup() {
+    static char data[2 * 4096], out[2 * 4096];
+    char path[64];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char) (i * 31 + i / 4096);
+    }
+    ramfs_dedup(1);
+    for (int i = 0; i < 3; i++) {
+        sprintf(path, "/dd%d", i);
+        int fd = ropen(path, O_CREAT | O_WRONLY);
+        assert(fd >= 0 && rwrite(fd, data, sizeof(data)) == sizeof(data) && rclose(fd) == 0);
+    }
+    RamfsDedupStats stats;
+    ramfs_dedup_stats(&stats);
+    assert(stats.blocks == 2 && stats.references == 6 && stats.merged == 4);
+    //the first block of the middle file, partly written, stays out of the index
+    int fd = ropen("/dd1", O_WRONLY);
+    assert(fd >= 0 && rpwrite(fd, "!", 1, 10) == 1 && rclose(fd) == 0);
+    ramfs_dedup_stats(&stats);
+    assert(stats.blocks == 2 && stats.references == 5 && stats.saved_bytes == 3 * 4096);
+    for (int i = 0; i < 3; i++) {
+        sprintf(path, "/dd%d", i);
+        fd = ropen(path, O_RDONLY);
+        assert(fd >= 0 && rread(fd, out, sizeof(out)) == sizeof(out) && rclose(fd) == 0);
+        assert(memcmp(out + 11, data + 11, sizeof(data) - 11) == 0 && memcmp(out, data, 10) == 0);
+        assert(out[10] == (i == 1 ? '!' : data[10]));
+    }
+    //the last files holding the first block take it out of the index once they write it too
+    for (int i = 0; i < 3; i += 2) {
+        sprintf(path, "/dd%d", i);
+        fd = ropen(path, O_WRONLY);
+        assert(fd >= 0 && rpwrite(fd, "?", 1, 10) == 1 && rclose(fd) == 0);
+    }
+    ramfs_dedup_stats(&stats);
+    assert(stats.blocks == 1 && stats.references == 3);
+    for (int i = 0; i < 3; i++) {
+        sprintf(path, "/dd%d", i);
+        assert(runlink(path) == 0);
+    }
+    ramfs_dedup(0);
+    //another instance indexes its own blocks, the default index does not see them
+    Ramfs *other = ramfs_create();
+    assert(other != NULL);
+    rfs_dedup(other, 1);
+    for (int i = 0; i < 2; i++) {
+        sprintf(path, "/dd%d", i);
+        fd = rfs_open(other, path, O_CREAT | O_WRONLY);
+        assert(fd >= 0 && rfs_write(other, fd, data, sizeof(data)) == sizeof(data) && rfs_close(other, fd) == 0);
+    }
+    RamfsDedupStats own;
+    rfs_dedup_stats(other, &own);
+    assert(own.blocks == 2 && own.references == 4 && own.merged == 2);
+    ramfs_dedup_stats(&stats);
+    assert(stats.merged == 4);
+    ramfs_destroy(other);
+}
+
+#define SPILL_PATH "/tmp/ramfs_stress.spill"
+#define SPILL_FILES 16
+#define SPILL_FILE_SIZE (64 * 1024)
+
+//under a budget of a few files the rest is paged out, and every file reads back as written,
+//also after a write into a paged out block
+static void check_spill() {
+    static char data[SPILL_FILE_SIZE], out[SPILL_FILE_SIZE];
+    char path[64];
+    unlink(SPILL_PATH);
+    assert(ramfs_memory_budget(4 * SPILL_FILE_SIZE, SPILL_PATH) == 0);
+    for (int i = 0; i < SPILL_FILES; i++) {
+        for (int j = 0; j < SPILL_FILE_SIZE; j++) {
+            data[j] = (char) (i * 7 + j * 3 + j / 4096);
+        }
+        sprintf(path, "/sp%d", i);
+        int fd = ropen(path, O_CREAT | O_WRONLY);
+        assert(fd >= 0 && rwrite(fd, data, SPILL_FILE_SIZE) == SPILL_FILE_SIZE && rclose(fd) == 0);
+    }
+    static RamfsStats stats;
+    for (int wait = 0; wait < 500; wait++) {
+        ramfs_stats(&stats);
+        if (stats.block_bytes <= 4 * SPILL_FILE_SIZE) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert(stats.block_bytes <= 4 * SPILL_FILE_SIZE && stats.spilled_bytes >= (SPILL_FILES - 4) * SPILL_FILE_SIZE);
+    for (int i = 0; i < SPILL_FILES; i++) {
+        for (int j = 0; j < SPILL_FILE_SIZE; j++) {
+            data[j] = (char) (i * 7 + j * 3 + j / 4096);
+        }
+        sprintf(path, "/sp%d", i);
+        int fd = ropen(path, O_RDWR);
+        assert(fd >= 0 && rread(fd, out, SPILL_FILE_SIZE) == SPILL_FILE_SIZE);
+        assert(memcmp(out, data, SPILL_FILE_SIZE) == 0);
+        //a write into the middle of a block keeps the bytes around it
+        assert(rpwrite(fd, "spill", 5, 4096 + 100) == 5);
+        assert(rpread(fd, out, 4096, 4096) == 4096 && memcmp(out + 100, "spill", 5) == 0);
+        assert(memcmp(out, data + 4096, 100) == 0 && memcmp(out + 105, data + 4096 + 105, 4096 - 105) == 0);
+        assert(rclose(fd) == 0);
+    }
+    assert(ramfs_memory_budget(0, NULL) == 0);
+    for (int i = 0; i < SPILL_FILES; i++) {
+        sprintf(path, "/sp%d", i);
+        assert(runlink(path) == 0);
+    }
+    unlink(SPILL_PATH);
+}
+
+#define SHARE_PATH "/tmp/ramfs_stress.img"
+
+//a file another process commits is seen after a refresh, which waits for the descriptors of the old tree;
+//every instance joins the image with a state of its own
+static void check_share() {
+    static char out[64];
+    unlink(SHARE_PATH);
+    unlink(SHARE_PATH ".lock");
+    assert(ramfs_share(SHARE_PATH) == 0 && rshare_refresh() == 0);
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        //the child joins with a lock descriptor of its own and publishes a file
+        int fd = -1;
+        int ok = ramfs_share(SHARE_PATH) == 0 && rshare_begin() == 0 &&
+                 (fd = ropen("/forked", O_CREAT | O_WRONLY)) >= 0 && rwrite(fd, "from the child", 14) == 14 &&
+                 rclose(fd) == 0 && rshare_commit() == 0;
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    RamfsStat st;
+    assert(rstat("/forked", &st) == -1);
+    int fd = ropendir("/");
+    assert(fd >= 0 && rshare_refresh() == -1 && errno == EBUSY && rclosedir(fd) == 0);
+    assert(rshare_refresh() == 1 && rshare_refresh() == 0);
+    fd = ropen("/forked", O_RDONLY);
+    assert(fd >= 0 && rread(fd, out, sizeof(out)) == 14 && memcmp(out, "from the child", 14) == 0);
+    assert(rclose(fd) == 0);
+    //another instance joins on its own and restores the same tree
+    Ramfs *other = ramfs_create();
+    assert(other != NULL && rfs_share(other, SHARE_PATH) == 0);
+    assert(rfs_stat(other, "/forked", &st) == 0 && st.size == 14);
+    ramfs_destroy(other);
+    assert(ramfs_share(NULL) == 0 && runlink("/forked") == 0);
+    unlink(SHARE_PATH);
+    unlink(SHARE_PATH ".lock");
+}
+
+int main() {
+    assert(init_ramfs() == 0);
+    check_lookups();
+    check_mmap();
+    check_vectored();
+    check_sparse();
+    check_readdir();
+    check_journal();
+    check_dedup();
+    check_spill();
+    check_share();
+    //the compression thread packs whatever the workers leave alone for a millisecond
+    assert(ramfs_compress(1) == 0);
+    pthread_t threads[THREADS];
+    for (long i = 0; i < THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, worker, (void *) i) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    //chains queued on a worker pool complete once each, every descriptor they open is closed
+    RamfsAio *aio = raio_create(4);
+    assert(aio != NULL);
+    static RamfsSubmission ops[AIO_CHAINS][3];
+    static char names[AIO_CHAINS][16];
+    memset(ops, 0, sizeof(ops));
+    for (long i = 0; i < AIO_CHAINS; i++) {
+        sprintf(names[i], "/a%ld", i);
+        ops[i][0].op = RAMFS_SUBMIT_OPEN;
+        ops[i][0].flags = RAMFS_SUBMIT_LINK;
+        ops[i][0].path = names[i];
+        ops[i][0].open_flags = O_CREAT | O_WRONLY;
+        ops[i][1].op = RAMFS_SUBMIT_WRITE;
+        ops[i][1].flags = RAMFS_SUBMIT_LINK;
+        ops[i][1].fd = RAMFS_FD_LINKED;
+        ops[i][1].buf = names[i];
+        ops[i][1].count = sizeof(names[i]);
+        ops[i][1].offset = -1;
+        ops[i][2].op = RAMFS_SUBMIT_CLOSE;
+        ops[i][2].fd = RAMFS_FD_LINKED;
+        assert(raio_submit(aio, ops[i], 3, (void *) i) == 0);
+    }
+    static int completed[AIO_CHAINS];
+    RamfsCompletion completions[16];
+    for (int done = 0; done < AIO_CHAINS;) {
+        int n = raio_wait(aio, completions, 16);
+        assert(n > 0);
+        for (int i = 0; i < n; i++) {
+            long id = (long) completions[i].user_data;
+            assert(completions[i].ops == ops[id] && completions[i].result == 3);
+            assert(completed[id]++ == 0);
+        }
+        done += n;
+    }
+    assert(raio_poll(aio, completions, 16) == 0);
+    raio_destroy(aio);
+    for (int i = 0; i < AIO_CHAINS; i++) {
+        assert(runlink(names[i]) == 0);
+    }
+    //instances work next to the default tree without touching it or its counters
+    static RamfsStats before;
+    ramfs_stats(&before);
+    for (int i = 0; i < INSTANCES / 2; i++) {
+        pairs[i] = ramfs_create();
+        assert(pairs[i] != NULL);
+    }
+    for (long i = 0; i < INSTANCES; i++) {
+        assert(pthread_create(&threads[i], NULL, instance_worker, (void *) i) == 0);
+    }
+    for (int i = 0; i < INSTANCES; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < INSTANCES / 2; i++) {
+        RamfsStat st;
+        assert(rfs_stat(pairs[i], "/log", &st) == 0 && st.size == 2 * (ROUNDS / 4) * 8);
+        //the counters of an instance are its own
+        static RamfsStats own;
+        rfs_stats(pairs[i], &own);
+        assert(own.files == 1 && own.open_fds == 0 && own.ops[RAMFS_OP_OPEN].calls == 2 * (ROUNDS / 4));
+        ramfs_destroy(pairs[i]);
+    }
+    static RamfsStats after;
+    ramfs_stats(&after);
+    assert(after.files == before.files && after.ops[RAMFS_OP_OPEN].calls == before.ops[RAMFS_OP_OPEN].calls);
+    assert(ropen("/log", O_RDONLY) == -1);
+    //private trees are intact, every open descriptor was closed
+    char path[64];
+    for (int i = 0; i < THREADS; i++) {
+        for (int j = 0; j < 32; j++) {
+            sprintf(path, "/t%d/f%d", i, j);
+            runlink(path);
+        }
+        for (int j = 0; j < 8; j++) {
+            sprintf(path, "/t%d/d%d", i, j);
+            rrmdir(path);
+        }
+        sprintf(path, "/t%d", i);
+        assert(rrmdir(path) == 0);
+    }
+    for (int i = 0; i < SHARED; i++) {
+        sprintf(path, "/s%d", i);
+        runlink(path);
+        assert(ropen(path, O_RDONLY) == -1);
+    }
+    //the gauges summed over every thread's counters are back to an empty tree
+    static RamfsStats stats;
+    ramfs_stats(&stats);
+    assert(stats.files == 0 && stats.directories == 1 && stats.open_fds == 0);
+    assert(stats.ops[RAMFS_OP_OPEN].calls > THREADS * ROUNDS);
+    puts("true");
+}